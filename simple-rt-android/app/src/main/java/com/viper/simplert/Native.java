@@ -19,7 +19,8 @@
 package com.viper.simplert;
 
 public class Native {
-    static native void start(int tun_fd, int acc_fd);
+    static native void start(int tun_fd, int acc_fd, boolean is_framed, boolean is_lz4, int mtu,
+            boolean has_ctrl);
     static native void stop();
     static native boolean is_running();
 
@@ -29,6 +29,7 @@ import android.net.ConnectivityManager;
 import android.net.LinkAddress;
 import android.net.LinkProperties;
 import android.net.Network;
+import android.net.Uri;
 import android.net.VpnService;
 import android.os.Build;
 import android.os.ParcelFileDescriptor;
@@ -93,6 +94,45 @@ public class TetherService extends VpnService {
             prefixLength = 24;
         }
 
+        /* host options are passed as uri query, old hosts send none */
+        boolean isFramed = false;
+        boolean isLz4 = false;
+        boolean hasCtrl = false;
+        int mtu = 1500;
+        if (accessory.getUri() != null) {
+            Uri uri = Uri.parse(accessory.getUri());
+            isFramed = "1".equals(uri.getQueryParameter("frame"));
+            isLz4 = "1".equals(uri.getQueryParameter("lz4"));
+            /* host pings over framed transfers and drops us if we stop answering */
+            hasCtrl = isFramed && "1".equals(uri.getQueryParameter("ctrl"));
+
+            /* host subnet may be wider than /24 */
+            String prefix = uri.getQueryParameter("prefix");
+            if (prefix != null && tokens.length == 2) {
+                try {
+                    int len = Integer.parseInt(prefix);
+                    if (len >= 16 && len <= 30) {
+                        prefixLength = len;
+                    }
+                } catch (NumberFormatException e) {
+                    Log.w(TAG, "Bad prefix length: " + prefix);
+                }
+            }
+
+            /* jumbo mtu is confirmed to host in framed transfers only */
+            String hostMtu = uri.getQueryParameter("mtu");
+            if (hostMtu != null && isFramed) {
+                try {
+                    int val = Integer.parseInt(hostMtu);
+                    if (val >= 576 && val <= 16000) {
+                        mtu = val;
+                    }
+                } catch (NumberFormatException e) {
+                    Log.w(TAG, "Bad mtu: " + hostMtu);
+                }
+            }
+        }
+
         Log.d(TAG, "Got accessory: " + accessory.getModel());
 
         IntentFilter filter = new IntentFilter(ACTION_USB_PERMISSION);
@@ -100,7 +140,7 @@ public class TetherService extends VpnService {
         registerReceiver(mUsbReceiver, filter);
 
         Builder builder = new Builder();
-        builder.setMtu(1500);
+        builder.setMtu(mtu);
         if (Build.VERSION.SDK_INT >= 21) {
             builder.allowBypass();
         }
@@ -124,7 +164,7 @@ public class TetherService extends VpnService {
         }
 
         Toast.makeText(this, "SimpleRT Connected!", Toast.LENGTH_SHORT).show();
-        Native.start(tunFd.detachFd(), accessoryFd.detachFd());
+        Native.start(tunFd.detachFd(), accessoryFd.detachFd(), isFramed, isLz4, mtu, hasCtrl);
 
         setAsUnderlyingNetwork(ipAddr + "/" + prefixLength);
 
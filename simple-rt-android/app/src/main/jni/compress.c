@@ -0,0 +1,259 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "compress.h"
+
+#define LZ_HASH_BITS        12
+#define LZ_MIN_MATCH        4
+#define LZ_LAST_LITERALS    5
+#define LZ_MFLIMIT          12
+#define LZ_MAX_OFFSET       65535
+
+/* sampled bytes and distinct values among them above which data is noise */
+#define ENTROPY_SAMPLES     128
+#define ENTROPY_MAX_DISTINCT 96
+
+/* ip and tcp headers are skipped, they always compress somewhat */
+#define ENTROPY_SKIP        40
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint32_t lz_hash(uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* literal or match length continuation bytes */
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+
+    *op++ = len;
+
+    return op;
+}
+
+static uint8_t *put_literals(uint8_t *op, uint8_t *oend, uint8_t token_low,
+        const uint8_t *lit, size_t lit_len)
+{
+    if ((size_t) (oend - op) < 1 + lit_len / 255 + 1 + lit_len) {
+        return NULL;
+    }
+
+    *op++ = (lit_len >= 15 ? 15 : lit_len) << 4 | token_low;
+
+    if (lit_len >= 15) {
+        op = put_length(op, lit_len - 15);
+    }
+
+    memcpy(op, lit, lit_len);
+
+    return op + lit_len;
+}
+
+size_t lz_compress(const uint8_t *src, size_t size,
+        uint8_t *dst, size_t dst_size)
+{
+    uint16_t table[1 << LZ_HASH_BITS] = { 0 };
+    uint8_t *op = dst, *oend = dst + dst_size;
+    size_t ip = 0, anchor = 0, ref, mlen;
+    uint32_t seq, h;
+
+    if (size > LZ_MAX_OFFSET) {
+        return 0;
+    }
+
+    /* last match must start 12 bytes before end, last 5 are literals */
+    while (size >= LZ_MFLIMIT + 1 && ip < size - LZ_MFLIMIT) {
+        seq = read32(src + ip);
+        h = lz_hash(seq);
+        ref = table[h];
+        table[h] = ip;
+
+        if (ref >= ip || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        mlen = LZ_MIN_MATCH;
+        while (ip + mlen < size - LZ_LAST_LITERALS &&
+                src[ref + mlen] == src[ip + mlen]) {
+            mlen++;
+        }
+
+        if ((op = put_literals(op, oend, mlen - LZ_MIN_MATCH >= 15 ?
+                        15 : mlen - LZ_MIN_MATCH,
+                        src + anchor, ip - anchor)) == NULL ||
+                oend - op < 2 + (ptrdiff_t) (mlen / 255 + 1)) {
+            return 0;
+        }
+
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+
+        if (mlen - LZ_MIN_MATCH >= 15) {
+            op = put_length(op, mlen - LZ_MIN_MATCH - 15);
+        }
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    if ((op = put_literals(op, oend, 0, src + anchor, size - anchor)) == NULL) {
+        return 0;
+    }
+
+    return op - dst;
+}
+
+ssize_t lz_decompress(const uint8_t *src, size_t size,
+        uint8_t *dst, size_t dst_size)
+{
+    const uint8_t *ip = src, *iend = src + size;
+    uint8_t *op = dst, *oend = dst + dst_size;
+    size_t len, offset;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        if ((len = token >> 4) == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                len += *ip;
+            } while (*ip++ == 255);
+        }
+
+        if ((size_t) (iend - ip) < len || (size_t) (oend - op) < len) {
+            return -1;
+        }
+
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        /* block ends with literals */
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        if (offset == 0 || offset > (size_t) (op - dst)) {
+            return -1;
+        }
+
+        if ((len = token & 0xf) == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                len += *ip;
+            } while (*ip++ == 255);
+        }
+
+        len += LZ_MIN_MATCH;
+
+        if ((size_t) (oend - op) < len) {
+            return -1;
+        }
+
+        /* match may overlap output, copy byte by byte */
+        for (const uint8_t *m = op - offset; len; len--) {
+            *op++ = *m++;
+        }
+    }
+
+    return op - dst;
+}
+
+bool is_compressible(const uint8_t *data, size_t size)
+{
+    uint64_t seen[4] = { 0 };
+    size_t distinct = 0, samples;
+
+    if (size < COMPRESS_MIN_SIZE) {
+        return false;
+    }
+
+    data += ENTROPY_SKIP;
+    size -= ENTROPY_SKIP;
+    samples = size < ENTROPY_SAMPLES ? size : ENTROPY_SAMPLES;
+
+    for (size_t i = 0; i < samples; i++) {
+        uint8_t b = data[i * size / samples];
+
+        if (!(seen[b >> 6] & (1ull << (b & 63)))) {
+            seen[b >> 6] |= 1ull << (b & 63);
+            distinct++;
+        }
+    }
+
+    return distinct * ENTROPY_SAMPLES <= ENTROPY_MAX_DISTINCT * samples;
+}
+
+static inline uint64_t get_cpu_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t compress_packet(compress_stats_t *stats, const uint8_t *src,
+        size_t size, uint8_t *dst, size_t dst_size)
+{
+    uint64_t start;
+    size_t ret;
+
+    if (!is_compressible(src, size)) {
+        stats->skipped++;
+        return 0;
+    }
+
+    start = get_cpu_time_ns();
+
+    /* must gain something, else peer would decompress for nothing */
+    ret = lz_compress(src, size, dst, dst_size < size ? dst_size : size - 1);
+
+    stats->cpu_ns += get_cpu_time_ns() - start;
+    stats->packets++;
+    stats->bytes_in += size;
+    stats->bytes_out += ret ? ret : size;
+
+    return ret;
+}
@@ -0,0 +1,63 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * LZ4 block format, no frame header: packets are small and their size is
+ * known from the framed transfer. only blocks up to 64 KB are produced.
+ *
+ * Keep in sync with simple-rt-cli/src/compress.c
+ */
+
+/* smaller packets are not worth it */
+#define COMPRESS_MIN_SIZE 128
+
+/* worst case output size */
+#define COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+typedef struct compress_stats_t {
+    uint64_t packets;
+    uint64_t skipped;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cpu_ns;
+} compress_stats_t;
+
+/* 0 if output doesn't fit into dst_size */
+size_t lz_compress(const uint8_t *src, size_t size,
+        uint8_t *dst, size_t dst_size);
+
+/* -1 on malformed input or if output doesn't fit into dst_size */
+ssize_t lz_decompress(const uint8_t *src, size_t size,
+        uint8_t *dst, size_t dst_size);
+
+/* cheap entropy estimate, false for already compressed or encrypted data */
+bool is_compressible(const uint8_t *data, size_t size);
+
+/* compressed size if it's worth it, 0 if packet should go as is */
+size_t compress_packet(compress_stats_t *stats, const uint8_t *src,
+        size_t size, uint8_t *dst, size_t dst_size);
+
+#endif
@@ -20,10 +20,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <android/log.h>
 
+#include "compress.h"
+
 #define LOG_TAG "SIMPLE_RT_JNI"
 
 #define DPRINTF(level, fmt, args...) \
@@ -37,82 +43,563 @@
 #define LOGW(fmt, args...) DPRINTF(ANDROID_LOG_WARN, fmt, ##args)
 #define LOGE(fmt, args...) DPRINTF(ANDROID_LOG_ERROR, fmt, ##args)
 
+/* relay counters, each one has single writer thread */
+typedef struct relay_stats_t {
+    unsigned long long tun_packets;
+    unsigned long long tun_batches;
+    unsigned long long acc_packets;
+    unsigned long long acc_transfers;
+    unsigned long long tun_dropped;
+} relay_stats_t;
+
 static struct {
     pthread_t tun_thread;
     pthread_t acc_thread;
     int tun_fd;
     int acc_fd;
+    /* stop() wakes tun thread out of poll */
+    int wake_fds[2];
+    bool is_framed;
+    bool is_lz4;
+    /* host pings, pongs are written by accessory thread */
+    bool has_ctrl;
+    unsigned int mtu;
+    compress_stats_t lz_stats;
+    relay_stats_t stats;
+    /* both threads write accessory, transfers must not interleave */
+    pthread_mutex_t acc_lock;
+    /* last thread out closes fds, the other one may still use them */
+    atomic_int threads;
+    /* threads of last start, joined by stop() or next start() */
+    bool is_joinable;
     volatile bool is_started;
 } module;
 
+/* tun thread is woken by stop(), accessory thread by detach */
 enum ThreadType {
     TUN_THREAD = 0,
     ACC_THREAD = 1,
 };
 
-#define ACC_BUF_SIZE 4096
+/* tun mtu is set by host, see -M there */
+#define DEFAULT_MTU 1500
+#define MAX_MTU 16000
+
+/* framed transfers, keep in sync with simple-rt-cli/include/framing.h */
+#define FRAME_MAGIC             0x53
+#define FRAME_VERSION           1
+#define FRAME_BATCH_HDR_SIZE    4
+#define FRAME_HDR_SIZE          4
+#define FRAME_BATCH_SIZE        16384
+#define FRAME_PAD_ALIGN         64
+#define FRAME_TYPE_DATA         0
+#define FRAME_TYPE_CAPS         1
+#define FRAME_TYPE_CTRL         2
+#define FRAME_FLAG_LZ4          0x01
+#define FRAME_CAP_LZ4           0x01
+#define FRAME_CAP_MTU           0x02
+#define FRAME_CAP_CTRL          0x04
+#define CTRL_PING               1
+#define CTRL_PONG               2
+#define CTRL_PING_SIZE          12
+#define CTRL_STATS              5
+#define CTRL_PONG_SIZE          (CTRL_PING_SIZE + CTRL_STATS * 8)
+
+/* relay buffers live as long as the library, nothing is allocated per run */
+static struct {
+    uint8_t batch[FRAME_BATCH_SIZE];
+    uint8_t pkt[MAX_MTU];
+} tun_arena;
+
+static struct {
+    uint8_t transfer[FRAME_BATCH_SIZE];
+    uint8_t pkt[FRAME_BATCH_SIZE];
+    uint8_t pong[FRAME_BATCH_HDR_SIZE + FRAME_HDR_SIZE + CTRL_PONG_SIZE + 1];
+} acc_arena;
 
 jint JNI_OnLoad(JavaVM *jvm, void *reserved)
 {
     LOGV(__func__);
 
     module.is_started = false;
+    module.wake_fds[0] = -1;
+    module.wake_fds[1] = -1;
     return JNI_VERSION_1_6;
 }
 
-void *thread_proc(void *arg)
+static inline void put_be16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val & 0xff;
+}
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+    return (uint16_t) (p[0] << 8) | p[1];
+}
+
+static inline void put_be64(uint8_t *p, uint64_t val)
+{
+    for (int i = 0; i < 8; i++) {
+        p[i] = val >> (56 - 8 * i);
+    }
+}
+
+/* false when relay is stopping or fd failed */
+static bool wait_fd(int fd, short events)
+{
+    struct pollfd pfds[2] = {
+        { .fd = fd, .events = events },
+        { .fd = module.wake_fds[0], .events = POLLIN },
+    };
+
+    while (module.is_started) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("poll failed: %s", strerror(errno));
+            return false;
+        }
+
+        if (pfds[1].revents) {
+            return false;
+        }
+
+        if (pfds[0].revents & (POLLERR | POLLNVAL)) {
+            return false;
+        }
+
+        if (pfds[0].revents) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* tun is nonblocking: -1 with EAGAIN when it has nothing more now */
+static ssize_t read_tun_packet(uint8_t *buf, size_t size)
 {
-    char buf[ACC_BUF_SIZE] = { 0 };
     ssize_t rd;
-    int in_fd, out_fd;
 
-    enum ThreadType thread_type = (enum ThreadType) arg;
+    while ((rd = read(module.tun_fd, buf, size)) < 0 && errno == EINTR) {
+    }
 
-    if (thread_type == TUN_THREAD) {
-        in_fd = module.tun_fd;
-        out_fd = module.acc_fd;
-    } else {
-        in_fd = module.acc_fd;
-        out_fd = module.tun_fd;
+    return rd;
+}
+
+/* one packet per write, bad packet is dropped, false only if relay stops */
+static bool write_tun_packet(const uint8_t *data, size_t len)
+{
+    ssize_t wr;
+
+    while (true) {
+        if ((wr = write(module.tun_fd, data, len)) == (ssize_t) len) {
+            module.stats.acc_packets++;
+            return true;
+        }
+
+        if (wr < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (wr < 0 && errno == EAGAIN) {
+            if (!wait_fd(module.tun_fd, POLLOUT)) {
+                return false;
+            }
+            continue;
+        }
+
+        /* tun never takes part of packet: bad one is dropped, closed tun stops */
+        module.stats.tun_dropped++;
+        return wr >= 0 || errno != EBADF;
+    }
+}
+
+/* accessory may take part of transfer, the rest follows */
+static bool write_acc(const uint8_t *data, size_t len)
+{
+    bool ret = true;
+    ssize_t wr;
+
+    pthread_mutex_lock(&module.acc_lock);
+
+    while (len) {
+        if ((wr = write(module.acc_fd, data, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("accessory write failed: %s", strerror(errno));
+            ret = false;
+            break;
+        }
+
+        data += wr;
+        len -= wr;
+    }
+
+    pthread_mutex_unlock(&module.acc_lock);
+
+    return ret;
+}
+
+/* write framed transfer into accessory, padded like host does */
+static bool write_batch(uint8_t *buf, size_t len, uint16_t count)
+{
+    put_be16(&buf[2], count);
+
+    if (len % FRAME_PAD_ALIGN == 0) {
+        buf[len++] = 0;
     }
 
+    module.stats.tun_batches++;
+
+    return write_acc(buf, len);
+}
+
+/* first batch tells host we speak framed transfers, and what else */
+static bool write_caps(uint8_t *buf)
+{
+    size_t len = FRAME_BATCH_HDR_SIZE;
+    uint16_t count = 0;
+
+    buf[0] = FRAME_MAGIC;
+    buf[1] = FRAME_VERSION;
+
+    if (module.is_lz4 || module.mtu != DEFAULT_MTU || module.has_ctrl) {
+        uint8_t caps = (module.is_lz4 ? FRAME_CAP_LZ4 : 0) |
+            (module.has_ctrl ? FRAME_CAP_CTRL : 0);
+
+        put_be16(&buf[len], 0);
+        buf[len + 2] = FRAME_TYPE_CAPS;
+
+        if (module.mtu != DEFAULT_MTU) {
+            caps |= FRAME_CAP_MTU;
+            put_be16(&buf[len], 2);
+            put_be16(&buf[len + FRAME_HDR_SIZE], module.mtu);
+        }
+
+        buf[len + 3] = caps;
+        len += FRAME_HDR_SIZE + get_be16(&buf[len]);
+        count++;
+    }
+
+    return write_batch(buf, len, count);
+}
+
+/*
+ * tun -> accessory: tun is drained into one batch until it has nothing
+ * more or batch is full, then batch goes out in one write
+ */
+static void tun_to_acc_framed(void)
+{
+    uint8_t *buf = tun_arena.batch;
+    uint8_t *pkt = tun_arena.pkt;
+    size_t len, lz_len;
+    uint16_t count;
+    ssize_t rd = 0;
+
+    if (!write_caps(buf)) {
+        return;
+    }
+
+    while (wait_fd(module.tun_fd, POLLIN)) {
+        len = FRAME_BATCH_HDR_SIZE;
+        count = 0;
+
+        /* keep room for padding */
+        while (sizeof(tun_arena.batch) - len >=
+                FRAME_HDR_SIZE + module.mtu + 1) {
+            uint8_t *frame = &buf[len];
+
+            rd = read_tun_packet(module.is_lz4 ? pkt : &frame[FRAME_HDR_SIZE],
+                    module.is_lz4 ? sizeof(tun_arena.pkt) :
+                    sizeof(tun_arena.batch) - len - FRAME_HDR_SIZE - 1);
+            if (rd <= 0) {
+                break;
+            }
+
+            frame[2] = FRAME_TYPE_DATA;
+            frame[3] = 0;
+
+            /* room for packet is always there, see loop condition */
+            if (module.is_lz4) {
+                if ((lz_len = compress_packet(&module.lz_stats, pkt, rd,
+                                &frame[FRAME_HDR_SIZE], rd)) != 0) {
+                    rd = lz_len;
+                    frame[3] = FRAME_FLAG_LZ4;
+                } else {
+                    memcpy(&frame[FRAME_HDR_SIZE], pkt, rd);
+                }
+            }
+
+            put_be16(&frame[0], rd);
+
+            len += FRAME_HDR_SIZE + rd;
+            count++;
+        }
+
+        module.stats.tun_packets += count;
+
+        if (count && !write_batch(buf, len, count)) {
+            break;
+        }
+
+        if (rd == 0 || (rd < 0 && errno != EAGAIN)) {
+            LOGE("tun read failed: %s", rd ? strerror(errno) : "eof");
+            break;
+        }
+    }
+
+    if (module.lz_stats.packets) {
+        LOGI("lz4: %llu -> %llu bytes, %llu packets skipped, %llu ns per packet",
+                (unsigned long long) module.lz_stats.bytes_in,
+                (unsigned long long) module.lz_stats.bytes_out,
+                (unsigned long long) module.lz_stats.skipped,
+                (unsigned long long) (module.lz_stats.cpu_ns /
+                    module.lz_stats.packets));
+    }
+}
+
+/* tun -> accessory, old host: one packet per transfer */
+static void tun_to_acc_raw(void)
+{
+    uint8_t *pkt = tun_arena.pkt;
+    ssize_t rd;
+
+    while (wait_fd(module.tun_fd, POLLIN)) {
+        while ((rd = read_tun_packet(pkt, sizeof(tun_arena.pkt))) > 0) {
+            module.stats.tun_packets++;
+            module.stats.tun_batches++;
+
+            if (!write_acc(pkt, rd)) {
+                return;
+            }
+        }
+
+        if (rd == 0 || errno != EAGAIN) {
+            LOGE("tun read failed: %s", rd ? strerror(errno) : "eof");
+            return;
+        }
+    }
+}
+
+/*
+ * ping of host is echoed right away with our counters, host measures
+ * rtt and drops us if pongs stop. counters of tun thread are read racy,
+ * they are statistics only.
+ */
+static bool write_pong(const uint8_t *ping)
+{
+    uint8_t *buf = acc_arena.pong;
+    uint8_t *frame = &buf[FRAME_BATCH_HDR_SIZE];
+    uint8_t *stats = &frame[FRAME_HDR_SIZE + CTRL_PING_SIZE];
+    size_t len = FRAME_BATCH_HDR_SIZE + FRAME_HDR_SIZE + CTRL_PONG_SIZE;
+
+    buf[0] = FRAME_MAGIC;
+    buf[1] = FRAME_VERSION;
+    put_be16(&buf[2], 1);
+
+    put_be16(&frame[0], CTRL_PONG_SIZE);
+    frame[2] = FRAME_TYPE_CTRL;
+    frame[3] = CTRL_PONG;
+    memcpy(&frame[FRAME_HDR_SIZE], ping, CTRL_PING_SIZE);
+
+    put_be64(&stats[0], module.stats.tun_packets);
+    put_be64(&stats[8], module.stats.tun_batches);
+    put_be64(&stats[16], module.stats.acc_packets);
+    put_be64(&stats[24], module.stats.acc_transfers);
+    put_be64(&stats[32], module.stats.tun_dropped);
+
+    if (len % FRAME_PAD_ALIGN == 0) {
+        buf[len++] = 0;
+    }
+
+    return write_acc(buf, len);
+}
+
+/* splits framed transfer, its packets go to tun back to back */
+static bool write_framed_transfer(const uint8_t *buf, ssize_t rd)
+{
+    uint8_t *pkt = acc_arena.pkt;
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + rd;
+
+    while (end - p >= FRAME_BATCH_HDR_SIZE && p[0] == FRAME_MAGIC) {
+        uint16_t count = get_be16(&p[2]);
+
+        p += FRAME_BATCH_HDR_SIZE;
+
+        for (uint16_t i = 0; i < count; i++) {
+            uint16_t frame_len;
+            bool ret = true;
+
+            if (end - p < FRAME_HDR_SIZE ||
+                    end - p - FRAME_HDR_SIZE < (frame_len = get_be16(p))) {
+                LOGE("Malformed framed transfer, size %zd", rd);
+                return true;
+            }
+
+            if (p[2] == FRAME_TYPE_DATA && (p[3] & FRAME_FLAG_LZ4)) {
+                ssize_t n = lz_decompress(&p[FRAME_HDR_SIZE], frame_len,
+                        pkt, sizeof(acc_arena.pkt));
+
+                if (n > 0) {
+                    ret = write_tun_packet(pkt, n);
+                } else {
+                    LOGE("Malformed compressed packet, size %u", frame_len);
+                }
+            } else if (p[2] == FRAME_TYPE_DATA) {
+                ret = write_tun_packet(&p[FRAME_HDR_SIZE], frame_len);
+            } else if (p[2] == FRAME_TYPE_CTRL && p[3] == CTRL_PING &&
+                    module.has_ctrl && frame_len >= CTRL_PING_SIZE) {
+                ret = write_pong(&p[FRAME_HDR_SIZE]);
+            }
+
+            if (!ret) {
+                return false;
+            }
+
+            p += FRAME_HDR_SIZE + frame_len;
+        }
+
+        /* skip padding */
+        while (p < end && *p == 0) {
+            p++;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * accessory -> tun. f_accessory has neither poll nor nonblocking io, so
+ * this thread blocks in read of whole transfers, detach wakes it up.
+ */
+static void acc_to_tun(void)
+{
+    uint8_t *buf = acc_arena.transfer;
+    ssize_t rd;
+
     while (module.is_started) {
-        if ((rd = read(in_fd, buf, sizeof(buf))) > 0) {
-            write(out_fd, buf, rd);
-        } else {
-            /* FIXME */
+        if ((rd = read(module.acc_fd, buf, sizeof(acc_arena.transfer))) < 0 &&
+                errno == EINTR) {
+            continue;
+        }
+
+        if (rd <= 0) {
+            LOGE("accessory read failed: %s", rd ? strerror(errno) : "eof");
+            break;
+        }
+
+        module.stats.acc_transfers++;
+
+        if (buf[0] != FRAME_MAGIC ? !write_tun_packet(buf, rd) :
+                !write_framed_transfer(buf, rd)) {
             break;
         }
     }
+}
+
+void *thread_proc(void *arg)
+{
+    enum ThreadType thread_type = (enum ThreadType) (intptr_t) arg;
+
+    if (thread_type == ACC_THREAD) {
+        acc_to_tun();
+    } else if (module.is_framed) {
+        tun_to_acc_framed();
+    } else {
+        tun_to_acc_raw();
+    }
 
+    /* other direction goes down too */
     module.is_started = false;
-    close(in_fd);
+    write(module.wake_fds[1], "", 1);
+
+    if (atomic_fetch_sub(&module.threads, 1) == 1) {
+        relay_stats_t *s = &module.stats;
+
+        LOGI("relay: tun -> acc %llu packets in %llu transfers, "
+                "acc -> tun %llu packets in %llu transfers, %llu dropped",
+                s->tun_packets, s->tun_batches,
+                s->acc_packets, s->acc_transfers, s->tun_dropped);
+
+        close(module.tun_fd);
+        close(module.acc_fd);
+        pthread_mutex_destroy(&module.acc_lock);
+    }
 
     return NULL;
 }
 
+/* threads of previous run are gone or going, wake pipe goes with them */
+static void join_threads(void)
+{
+    if (module.is_joinable) {
+        pthread_join(module.tun_thread, NULL);
+        pthread_join(module.acc_thread, NULL);
+        module.is_joinable = false;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (module.wake_fds[i] >= 0) {
+            close(module.wake_fds[i]);
+            module.wake_fds[i] = -1;
+        }
+    }
+}
+
 JNIEXPORT void JNICALL
-Java_com_viper_simplert_Native_start(JNIEnv *env, jclass type, jint tun_fd, jint acc_fd)
+Java_com_viper_simplert_Native_start(JNIEnv *env, jclass type, jint tun_fd, jint acc_fd,
+        jboolean is_framed, jboolean is_lz4, jint mtu, jboolean has_ctrl)
 {
-    LOGV("%s: tun_fd = %d, acc_fd = %d", __func__, tun_fd, acc_fd);
+    LOGV("%s: tun_fd = %d, acc_fd = %d, framed = %d, lz4 = %d, mtu = %d, "
+            "ctrl = %d", __func__, tun_fd, acc_fd, is_framed, is_lz4, mtu,
+            has_ctrl);
 
-    if (module.is_started) {
+    /* relay that died without stop() may still be on its way out */
+    if (module.is_started || atomic_load(&module.threads) != 0) {
         LOGE("Native threads already started!");
+        close(tun_fd);
+        close(acc_fd);
+        return;
+    }
+
+    join_threads();
+
+    if (pipe(module.wake_fds) < 0) {
+        LOGE("Unable to create wake pipe: %s", strerror(errno));
+        close(tun_fd);
+        close(acc_fd);
         return;
     }
 
     module.is_started = true;
     module.tun_fd = tun_fd;
     module.acc_fd = acc_fd;
+    module.is_framed = is_framed;
+    module.is_lz4 = is_framed && is_lz4;
+    module.has_ctrl = is_framed && has_ctrl;
+    pthread_mutex_init(&module.acc_lock, NULL);
+    module.mtu = mtu > 0 && mtu <= MAX_MTU ? mtu : DEFAULT_MTU;
+    memset(&module.lz_stats, 0, sizeof(module.lz_stats));
+    memset(&module.stats, 0, sizeof(module.stats));
+    atomic_store(&module.threads, 2);
 
+    /* tun is drained until EAGAIN, accessory blocks, see acc_to_tun() */
     int flags = fcntl(tun_fd, F_GETFL, 0);
-    fcntl(tun_fd, F_SETFL, flags & ~O_NONBLOCK);
+    fcntl(tun_fd, F_SETFL, flags | O_NONBLOCK);
 
     flags = fcntl(acc_fd, F_GETFL, 0);
     fcntl(acc_fd, F_SETFL, flags & ~O_NONBLOCK);
 
-    pthread_create(&module.tun_thread, NULL, thread_proc, TUN_THREAD);
-    pthread_create(&module.acc_thread, NULL, thread_proc, ACC_THREAD);
+    pthread_create(&module.tun_thread, NULL, thread_proc,
+            (void *) (intptr_t) TUN_THREAD);
+    pthread_create(&module.acc_thread, NULL, thread_proc,
+            (void *) (intptr_t) ACC_THREAD);
+    module.is_joinable = true;
 }
 
 JNIEXPORT void JNICALL
@@ -121,9 +608,11 @@ Java_com_viper_simplert_Native_stop(JNIEnv *env, jclass type)
     LOGV(__func__);
 
     module.is_started = false;
+    if (module.wake_fds[1] >= 0) {
+        write(module.wake_fds[1], "", 1);
+    }
 
-    pthread_join(module.tun_thread, NULL);
-    pthread_join(module.acc_thread, NULL);
+    join_threads();
 }
 
 JNIEXPORT jboolean JNICALL
@@ -0,0 +1,206 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * accessory lookup cost under contention: rwlock protected table versus
+ * atomically published slots with qsbr reclamation, the way accessory.c
+ * does it. one writer keeps replacing entries while readers look them up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "qsbr.h"
+
+#define SLOTS 256
+#define LOOKUPS_PER_THREAD 20000000UL
+#define QUIESCENT_EVERY 64
+
+typedef struct entry_t {
+    unsigned long val;
+    uint64_t retire_epoch;
+    struct entry_t *next;
+} entry_t;
+
+static pthread_rwlock_t g_lock = PTHREAD_RWLOCK_INITIALIZER;
+static entry_t *g_locked[SLOTS];
+static _Atomic(entry_t *) g_published[SLOTS];
+
+static atomic_bool g_stop;
+static atomic_ulong g_sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *rwlock_reader(void *arg)
+{
+    unsigned long sum = 0;
+    entry_t *e;
+
+    for (unsigned long i = 0; i < LOOKUPS_PER_THREAD; i++) {
+        pthread_rwlock_rdlock(&g_lock);
+        if ((e = g_locked[i % SLOTS]) != NULL) {
+            sum += e->val;
+        }
+        pthread_rwlock_unlock(&g_lock);
+    }
+
+    atomic_fetch_add(&g_sink, sum);
+    return NULL;
+}
+
+static void *qsbr_reader(void *arg)
+{
+    unsigned long sum = 0;
+    entry_t *e;
+
+    qsbr_register_thread();
+
+    for (unsigned long i = 0; i < LOOKUPS_PER_THREAD; i++) {
+        if ((e = atomic_load_explicit(&g_published[i % SLOTS],
+                        memory_order_acquire)) != NULL) {
+            sum += e->val;
+        }
+
+        /* shard reports once per event loop iteration */
+        if (i % QUIESCENT_EVERY == 0) {
+            qsbr_quiescent();
+        }
+    }
+
+    qsbr_unregister_thread();
+
+    atomic_fetch_add(&g_sink, sum);
+    return NULL;
+}
+
+static void *rwlock_writer(void *arg)
+{
+    entry_t *e, *old;
+
+    for (unsigned long i = 0; !atomic_load(&g_stop); i++) {
+        e = malloc(sizeof(*e));
+        e->val = i;
+
+        pthread_rwlock_wrlock(&g_lock);
+        old = g_locked[i % SLOTS];
+        g_locked[i % SLOTS] = e;
+        pthread_rwlock_unlock(&g_lock);
+
+        free(old);
+    }
+
+    return NULL;
+}
+
+static void *qsbr_writer(void *arg)
+{
+    entry_t *e, *old, *retired = NULL, **pp;
+
+    for (unsigned long i = 0; !atomic_load(&g_stop); i++) {
+        e = malloc(sizeof(*e));
+        e->val = i;
+
+        old = atomic_exchange(&g_published[i % SLOTS], e);
+
+        if (old) {
+            old->retire_epoch = qsbr_retire();
+            old->next = retired;
+            retired = old;
+        }
+
+        if (i % SLOTS) {
+            continue;
+        }
+
+        for (pp = &retired; (old = *pp) != NULL; ) {
+            if (qsbr_poll(old->retire_epoch)) {
+                *pp = old->next;
+                free(old);
+            } else {
+                pp = &old->next;
+            }
+        }
+    }
+
+    while ((old = retired) != NULL) {
+        retired = old->next;
+        free(old);
+    }
+
+    return NULL;
+}
+
+static double run(const char *name, void *(*reader)(void *),
+        void *(*writer)(void *), int threads)
+{
+    pthread_t th[threads], wr;
+    uint64_t start, elapsed;
+    double ns_per_op;
+
+    atomic_store(&g_stop, false);
+    pthread_create(&wr, NULL, writer, NULL);
+
+    start = now_ns();
+
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&th[i], NULL, reader, NULL);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_join(th[i], NULL);
+    }
+
+    elapsed = now_ns() - start;
+
+    atomic_store(&g_stop, true);
+    pthread_join(wr, NULL);
+
+    /* wall time per lookup of one thread */
+    ns_per_op = (double) elapsed / LOOKUPS_PER_THREAD;
+
+    printf("%-8s threads=%-3d ns/op=%.2f lookups/s=%.0f\n", name, threads,
+            ns_per_op, threads * 1e9 / ns_per_op);
+
+    return ns_per_op;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+
+    for (int i = 0; i < SLOTS; i++) {
+        g_locked[i] = calloc(1, sizeof(entry_t));
+        atomic_init(&g_published[i], calloc(1, sizeof(entry_t)));
+    }
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        run("rwlock", rwlock_reader, rwlock_writer, threads);
+        run("qsbr", qsbr_reader, qsbr_writer, threads);
+    }
+
+    return 0;
+}
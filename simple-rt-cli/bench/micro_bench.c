@@ -0,0 +1,484 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * hot path functions one by one, linked against the real objects. one
+ * line per case, key=value, so runs of two commits can be diffed:
+ *
+ *   bench=<case> threads=<n> ns/op=<wall time per op of one thread>
+ *   ops/s=<all threads> p50_ns=<op latency> p99_ns=<op latency>
+ *
+ * latency is sampled per chunk of ops, timer costs more than most of them.
+ * optional argument runs only cases whose name contains it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "accessory.h"
+#include "compress.h"
+#include "framing.h"
+#include "network.h"
+#include "packet.h"
+#include "poller.h"
+#include "qsbr.h"
+#include "shard.h"
+#include "tun.h"
+#include "utils.h"
+
+#define BENCH_OPS 2000000UL
+#define BENCH_CHUNK 32
+#define BENCH_PKT_SIZE 1400
+#define BENCH_ACCESSORIES 200
+/* published accessories keep this few packets, pool mustn't run dry */
+#define BENCH_TX_QUEUE_LEN 16
+/* one accessory replaced that often while readers run */
+#define BENCH_CHURN_US 100
+/* churn waits for shard to reclaim, their queues pin packets */
+#define BENCH_RETIRED_MAX 16
+
+typedef struct bench_t {
+    const char *name;
+    void (*op)(unsigned long i);
+    unsigned long ops;
+    unsigned int chunk;
+    int threads;
+    /* shard threads are qsbr readers, so are these */
+    bool is_reader;
+} bench_t;
+
+typedef struct bench_thread_t {
+    const bench_t *bench;
+    uint64_t *samples;
+    size_t samples_cnt;
+} bench_thread_t;
+
+static uint8_t g_pkts[8][BENCH_PKT_SIZE];
+static uint8_t g_text[BENCH_PKT_SIZE];
+static uint8_t g_lz[COMPRESS_BOUND(BENCH_PKT_SIZE)];
+static size_t g_lz_len;
+
+/* owned by churn thread, ids are read by lookups */
+static accessory_t *g_accs[BENCH_ACCESSORIES];
+static shard_t *g_shard;
+static atomic_uint g_acc_ids[BENCH_ACCESSORIES];
+static atomic_bool g_churn;
+
+static int g_sock[2];
+
+/* echo thread on the other end, see op_rtt_sleep() */
+static int g_rtt_sock[2];
+static poller_t *g_rtt_pollers[2];
+static atomic_bool g_rtt_spin;
+
+static atomic_ulong g_sink;
+
+/* results only, retired accessories report their drops on stdout */
+static FILE *g_out;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void op_classify(unsigned long i)
+{
+    atomic_fetch_add_explicit(&g_sink,
+            get_acc_id_from_packet(g_pkts[i & 7], BENCH_PKT_SIZE, true),
+            memory_order_relaxed);
+}
+
+static void op_serial(unsigned long i)
+{
+    char buf[64];
+
+    fill_serial_param(buf, sizeof(buf), 2 + i % BENCH_ACCESSORIES);
+}
+
+static void op_id_alloc(unsigned long i)
+{
+    return_accessory_id(acquire_accessory_id());
+}
+
+/*
+ * tun thread's path to a phone: lookup, policing and tail drop, queues
+ * are full since nothing writes them. accessories are replaced meanwhile.
+ */
+static void op_acc_lookup(unsigned long i)
+{
+    packet_t *pkt;
+
+    if ((pkt = packet_alloc()) == NULL) {
+        return;
+    }
+
+    pkt->len = BENCH_PKT_SIZE;
+    send_accessory_packet(pkt, atomic_load_explicit(
+                &g_acc_ids[i % BENCH_ACCESSORIES], memory_order_relaxed));
+}
+
+static void op_packet_alloc(unsigned long i)
+{
+    packet_free(packet_alloc());
+}
+
+static void op_lz_compress(unsigned long i)
+{
+    uint8_t out[COMPRESS_BOUND(BENCH_PKT_SIZE)];
+
+    atomic_fetch_add_explicit(&g_sink,
+            lz_compress(g_text, sizeof(g_text), out, sizeof(out)),
+            memory_order_relaxed);
+}
+
+static void op_lz_decompress(unsigned long i)
+{
+    uint8_t out[BENCH_PKT_SIZE];
+
+    atomic_fetch_add_explicit(&g_sink,
+            lz_decompress(g_lz, g_lz_len, out, sizeof(out)),
+            memory_order_relaxed);
+}
+
+/* one packet into tun and back, socketpair stands for the device */
+static void op_tun_roundtrip(unsigned long i)
+{
+    uint8_t buf[MAX_MTU];
+
+    if (tun_write_ip_packet(g_sock[0], g_pkts[i & 7], BENCH_PKT_SIZE,
+                NULL) < 0 ||
+            tun_read_ip_packet(g_sock[1], buf, sizeof(buf), NULL) < 0) {
+        perror("tun roundtrip");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* like a shard: spinning on its poller, or sleeping in it */
+static void wait_readable(poller_t *poller, bool spin)
+{
+    void *data[1];
+
+    while (poller_wait(poller, data, 1, spin ? 0 : -1) <= 0) {
+    }
+}
+
+static void *rtt_echo_proc(void *arg)
+{
+    uint8_t buf[MAX_MTU];
+    ssize_t len;
+
+    while (true) {
+        wait_readable(g_rtt_pollers[1], atomic_load(&g_rtt_spin));
+
+        if ((len = read(g_rtt_sock[1], buf, sizeof(buf))) > 0 &&
+                write(g_rtt_sock[1], buf, len) < 0) {
+            perror("rtt echo");
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * packet to another thread and back, wakeup cost of both ends is what
+ * -B saves. run with threads pinned to two cores, e.g.
+ * taskset -c 2,3 ./bench/micro_bench rtt
+ */
+static void rtt_roundtrip(bool spin)
+{
+    uint8_t buf[MAX_MTU];
+
+    atomic_store(&g_rtt_spin, spin);
+
+    if (write(g_rtt_sock[0], g_pkts[0], BENCH_PKT_SIZE) < 0) {
+        perror("rtt");
+        exit(EXIT_FAILURE);
+    }
+
+    wait_readable(g_rtt_pollers[0], spin);
+
+    if (read(g_rtt_sock[0], buf, sizeof(buf)) < 0) {
+        perror("rtt");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void op_rtt_sleep(unsigned long i)
+{
+    rtt_roundtrip(false);
+}
+
+static void op_rtt_spin(unsigned long i)
+{
+    rtt_roundtrip(true);
+}
+
+static const bench_t benches[] = {
+    { "get_acc_id_from_packet", op_classify, BENCH_OPS * 10, BENCH_CHUNK, 1, false },
+    { "fill_serial_param", op_serial, BENCH_OPS, BENCH_CHUNK, 1, false },
+    { "id_alloc", op_id_alloc, BENCH_OPS, BENCH_CHUNK, 1, false },
+    { "id_alloc", op_id_alloc, BENCH_OPS, BENCH_CHUNK, 4, false },
+    { "acc_lookup", op_acc_lookup, BENCH_OPS * 10, BENCH_CHUNK, 1, true },
+    { "acc_lookup", op_acc_lookup, BENCH_OPS * 10, BENCH_CHUNK, 4, true },
+    { "packet_alloc_free", op_packet_alloc, BENCH_OPS, BENCH_CHUNK, 1, false },
+    { "packet_alloc_free", op_packet_alloc, BENCH_OPS, BENCH_CHUNK, 4, false },
+    { "lz_compress", op_lz_compress, BENCH_OPS / 10, 1, 1, false },
+    { "lz_decompress", op_lz_decompress, BENCH_OPS / 10, 1, 1, false },
+    { "tun_roundtrip", op_tun_roundtrip, BENCH_OPS / 10, 1, 1, false },
+    { "rtt_sleep", op_rtt_sleep, BENCH_OPS / 100, 1, 1, false },
+    { "rtt_spin", op_rtt_spin, BENCH_OPS / 100, 1, 1, false },
+};
+
+/* device without usb io, served by the shard like a real one */
+static void add_accessory(size_t idx)
+{
+    char serial[32];
+    accessory_id_t id;
+    accessory_t *acc;
+
+    snprintf(serial, sizeof(serial), "bench%zu", idx);
+
+    g_shard = acquire_shard();
+
+    if ((id = acquire_accessory_id()) == 0 ||
+            (acc = new_accessory(NULL, g_shard, 0, 0, serial)) == NULL ||
+            !publish_accessory(acc, id)) {
+        fprintf(stderr, "Unable to publish accessory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    g_accs[idx] = acc;
+    atomic_store(&g_acc_ids[idx], id);
+}
+
+/* lookups race with retire and reuse of ids, as with replugged phones */
+static void *churn_thread_proc(void *arg)
+{
+    size_t idx = 0;
+
+    while (atomic_load(&g_churn)) {
+        usleep(BENCH_CHURN_US);
+
+        if (atomic_load(&g_shard->retired_cnt) >= BENCH_RETIRED_MAX) {
+            continue;
+        }
+
+        free_accessory(g_accs[idx]);
+        add_accessory(idx);
+
+        idx = (idx + 1) % BENCH_ACCESSORIES;
+    }
+
+    return NULL;
+}
+
+static void *bench_thread_proc(void *arg)
+{
+    bench_thread_t *t = arg;
+    const bench_t *b = t->bench;
+    uint64_t start;
+
+    if (b->is_reader) {
+        qsbr_register_thread();
+    }
+
+    for (unsigned long i = 0; i < b->ops; i += b->chunk) {
+        start = now_ns();
+
+        for (unsigned long j = i; j < i + b->chunk; j++) {
+            b->op(j);
+        }
+
+        t->samples[t->samples_cnt++] = (now_ns() - start) / b->chunk;
+
+        if (b->is_reader) {
+            qsbr_quiescent();
+        }
+    }
+
+    if (b->is_reader) {
+        qsbr_unregister_thread();
+    }
+
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void run_bench(const bench_t *b)
+{
+    pthread_t th[b->threads];
+    bench_thread_t t[b->threads];
+    size_t per_thread = b->ops / b->chunk + 1;
+    uint64_t *samples, start, elapsed;
+    size_t cnt = 0;
+    pthread_t churn_thread;
+
+    if ((samples = malloc(per_thread * b->threads * sizeof(*samples))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if (b->is_reader) {
+        atomic_store(&g_churn, true);
+        if (pthread_create(&churn_thread, NULL, churn_thread_proc,
+                    NULL) != 0) {
+            fprintf(stderr, "Unable to start churn thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start = now_ns();
+
+    for (int i = 0; i < b->threads; i++) {
+        t[i].bench = b;
+        t[i].samples = samples + per_thread * i;
+        t[i].samples_cnt = 0;
+        pthread_create(&th[i], NULL, bench_thread_proc, &t[i]);
+    }
+
+    for (int i = 0; i < b->threads; i++) {
+        pthread_join(th[i], NULL);
+    }
+
+    elapsed = now_ns() - start;
+
+    if (b->is_reader) {
+        atomic_store(&g_churn, false);
+        pthread_join(churn_thread, NULL);
+    }
+
+    /* samples of all threads, packed */
+    for (int i = 0; i < b->threads; i++) {
+        memmove(samples + cnt, t[i].samples, t[i].samples_cnt * sizeof(*samples));
+        cnt += t[i].samples_cnt;
+    }
+
+    qsort(samples, cnt, sizeof(*samples), cmp_u64);
+
+    fprintf(g_out, "bench=%s threads=%d ns/op=%.2f ops/s=%.0f p50_ns=%llu p99_ns=%llu\n",
+            b->name, b->threads, (double) elapsed / b->ops,
+            (double) b->ops * b->threads * 1e9 / elapsed,
+            (unsigned long long) samples[cnt / 2],
+            (unsigned long long) samples[cnt * 99 / 100]);
+
+    free(samples);
+}
+
+/* ipv4 packets, half of them to accessories, rest to the internet */
+static void init_packets(void)
+{
+    for (int i = 0; i < 8; i++) {
+        uint8_t *p = g_pkts[i];
+
+        p[0] = 0x45;
+        p[2] = BENCH_PKT_SIZE >> 8;
+        p[3] = BENCH_PKT_SIZE & 0xff;
+        p[8] = 64;
+        p[9] = 6;
+        memcpy(&p[12], (uint8_t []) { 10, 10, 10, 1 }, 4);
+        memcpy(&p[16], i & 1 ? (uint8_t []) { 8, 8, 8, 8 } :
+                (uint8_t []) { 10, 10, 10, 2 + i }, 4);
+    }
+
+    /* plain text http response, compresses well */
+    for (size_t i = 0; i < sizeof(g_text); i++) {
+        g_text[i] = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n"[i % 42];
+    }
+
+    g_lz_len = lz_compress(g_text, sizeof(g_text), g_lz, sizeof(g_lz));
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    pthread_t rtt_thread;
+
+    init_packets();
+
+    if ((g_out = fdopen(dup(STDOUT_FILENO), "w")) == NULL ||
+            freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        return EXIT_FAILURE;
+    }
+
+    setvbuf(g_out, NULL, _IOLBF, 0);
+
+    get_simple_rt_config()->tx_queue_len = BENCH_TX_QUEUE_LEN;
+
+    if (!setup_address_plan() || !init_accessory_table(get_network_size()) ||
+            !packet_pool_init(DEFAULT_MTU, FRAME_BATCH_SIZE, 16 << 20) ||
+            !start_shards(1)) {
+        fprintf(stderr, "Unable to set up benchmark\n");
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < BENCH_ACCESSORIES; i++) {
+        add_accessory(i);
+    }
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, g_sock) < 0 ||
+            socketpair(AF_UNIX, SOCK_DGRAM, 0, g_rtt_sock) < 0) {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if ((g_rtt_pollers[i] = poller_new()) == NULL ||
+                !poller_add(g_rtt_pollers[i], g_rtt_sock[i], POLLIN,
+                    &g_rtt_sock[i])) {
+            fprintf(stderr, "Unable to set up rtt poller\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (pthread_create(&rtt_thread, NULL, rtt_echo_proc, NULL) != 0) {
+        fprintf(stderr, "Unable to start rtt echo thread\n");
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(benches); i++) {
+        if (filter && !strstr(benches[i].name, filter)) {
+            continue;
+        }
+
+        /* two spinners on one cpu take turns by time slice */
+        if (benches[i].op == op_rtt_spin &&
+                sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+            fprintf(g_out, "bench=%s skipped, needs 2 cpus\n", benches[i].name);
+            continue;
+        }
+
+        run_bench(&benches[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
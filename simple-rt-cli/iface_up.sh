@@ -24,6 +24,7 @@ HOST_ADDR=$5
 TUNNEL_CIDR=$6
 NAMESERVER=$7
 LOCAL_INTERFACE=$8
+MTU=${9:-1500}
 shift
 
 set -e
@@ -31,7 +32,7 @@ set -e
 comment="simple_rt"
 
 function linux_start {
-    ifconfig $TUN_DEV $HOST_ADDR/$TUNNEL_CIDR up
+    ifconfig $TUN_DEV $HOST_ADDR/$TUNNEL_CIDR mtu $MTU up
     sysctl -w net.ipv4.ip_forward=1 > /dev/null
     iptables -I FORWARD -j ACCEPT -m comment --comment "${comment}"
     iptables -t nat -I POSTROUTING -s $TUNNEL_NET/$TUNNEL_CIDR -o $LOCAL_INTERFACE -j MASQUERADE -m comment --comment "${comment}"
@@ -42,8 +43,8 @@ function linux_stop {
 }
 
 function osx_start {
-    ifconfig $TUN_DEV $HOST_ADDR 10.10.10.2 netmask 255.255.255.0 up
-    route add -net $TUNNEL_NET $HOST_ADDR
+    ifconfig $TUN_DEV $HOST_ADDR $HOST_ADDR mtu $MTU up
+    route add -net $TUNNEL_NET/$TUNNEL_CIDR -interface $TUN_DEV
     sysctl -w net.inet.ip.forwarding=1
     echo "nat on $LOCAL_INTERFACE from $TUNNEL_NET/$TUNNEL_CIDR to any -> ($LOCAL_INTERFACE)" > /tmp/nat_rules_rt
 
@@ -72,6 +73,7 @@ if [ "$ACTION" = "start" ]; then
     echo address:               $HOST_ADDR
     echo netmask:               $TUNNEL_CIDR
     echo nameserver:            $NAMESERVER
+    echo mtu:                   $MTU
 fi
 
 ifconfig $LOCAL_INTERFACE > /dev/null
@@ -20,21 +20,63 @@
 #define _ACCESSORY_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <libusb.h>
 
+#include "metrics.h"
+#include "packet.h"
+#include "ratelimit.h"
+
+typedef struct shard_t shard_t;
+
 typedef uint32_t accessory_id_t;
 typedef struct accessory_t accessory_t;
 
 accessory_t *new_accessory(struct libusb_device_handle *handle,
-        uint8_t ep_in, uint8_t ep_out);
+        shard_t *shard, uint8_t ep_in, uint8_t ep_out,
+        const char *usb_serial);
 
 void free_accessory(accessory_t *acc);
 
-int send_accessory_packet(const uint8_t *data, size_t size,
-        accessory_id_t id);
+/* takes ownership of pkt, -1 if it was dropped */
+int send_accessory_packet(packet_t *pkt, accessory_id_t id);
+
+/* hotplug arrival, main thread only */
+void handle_usb_device_arrived(struct libusb_device *dev);
+
+void handle_accessory_events(shard_t *shard);
+
+/* before stop_shards(), every accessory is closed and freed */
+void stop_accessories(void);
+
+typedef void (*accessory_metrics_cb)(void *arg, accessory_id_t id,
+        acc_metrics_t *m, uint64_t tx_dropped, size_t tx_queued);
+
+/* caller must be qsbr reader, metrics stay valid until it's quiescent */
+void for_each_accessory(accessory_metrics_cb cb, void *arg);
+
+typedef void (*accessory_limits_cb)(void *arg, accessory_id_t id,
+        rate_limiter_t *limits);
+
+/* limiters of both directions, same rules as for_each_accessory() */
+void for_each_accessory_limits(accessory_limits_cb cb, void *arg);
+
+/* sized to accessory network, before any accessory is probed */
+bool init_accessory_table(size_t size);
+
+/* address remembered for absent phone, others get it last */
+void defer_accessory_id(accessory_id_t id);
+
+/* free id of no phone in particular, 0 if none is left */
+accessory_id_t acquire_accessory_id(void);
+
+/* lookups find acc by id reserved for it, unless another phone holds it */
+bool publish_accessory(accessory_t *acc, accessory_id_t id);
 
-void run_usb_probe_thread_detached(struct libusb_device *dev);
+/* id of failed handshake back to pool, unless accessory took it */
+void return_accessory_id(accessory_id_t id);
 
-accessory_id_t gen_new_serial_string(char *str, size_t size);
+accessory_id_t gen_new_serial_string(const char *usb_serial,
+        char *serial, size_t serial_size, char *uri, size_t uri_size);
 
 #endif
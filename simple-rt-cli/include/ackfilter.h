@@ -0,0 +1,88 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ACKFILTER_H_
+#define _ACKFILTER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "framing.h"
+
+/* sack blocks fit into tcp options next to timestamp */
+#define ACK_MAX_SACKS 4
+
+/* tcp flows tracked per transfer, acks of others pass as they are */
+#define ACK_FILTER_FLOWS 16
+
+/* smallest data frame holds frame header and pure ack */
+#define ACK_FILTER_MAX_FRAMES \
+    (FRAME_BATCH_SIZE / (FRAME_HDR_SIZE + 40) + 1)
+
+/* ipv4 tcp segment with no payload and no flag but ack */
+typedef struct tcp_ack_t {
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t ack;
+    bool has_ts;
+    uint32_t tsval;
+    uint8_t sack_cnt;
+    uint32_t sack[ACK_MAX_SACKS][2];
+} tcp_ack_t;
+
+/*
+ * false for anything filtering could hurt: data, syn, fin, rst, urg,
+ * ece or cwr set, ce marked, fragments, options but sack and timestamp.
+ */
+bool parse_tcp_ack(const uint8_t *pkt, size_t size, tcp_ack_t *ack);
+
+/*
+ * same flow, newer one acks more or sacks more, and everything older
+ * sacked is covered. duplicate acks are never redundant, they trigger
+ * fast retransmit.
+ */
+bool is_ack_redundant(const tcp_ack_t *older, const tcp_ack_t *newer);
+
+/*
+ * acks of one usb transfer, cake style: transfer is scanned once before
+ * its packets are written, acks followed by newer ones of same flow are
+ * marked by data frame index and skipped then.
+ */
+typedef struct ack_filter_slot_t {
+    tcp_ack_t ack;
+    uint16_t frame;
+} ack_filter_slot_t;
+
+typedef struct ack_filter_t {
+    ack_filter_slot_t slots[ACK_FILTER_FLOWS];
+    size_t slots_cnt;
+    size_t frames;
+    uint64_t dropped[(ACK_FILTER_MAX_FRAMES + 63) / 64];
+} ack_filter_t;
+
+void ack_filter_reset(ack_filter_t *f);
+
+/* every data frame in order, pkt is NULL if it can't be looked into */
+void ack_filter_add(ack_filter_t *f, const uint8_t *pkt, size_t size);
+
+bool ack_filter_is_dropped(const ack_filter_t *f, size_t frame);
+
+#endif
@@ -20,19 +20,48 @@
 #define _LINUX_ADK_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <libusb.h>
 
 #include "accessory.h"
+#include "packet.h"
+#include "shard.h"
 
-typedef accessory_id_t (*gen_new_serial_str_cb)(char *str, size_t size);
+/* usb_serial is empty if device has none */
+typedef accessory_id_t (*gen_new_serial_str_cb)(const char *usb_serial,
+        char *serial, size_t serial_size, char *uri, size_t uri_size);
 
-accessory_t *probe_usb_device(struct libusb_device *dev,
+/*
+ * device is in accessory mode, reports its handshake if any. id reserved
+ * by that handshake goes to accessory, 0 without one.
+ */
+bool is_accessory_present(struct libusb_device *dev, accessory_id_t *id);
+
+accessory_t *probe_usb_device(struct libusb_device *dev, shard_t *shard);
+
+/*
+ * switches device into accessory mode. async, driven by default libusb
+ * context and handle_aoa_handshakes(), main thread only.
+ */
+bool start_aoa_handshake(struct libusb_device *dev,
         gen_new_serial_str_cb gen_new_serial_str);
 
+/* runs due steps, returns us until next one, -1 if none */
+int64_t handle_aoa_handshakes(void);
+
+void stop_aoa_handshakes(void);
+
+/* synchronous io, 0 on timeout, -1 on error */
 ssize_t read_usb_packet(struct libusb_device_handle *handle, uint8_t ep,
         uint8_t *data, size_t size);
 
 ssize_t write_usb_packet(struct libusb_device_handle *handle, uint8_t ep,
         const uint8_t *data, size_t size);
 
+struct libusb_transfer *alloc_usb_transfer(struct libusb_device_handle *handle,
+        uint8_t ep, libusb_transfer_cb_fn cb, void *user_data);
+
+int submit_usb_packet(struct libusb_transfer *transfer, packet_t *pkt,
+        size_t size);
+
 #endif /* _LINUX_ADK_H_ */
@@ -0,0 +1,54 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DNS_H_
+#define _DNS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "utils.h"
+
+typedef struct dns_stats_t {
+    uint64_t queries;
+    uint64_t hits;
+    uint64_t misses;
+    /* answered by query already sent upstream for another phone */
+    uint64_t coalesced;
+    uint64_t prefetches;
+    uint64_t upstream_timeouts;
+    uint64_t entries;
+} dns_stats_t;
+
+bool parse_dns_mode(const char *str, dns_mode_t *mode);
+const char *get_dns_mode_name(dns_mode_t mode);
+
+/*
+ * caching forwarder on host tun address, -n server is its upstream,
+ * tcp queries are relayed to it uncached.
+ * needs tun address, so runs after start_network().
+ */
+bool start_dns(void);
+void stop_dns(void);
+
+/* phones are given host address as nameserver then */
+bool is_dns_running(void);
+
+void get_dns_stats(dns_stats_t *stats);
+
+#endif
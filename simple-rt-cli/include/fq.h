@@ -0,0 +1,88 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FQ_H_
+#define _FQ_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "metrics.h"
+#include "packet.h"
+
+/* flows hashed per accessory, power of two */
+#define FQ_FLOWS 256
+
+/* codel: acceptable standing queue and time it may be exceeded, us */
+#define FQ_CODEL_TARGET_US 5000
+#define FQ_CODEL_INTERVAL_US 100000
+
+/*
+ * fq_codel: packets are hashed by ipv4 5-tuple into flow queues served
+ * round robin with byte deficits, new flows first, so a bulk download
+ * doesn't delay dns or ssh of the same phone. every flow runs codel on
+ * time packets have waited since tun read: once it stays above target
+ * for an interval, packets are ecn marked or dropped at increasing rate.
+ * single owner, e.g. accessory tx side, no locking.
+ */
+typedef struct fq_flow_t {
+    packet_t *head;
+    packet_t *tail;
+    struct fq_flow_t *next;
+    int32_t deficit;
+    uint32_t backlog;
+    bool is_listed;
+
+    /* codel state */
+    bool is_dropping;
+    uint32_t count;
+    uint32_t last_count;
+    uint64_t first_above_ts;
+    uint64_t drop_next;
+} fq_flow_t;
+
+typedef struct fq_list_t {
+    fq_flow_t *head;
+    fq_flow_t *tail;
+} fq_list_t;
+
+typedef struct fq_t {
+    fq_flow_t *flows;
+    fq_list_t new_flows;
+    fq_list_t old_flows;
+    size_t len;
+    size_t limit;
+    uint32_t quantum;
+    uint32_t perturb;
+    /* enqueued pure ack drops older ones it makes redundant, see ackfilter.h */
+    bool filter_acks;
+    aqm_stats_t *stats;
+} fq_t;
+
+/* limit in packets, quantum in bytes per round */
+bool fq_init(fq_t *fq, size_t limit, uint32_t quantum, aqm_stats_t *stats);
+void fq_destroy(fq_t *fq);
+
+/* takes pkt, drops from fattest flow when over limit, and stale acks */
+void fq_enqueue(fq_t *fq, packet_t *pkt, uint64_t now);
+
+/* next packet to send or NULL, codel drops happen here */
+packet_t *fq_dequeue(fq_t *fq, uint64_t now);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FRAMING_H_
+#define _FRAMING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Framed usb transfer, all fields are big endian:
+ *
+ *   | magic | version | count:16 | len:16 | type | flags | packet | ...
+ *   \----- batch header -------/ \------ frame, count times -------/
+ *
+ * Raw transfers start with ip version nibble, FRAME_MAGIC never does.
+ * Transfers are padded, so their length is never a multiple of usb
+ * max packet size and no zero length packet is needed to end them.
+ *
+ * Keep in sync with simple-rt-android/app/src/main/jni/tetherservice.c
+ */
+#define FRAME_MAGIC             0x53
+#define FRAME_VERSION           1
+
+#define FRAME_BATCH_HDR_SIZE    4
+#define FRAME_HDR_SIZE          4
+
+/* f_accessory gadget buffer size, phone never reads more at once */
+#define FRAME_BATCH_SIZE        16384
+
+#define FRAME_PAD_ALIGN         64
+
+enum frame_type {
+    FRAME_TYPE_DATA = 0,
+    /* peer capabilities in flags, no payload, old peers skip it */
+    FRAME_TYPE_CAPS = 1,
+    /* control message, its type in flags, see ctrl_type */
+    FRAME_TYPE_CTRL = 2,
+};
+
+/* data frame flags: packet is lz4 block, see compress.h */
+#define FRAME_FLAG_LZ4          0x01
+
+/* caps frame flags: peer takes compressed packets */
+#define FRAME_CAP_LZ4           0x01
+
+/* caps frame flags: payload is mtu:16 of peer tun */
+#define FRAME_CAP_MTU           0x02
+
+/* caps frame flags: phone answers control frames, host offers ctrl=1 */
+#define FRAME_CAP_CTRL          0x04
+
+/*
+ * control frames, host pings and phone answers each ping right away,
+ * so they are keepalive and rtt probe at once
+ */
+enum ctrl_type {
+    /* seq:32 | ts:64, host clock in us */
+    CTRL_PING = 1,
+    /* seq and ts of ping echoed, then phone relay counters */
+    CTRL_PONG = 2,
+};
+
+#define CTRL_PING_SIZE          12
+
+/* pong counters, 64 bits each, in this order */
+enum ctrl_stat {
+    CTRL_STAT_TUN_PACKETS,      /* read from phone tun, sent to host */
+    CTRL_STAT_TUN_BATCHES,      /* usb transfers to host */
+    CTRL_STAT_ACC_PACKETS,      /* from host, written to phone tun */
+    CTRL_STAT_ACC_TRANSFERS,    /* usb transfers from host */
+    CTRL_STAT_TUN_DROPPED,      /* phone tun refused them */
+    CTRL_STATS,
+};
+
+#define CTRL_PONG_SIZE          (CTRL_PING_SIZE + CTRL_STATS * 8)
+
+typedef struct frame_batch_t {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    uint16_t count;
+} frame_batch_t;
+
+typedef void (*frame_cb)(void *arg, uint8_t type, uint8_t flags,
+        const uint8_t *data, size_t size);
+
+void frame_batch_init(frame_batch_t *batch, uint8_t *buf, size_t size);
+
+bool frame_batch_add(frame_batch_t *batch, uint8_t type, uint8_t flags,
+        const uint8_t *data, size_t size);
+
+size_t frame_batch_finish(frame_batch_t *batch);
+
+bool is_framed_transfer(const uint8_t *data, size_t size);
+
+int parse_framed_transfer(const uint8_t *data, size_t size,
+        frame_cb cb, void *arg);
+
+#endif
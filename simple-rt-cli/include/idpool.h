@@ -0,0 +1,48 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IDPOOL_H_
+#define _IDPOOL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * O(1) id allocator: free ids form doubly linked list over index arrays,
+ * so any id may be taken out of it, not only the head one. released ids
+ * go to the tail, recently used ones are handed out last.
+ */
+typedef struct id_pool_t {
+    uint32_t size;
+    uint32_t free_cnt;
+    uint32_t *next;
+    uint32_t *prev;
+} id_pool_t;
+
+bool id_pool_init(id_pool_t *pool, uint32_t size);
+void id_pool_destroy(id_pool_t *pool);
+
+/* returns false if id is used already */
+bool id_pool_reserve(id_pool_t *pool, uint32_t id);
+
+/* returns false if pool is exhausted */
+bool id_pool_acquire(id_pool_t *pool, uint32_t *id);
+
+void id_pool_release(id_pool_t *pool, uint32_t id);
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * counters have single writer, e.g. thread owning the direction of an
+ * accessory: updates are plain load and store, no locked instructions.
+ * metrics thread reads them whenever it's asked to.
+ */
+typedef atomic_uint_least64_t counter_t;
+
+static inline void counter_add(counter_t *c, uint64_t val)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c,
+                memory_order_relaxed) + val, memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(counter_t *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+/*
+ * log-linear histogram, hdr style: each power of two is split into
+ * 1 << HIST_SUB_BITS buckets, so relative error is below 25%.
+ */
+#define HIST_SUB_BITS 2
+#define HIST_MAX_MSB 39
+#define HIST_BUCKETS ((HIST_MAX_MSB + 1) << HIST_SUB_BITS)
+
+typedef struct hist_t {
+    counter_t buckets[HIST_BUCKETS];
+    counter_t sum;
+    counter_t count;
+} hist_t;
+
+static inline unsigned int hist_bucket(uint64_t val)
+{
+    unsigned int msb;
+
+    if (val < (1u << HIST_SUB_BITS)) {
+        return val;
+    }
+
+    msb = 63 - __builtin_clzll(val);
+    if (msb > HIST_MAX_MSB) {
+        return HIST_BUCKETS - 1;
+    }
+
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+        ((val >> (msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+static inline void hist_record(hist_t *h, uint64_t val)
+{
+    counter_add(&h->buckets[hist_bucket(val)], 1);
+    counter_add(&h->sum, val);
+    counter_add(&h->count, 1);
+}
+
+/* flow queues of one accessory, see fq.h */
+typedef struct aqm_stats_t {
+    counter_t codel_drops;
+    counter_t ecn_marks;
+    counter_t overlimit_drops;
+    /* pure acks, newer one of same flow was queued */
+    counter_t ack_drops;
+    /* packets held, gauge */
+    counter_t backlog;
+    /* us, read from tun to dequeued */
+    hist_t sojourn;
+} aqm_stats_t;
+
+/* per accessory, see for_each_accessory() */
+typedef struct acc_metrics_t {
+    /* usb -> tun, written by rx thread */
+    counter_t rx_packets;
+    counter_t rx_bytes;
+    counter_t rx_errors;
+    counter_t rx_rate_dropped;
+    /* pure acks, newer one of same flow came in same transfer */
+    counter_t rx_ack_dropped;
+
+    /* tun -> usb, written by tx thread */
+    counter_t tx_packets;
+    counter_t tx_bytes;
+    counter_t tx_errors;
+    /* tun threads and switching shards, atomic add */
+    counter_t tx_rate_dropped;
+
+    /* us, out transfer submit to completion */
+    hist_t usb_out_latency;
+
+    /* us, read from tun to handed to usb transfer */
+    hist_t tx_residence;
+
+    /* tx flow queues, written by tx thread */
+    aqm_stats_t aqm;
+
+    /* control channel, pings by tx thread, the rest by rx thread */
+    counter_t link_pings;
+    counter_t link_pongs;
+    /* us, ping sent to pong received */
+    hist_t link_rtt;
+    /* smoothed rtt, gauge */
+    counter_t link_srtt_us;
+    /* as phone reports it */
+    counter_t phone_tun_dropped;
+    /* torn down, pongs and everything else stopped coming */
+    counter_t link_timeouts;
+} acc_metrics_t;
+
+/* gone accessory still counts in totals, called by any thread */
+void retire_accessory_metrics(acc_metrics_t *m, uint64_t tx_dropped);
+
+/* prometheus text format over http on unix socket */
+bool start_metrics(const char *path);
+void stop_metrics(void);
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NETCONF_H_
+#define _NETCONF_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* addresses in host byte order */
+typedef struct netconf_t {
+    const char *dev;
+    uint32_t net_addr;
+    uint32_t host_addr;
+    unsigned int prefix;
+    const char *nameserver;
+    const char *out_iface;
+    unsigned int mtu;
+} netconf_t;
+
+/* address, link, forwarding and masquerading of accessory network */
+bool netconf_up(const netconf_t *conf);
+bool netconf_down(void);
+
+#endif
@@ -23,11 +23,31 @@
 #include <stdbool.h>
 
 #include "accessory.h"
+#include "tun.h"
+
+/* parses configured network, must run before anything else here */
+bool setup_address_plan(void);
+size_t get_network_size(void);
+
+/* host order address of accessory */
+uint32_t get_acc_addr(accessory_id_t id);
+
+/* dotted address in network, 0 if it's not an accessory one */
+accessory_id_t parse_acc_addr(const char *str);
+
+typedef struct tun_stats_t {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes;
+} tun_stats_t;
+
+void get_tun_stats(tun_stats_t *stats);
 
 bool start_network(void);
 void stop_network(void);
 
-ssize_t send_network_packet(const uint8_t *data, size_t size);
+ssize_t send_network_packet(const uint8_t *data, size_t size,
+        const tun_gso_t *gso, accessory_id_t id);
 
 accessory_id_t get_acc_id_from_packet(const uint8_t *data,
         size_t size, bool dst_addr);
@@ -35,4 +55,13 @@ accessory_id_t get_acc_id_from_packet(const uint8_t *data,
 char *fill_serial_param(char *buf, size_t size,
         accessory_id_t acc_id);
 
+char *fill_uri_param(char *buf, size_t size);
+
+/* rx path, syn of phone leaving through uplink gets its mss */
+void clamp_uplink_mss(uint8_t *data, size_t size);
+
+/* packet is bigger than accessory mtu, icmp goes back through tun */
+void send_frag_needed(const uint8_t *data, size_t size, uint16_t mtu,
+        accessory_id_t id);
+
 #endif
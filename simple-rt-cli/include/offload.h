@@ -0,0 +1,104 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OFFLOAD_H_
+#define _OFFLOAD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "tun.h"
+
+/* tcp flows coalesced at once per accessory */
+#define GRO_MAX_FLOWS 4
+
+/*
+ * tso: tun hands over one tcp super packet instead of many segments,
+ * cut it into mss sized segments with full checksums.
+ */
+typedef struct gso_iter_t {
+    const uint8_t *pkt;
+    size_t size;
+    size_t hdr_len;
+    size_t off;
+    uint16_t gso_size;
+    uint16_t ip_id;
+    uint16_t segs;
+    uint32_t seq;
+} gso_iter_t;
+
+bool finish_packet_csum(uint8_t *pkt, size_t size, const tun_gso_t *gso);
+
+bool gso_iter_init(gso_iter_t *it, const uint8_t *pkt, size_t size,
+        const tun_gso_t *gso);
+
+/* returns size of next segment written into out, 0 when done */
+size_t gso_next_segment(gso_iter_t *it, uint8_t *out, size_t out_size);
+
+/*
+ * gro: consecutive segments of tcp flow are merged into one super packet
+ * and written into tun at once, kernel segments it again if needed.
+ */
+typedef ssize_t (*gro_write_cb)(void *arg, const uint8_t *data, size_t size,
+        const tun_gso_t *gso);
+
+typedef struct gro_flow_t {
+    uint8_t *buf;
+    size_t len;
+    size_t hdr_len;
+    uint16_t segs;
+    uint16_t gso_size;
+    uint32_t next_seq;
+    bool is_closed;
+} gro_flow_t;
+
+typedef struct gro_t {
+    gro_flow_t flows[GRO_MAX_FLOWS];
+    size_t evict;
+    gro_write_cb write;
+    void *arg;
+    uint64_t merged;
+    uint64_t writes;
+} gro_t;
+
+bool gro_init(gro_t *gro, gro_write_cb write, void *arg);
+void gro_destroy(gro_t *gro);
+
+/* packet is either held for coalescing or written, -1 on write error */
+int gro_write_packet(gro_t *gro, const uint8_t *data, size_t size);
+int gro_flush(gro_t *gro);
+
+/* lowers mss option of ipv4 tcp syn, true if packet was changed */
+bool clamp_tcp_mss(uint8_t *pkt, size_t size, uint16_t mss);
+
+/*
+ * ecn congestion experienced instead of a drop, ipv4 only. false if
+ * packet is not ect, caller drops it then.
+ */
+bool mark_ecn_ce(uint8_t *pkt, size_t size);
+
+/*
+ * icmp "fragmentation needed" telling sender of pkt to use mtu,
+ * src_addr in host order. returns size written into out or 0.
+ */
+size_t build_icmp_frag_needed(uint8_t *out, size_t out_size,
+        const uint8_t *pkt, size_t size, uint32_t src_addr, uint16_t mtu);
+
+#endif
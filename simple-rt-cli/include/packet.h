@@ -0,0 +1,75 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Packets live in preallocated refcounted buffers. Packet is read once
+ * into its buffer and passed along by pointer, slices of one buffer
+ * (e.g. frames of a batch) share it and keep it alive.
+ */
+typedef enum packet_class_t {
+    PACKET_CLASS_PKT,   /* one ip packet, up to tun mtu */
+    PACKET_CLASS_XFER,  /* whole usb transfer, i.e. batch or rx buffer */
+    PACKET_CLASSES,
+} packet_class_t;
+
+typedef struct packet_t {
+    uint8_t *data;
+    size_t len;
+    uint32_t buf;
+    packet_class_t cls;
+    /* read from tun, us, 0 if not known */
+    uint64_t ts;
+    /* queue link of current owner, see fq.h */
+    struct packet_t *next;
+} packet_t;
+
+typedef struct packet_pool_stats_t {
+    size_t buf_size;
+    size_t bufs_total;
+    size_t bufs_used;
+    size_t bufs_peak;
+    uint64_t alloc_failed;
+    bool is_hugepage;
+} packet_pool_stats_t;
+
+/*
+ * queued packets take mtu sized buffers, so a full tx queue pins
+ * queue length times mtu, not times transfer size. transfer buffers
+ * get a quarter of mem_cap, packets the rest.
+ */
+bool packet_pool_init(size_t pkt_size, size_t xfer_size, size_t mem_cap);
+void packet_pool_destroy(void);
+void packet_pool_get_stats(packet_class_t cls, packet_pool_stats_t *stats);
+
+size_t packet_buf_size(void);
+size_t packet_xfer_size(void);
+
+packet_t *packet_alloc(void);
+packet_t *packet_alloc_xfer(void);
+packet_t *packet_slice(packet_t *pkt, uint8_t *data, size_t len);
+bool packet_is_shared(packet_t *pkt);
+void packet_free(packet_t *pkt);
+
+#endif
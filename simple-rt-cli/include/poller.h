@@ -0,0 +1,41 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POLLER_H_
+#define _POLLER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* readiness notification: epoll on linux, kqueue on osx */
+typedef struct poller_t poller_t;
+
+poller_t *poller_new(void);
+void poller_free(poller_t *poller);
+
+/* events are POLLIN / POLLOUT, data is returned by poller_wait */
+bool poller_add(poller_t *poller, int fd, short events, void *data);
+void poller_del(poller_t *poller, int fd);
+
+/* timeout_us < 0 waits forever, may be rounded up to ms */
+int poller_wait(poller_t *poller, void **data, int max, int64_t timeout_us);
+
+/* interrupts poller_wait from any thread */
+void poller_wakeup(poller_t *poller);
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QSBR_H_
+#define _QSBR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * quiescent state based reclamation. readers look up shared objects with
+ * plain atomic loads and report from time to time that they hold no
+ * references. retired object may be freed once every online reader has
+ * reported since it was retired.
+ */
+void qsbr_register_thread(void);
+void qsbr_unregister_thread(void);
+
+/* holds no references right now */
+void qsbr_quiescent(void);
+
+/* holds no references until qsbr_online, e.g. while sleeping */
+void qsbr_offline(void);
+void qsbr_online(void);
+
+/* called after object is unpublished, returns its grace period */
+uint64_t qsbr_retire(void);
+
+/* grace period of retired object is over */
+bool qsbr_poll(uint64_t epoch);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* per accessory rates are recomputed that often, see handle_rate_limits() */
+#define RATE_TICK_US 100000
+
+/* burst a bucket lets through at once: this long at its rate, or bytes */
+#define RATE_BURST_US 10000
+#define RATE_MIN_BURST 32768
+
+typedef enum rate_dir_t {
+    RATE_DOWN,  /* tun -> accessory */
+    RATE_UP,    /* accessory -> tun */
+    RATE_DIRS,
+} rate_dir_t;
+
+/*
+ * token bucket kept as the time it runs empty (gcra), so any number of
+ * threads take tokens with one compare and swap and no refill timer.
+ */
+typedef struct token_bucket_t {
+    atomic_uint_least64_t empty_ns;
+    /* bytes per second, 0 is no limit */
+    atomic_uint_least64_t rate;
+} token_bucket_t;
+
+/* one direction of an accessory, rate is set by main thread */
+typedef struct rate_limiter_t {
+    token_bucket_t bucket;
+    /* bytes which came for the bucket, passed or not */
+    atomic_uint_least64_t offered;
+    /* main thread only, demand of last tick */
+    uint64_t last_offered;
+} rate_limiter_t;
+
+void rate_limiter_init(rate_limiter_t *rl);
+
+/* false if packet is over accessory or total limit, any thread */
+bool rate_limit_packet(rate_limiter_t *rl, rate_dir_t dir, size_t len);
+
+/*
+ * limits file, mbit/s per direction, down first, 0 is no limit:
+ *   total <down> <up>      all accessories together
+ *   phone <down> <up>      each accessory
+ *   <address> <down> <up>  accessory with that address
+ *   fair                   total is shared max-min fair between busy ones
+ * main thread only, a failed reload keeps current limits.
+ */
+bool start_rate_limits(const char *path);
+bool reload_rate_limits(void);
+void stop_rate_limits(void);
+
+/* applies limits to accessories, returns us until next tick or -1 */
+int64_t handle_rate_limits(void);
+
+#endif
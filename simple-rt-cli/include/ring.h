@@ -0,0 +1,117 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Bounded lock-free queue of pointers, any number of producers and
+ * consumers. Cells carry sequence numbers, so producers never wait on
+ * each other, see Dmitry Vyukov's bounded MPMC queue.
+ */
+typedef struct ring_cell_t {
+    atomic_size_t seq;
+    void *data;
+} ring_cell_t;
+
+typedef struct ring_t {
+    ring_cell_t *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+} ring_t;
+
+bool ring_init(ring_t *ring, size_t size);
+void ring_destroy(ring_t *ring);
+
+static inline bool ring_push(ring_t *ring, void *data)
+{
+    ring_cell_t *cell;
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while (true) {
+        cell = &ring->cells[pos & ring->mask];
+
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* full */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    cell->data = data;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    return true;
+}
+
+static inline void *ring_pop(ring_t *ring)
+{
+    void *data;
+    ring_cell_t *cell;
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (true) {
+        cell = &ring->cells[pos & ring->mask];
+
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* empty */
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    data = cell->data;
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1,
+            memory_order_release);
+
+    return data;
+}
+
+static inline size_t ring_count(ring_t *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    return head > tail ? head - tail : 0;
+}
+
+#endif
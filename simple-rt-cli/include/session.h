@@ -0,0 +1,48 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "accessory.h"
+
+/* usb serial string of phone, same in accessory mode */
+#define SESSION_SERIAL_SIZE 128
+
+/*
+ * address each phone had last, keyed by its usb serial: phone that comes
+ * back, already in accessory mode or not, gets it again and keeps its tcp
+ * sessions. with a path table is kept there as "<serial> <address>" lines
+ * and survives restarts, addresses outside of -a network are skipped.
+ */
+bool start_sessions(const char *path);
+void stop_sessions(void);
+
+/* saves table if it changed, main thread only; us until next check or -1 */
+int64_t handle_sessions(void);
+
+/* 0 if phone has no serial or wasn't seen */
+accessory_id_t find_session_id(const char *usb_serial);
+
+/* address given to phone, taken from any other one; marks table changed */
+void bind_session(const char *usb_serial, accessory_id_t id);
+
+#endif
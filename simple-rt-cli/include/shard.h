@@ -0,0 +1,96 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <libusb.h>
+
+#include "poller.h"
+#include "ring.h"
+
+#define MAX_SHARDS 64
+
+/* fd readiness handler, owned by whoever registers the fd */
+typedef struct shard_io_t {
+    void (*handle)(void *arg);
+    void *arg;
+} shard_io_t;
+
+/*
+ * data plane thread: owns libusb context of its accessories and
+ * some tun queues, sleeps in one poller for all of them.
+ */
+typedef struct shard_t {
+    size_t idx;
+    /* see -C, -1 if not pinned */
+    int cpu;
+    pthread_t thread;
+    volatile bool is_running;
+    poller_t *poller;
+
+    libusb_context *usb_ctx;
+    shard_io_t usb_io;
+
+    /* accessories served, see acquire_shard() */
+    atomic_size_t load;
+
+    /* accessories with queued packets */
+    ring_t kick_ring;
+
+    /* batches waiting for flush, shard thread walks the list */
+    atomic_int pending_batches;
+    struct accessory_t *batch_list;
+
+    /* accessories with control channel, pinged by shard thread */
+    struct accessory_t *ctrl_list;
+    uint64_t ctrl_next_ts;
+
+    /* accessories waiting for grace period, see free_accessory() */
+    pthread_mutex_t retire_lock;
+    struct accessory_t *retired;
+    atomic_size_t retired_cnt;
+} shard_t;
+
+bool start_shards(size_t cnt);
+void stop_shards(void);
+
+size_t get_shards_count(void);
+shard_t *get_shard(size_t idx);
+
+/* shard of calling thread, NULL outside of data plane */
+shard_t *get_current_shard(void);
+
+/* least loaded shard for new accessory */
+shard_t *acquire_shard(void);
+void release_shard(shard_t *shard);
+
+bool shard_add_io(shard_t *shard, int fd, shard_io_t *io);
+void shard_del_io(shard_t *shard, int fd);
+
+void wakeup_shard(shard_t *shard);
+
+/* calling thread runs on cpu of shard, e.g. synchronous io of accessory */
+void pin_to_shard_cpu(shard_t *shard);
+
+#endif
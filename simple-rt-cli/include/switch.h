@@ -0,0 +1,44 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SWITCH_H_
+#define _SWITCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "accessory.h"
+#include "packet.h"
+#include "utils.h"
+
+bool parse_switch_policy(const char *str, switch_policy_t *policy);
+const char *get_switch_policy_name(switch_policy_t policy);
+
+/*
+ * called for every packet received from accessory src, data points into
+ * rx buffer, or anywhere if rx is NULL. true if packet was passed to other accessory or dropped by
+ * policy, false if it goes to tun as usual.
+ * caller must be qsbr reader.
+ */
+bool switch_accessory_packet(packet_t *rx, const uint8_t *data,
+        size_t size, accessory_id_t src);
+
+void print_switch_stats(void);
+
+#endif
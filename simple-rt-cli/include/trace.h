@@ -0,0 +1,82 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * packet path stages. each one is a usdt probe simple_rt:<name>(id, len)
+ * when built with systemtap sdt.h, and an entry of flight recorder.
+ */
+#define TRACE_STAGES(X) \
+    X(tun_read)         /* read from tun, accessory found */ \
+    X(tx_queued)        /* put into accessory tx queue */ \
+    X(tx_dropped)       /* tx queue is full */ \
+    X(usb_out_submit)   /* usb out transfer started, len of transfer */ \
+    X(usb_out_done)     /* usb out transfer completed */ \
+    X(usb_in_done)      /* usb in transfer completed, len of transfer */ \
+    X(tun_write)        /* written into tun */ \
+    X(usb_error)        /* usb transfer failed, len is libusb status */ \
+    X(tun_error)        /* tun write failed, len is errno */
+
+#define TRACE_STAGE_ENUM(name) TRACE_STAGE_##name,
+
+typedef enum trace_stage_t {
+    TRACE_STAGES(TRACE_STAGE_ENUM)
+    TRACE_STAGE_MAX,
+} trace_stage_t;
+
+#undef TRACE_STAGE_ENUM
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, id, len) DTRACE_PROBE2(simple_rt, name, id, len)
+#endif
+#endif
+
+/* no sdt.h, flight recorder only */
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(name, id, len) do { } while (0)
+#endif
+
+/* probe is a nop until attached, recorder writes thread's own entry */
+#define trace_packet(name, id, len) do { \
+    TRACE_PROBE(name, id, len); \
+    flight_record(TRACE_STAGE_##name, id, len); \
+} while (0)
+
+/* last FLIGHT_RECORDER_SIZE stages of each thread, always on */
+void flight_record(trace_stage_t stage, uint32_t id, uint32_t len);
+
+/*
+ * writes recorders merged, oldest first, into FLIGHT_DUMP_PATH.
+ * main thread only, runs at most once a second.
+ */
+bool flight_dump(const char *reason);
+
+/* data path error: wakes main loop to dump, no file io on the spot */
+void flight_dump_later(const char *reason);
+
+/* main loop: writes dump asked for by flight_dump_later() */
+void handle_flight_dump(void);
+
+#endif
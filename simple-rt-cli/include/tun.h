@@ -21,10 +21,37 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define MAX_TUN_QUEUES 256
+
+/* ip header + max tcp payload of tso super packet */
+#define TUN_GSO_MAX_SIZE 65535
+
+/*
+ * segmentation offload info, mirrors virtio_net_hdr.
+ * gso_size != 0 means tcpv4 super packet of gso_size segments,
+ * needs_csum means l4 checksum field holds pseudo header sum only.
+ */
+typedef struct tun_gso_t {
+    bool needs_csum;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t gso_size;
+    uint16_t hdr_len;
+} tun_gso_t;
 
 bool is_tun_present(void);
-int tun_alloc(char *dev_name, size_t dev_name_size);
-ssize_t tun_read_ip_packet(int fd, uint8_t *packet, size_t size);
-ssize_t tun_write_ip_packet(int fd, const uint8_t *packet, size_t size);
+bool tun_has_offload(void);
+size_t tun_max_queues(void);
+int tun_alloc(char *dev_name, size_t dev_name_size, bool multi_queue,
+        bool offload);
+
+/* gso may be NULL if offload is off */
+ssize_t tun_read_ip_packet(int fd, uint8_t *packet, size_t size,
+        tun_gso_t *gso);
+ssize_t tun_write_ip_packet(int fd, const uint8_t *packet, size_t size,
+        const tun_gso_t *gso);
 
 #endif
@@ -19,18 +19,137 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
 #define DEFAULT_NAMESERVER "8.8.8.8"
 
-#define ACC_BUF_SIZE 4096
+/* accessory network, host takes .1, accessories get the rest */
+#define DEFAULT_NETWORK "10.10.10.0/24"
+
+/* tun and accessory mtu, phone confirms it in caps frame */
+#define DEFAULT_MTU 1500
+
+/* packet with its frame header fits into one usb transfer */
+#define MIN_MTU 576
+#define MAX_MTU 16000
+
+/* usb transfers in flight per direction, 0 means synchronous io */
+#define DEFAULT_USB_TRANSFERS 4
+
+/* max time packet waits in batch, 0 means no framed transfers */
+#define DEFAULT_FLUSH_LATENCY_US 250
+
+/* packets queued per accessory, rounded up to power of two */
+#define DEFAULT_TX_QUEUE_LEN 256
+
+/* tun queues, spread over data plane shards */
+#define DEFAULT_TUN_QUEUES 1
+
+/* data plane threads, each one serves part of accessories and tun queues */
+#define DEFAULT_SHARDS 1
+
+/* packet buffer pool memory cap, MB */
+#define DEFAULT_POOL_SIZE_MB 64
+
+/* phone that answers keepalives but went silent this long is dropped */
+#define DEFAULT_LINK_TIMEOUT_MS 3000
+
+/* traffic between accessories, see switch.h */
+typedef enum switch_policy_t {
+    SWITCH_POLICY_KERNEL,   /* routed by host kernel, firewall applies */
+    SWITCH_POLICY_SWITCH,   /* passed to peer right from rx buffer */
+    SWITCH_POLICY_DROP,     /* accessories are isolated */
+} switch_policy_t;
+
+/* dns forwarder on host address, see dns.h */
+typedef enum dns_mode_t {
+    DNS_MODE_OFF,       /* phones ask -n server themselves */
+    DNS_MODE_CACHE,     /* answers are cached for their ttl */
+    DNS_MODE_PREFETCH,  /* popular names are refreshed before they expire */
+} dns_mode_t;
 
 #define ARRAY_SIZE(x) (sizeof((x)) / sizeof((x)[0]))
 
 typedef struct simple_rt_config_t {
     const char *interface;
     const char *nameserver;
+    const char *network;
+    unsigned int usb_transfers;
+    unsigned int flush_latency_us;
+    unsigned int tx_queue_len;
+    unsigned int tun_queues;
+    unsigned int shards;
+    unsigned int pool_size_mb;
+    bool offload;
+    switch_policy_t switch_policy;
+    bool compress;
+    const char *metrics_path;
+    unsigned int mtu;
+    const char *rate_limits_path;
+    unsigned int busy_poll_us;
+    const char *cpu_list;
+    dns_mode_t dns_mode;
+    bool ack_filter;
+    unsigned int link_timeout_ms;
+    const char *sessions_path;
 } simple_rt_config_t;
 
 extern simple_rt_config_t *get_simple_rt_config(void);
 extern const char *get_system_nameserver(void);
 
+/* pins calling thread, false if platform can't */
+extern bool pin_thread_to_cpu(int cpu);
+
+/* cpus serving usb host controller interrupt, e.g. "2", NULL if unknown */
+extern char *get_usb_irq_cpu_list(char *buf, size_t size);
+
+static inline uint64_t get_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* big endian fields of wire headers, unaligned */
+static inline uint16_t get_be16(const uint8_t *p)
+{
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+        (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline uint64_t get_be64(const uint8_t *p)
+{
+    return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static inline void put_be16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val & 0xff;
+}
+
+static inline void put_be32(uint8_t *p, uint32_t val)
+{
+    p[0] = val >> 24;
+    p[1] = (val >> 16) & 0xff;
+    p[2] = (val >> 8) & 0xff;
+    p[3] = val & 0xff;
+}
+
+static inline void put_be64(uint8_t *p, uint64_t val)
+{
+    put_be32(p, val >> 32);
+    put_be32(p + 4, val & 0xffffffff);
+}
+
 #endif
@@ -22,168 +22,1364 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "accessory.h"
+#include "ackfilter.h"
 #include "adk.h"
+#include "compress.h"
+#include "framing.h"
+#include "fq.h"
+#include "idpool.h"
 #include "network.h"
+#include "offload.h"
+#include "packet.h"
+#include "qsbr.h"
+#include "ring.h"
+#include "session.h"
+#include "shard.h"
+#include "switch.h"
+#include "trace.h"
 #include "utils.h"
 
-typedef struct accessory_t {
+/* probe threads only open accessories, or run sync io */
+#define PROBE_THREAD_STACK_SIZE (256 * 1024)
+
+/* keepalive period, shorter if link timeout leaves less than 3 of them */
+#define CTRL_PING_INTERVAL_US 1000000
+
+/* exit waits this long for accessories to drain, see stop_accessories() */
+#define ACC_STOP_TIMEOUT_US 2000000
+#define ACC_STOP_POLL_US 10000
+
+typedef struct accessory_t accessory_t;
+
+/* usb transfer, packet buffer is attached while in flight */
+typedef struct acc_xfer_t {
+    accessory_t *acc;
+    struct libusb_transfer *transfer;
+    packet_t *pkt;
+    uint64_t submit_ts;
+} acc_xfer_t;
+
+/* probe thread takes device and id its handshake reserved, if any */
+typedef struct usb_probe_t {
+    struct libusb_device *dev;
+    accessory_id_t id;
+} usb_probe_t;
+
+struct accessory_t {
     uint8_t ep_in;
     uint8_t ep_out;
     accessory_id_t id;
+    /* remembered id is checked against first packet, see session.h */
+    bool is_id_confirmed;
+    /* address of another phone was claimed, reported once */
+    bool is_id_refused;
+    char usb_serial[SESSION_SERIAL_SIZE];
     volatile bool is_running;
     struct libusb_device_handle *handle;
-} accessory_t;
 
-static struct {
-    bool used;
-    accessory_t *acc;
-} acc_list[256] = {
-    [0]     =   { .used = true }, /* reserved, network addr   */
-    [1]     =   { .used = true }, /* reserved, host addr      */
-    [255]   =   { .used = true }, /* reserved, broadcast addr */
-};
+    /* data plane thread owning usb context of handle */
+    shard_t *shard;
+
+    /* see free_accessory() */
+    atomic_bool is_retired;
+    uint64_t retire_epoch;
+    accessory_t *retire_next;
+
+    /* every accessory until destroyed, published or not */
+    accessory_t *live_next;
+
+    /* packets from tun thread, see kick_accessory_writer() */
+    ring_t tx_ring;
+    packet_t *tx_held;
+    /* ring is drained into flow queues by writer, see fq.h */
+    fq_t fq;
+    atomic_bool tx_scheduled;
+    atomic_ulong tx_dropped;
+    pthread_t writer_thread;
+
+    /* async io, see start_accessory_transfers() */
+    pthread_mutex_t lock;
+    pthread_cond_t tx_cond;
+    acc_xfer_t *xfers;
+    acc_xfer_t **out_free;
+    size_t xfers_cnt;
+    size_t out_free_cnt;
+    size_t in_flight;
+    size_t out_in_flight;
+
+    /* peer talks framed transfers, see framing.h */
+    bool is_framed;
+    acc_xfer_t *batch_xfer;
+    frame_batch_t batch;
+    uint64_t batch_ts;
+    bool on_batch_list;
+    accessory_t *batch_next;
+
+    /* peer sent FRAME_CAP_LZ4, tx stats are shard thread only */
+    bool is_lz4;
+    compress_stats_t lz_stats;
+
+    /* peer tun mtu, jumbo once confirmed in caps, read by tun thread */
+    atomic_uint mtu;
+
+    /* transfer being parsed, packets switched to peers slice it */
+    packet_t *rx_pkt;
+
+    /* stale tcp acks of transfer being parsed, see ackfilter.h */
+    bool filter_acks;
+    ack_filter_t rx_acks;
+    size_t rx_frame;
+
+    /* see metrics.h for who writes what */
+    acc_metrics_t metrics;
+
+    /* rates are set by main thread, see ratelimit.h */
+    rate_limiter_t limits[RATE_DIRS];
+
+    /* upstream tcp coalescing, tun offload only */
+    bool has_gro;
+    gro_t gro;
+
+    /* phone sent FRAME_CAP_CTRL, see framing.h */
+    atomic_bool has_ctrl;
+    /* last transfer from phone, rx thread writes */
+    atomic_uint_least64_t rx_ts;
+    /* pinged by tx thread, or shard thread in async io */
+    uint32_t ping_seq;
+    uint64_t ping_ts;
+    bool on_ctrl_list;
+    accessory_t *ctrl_next;
+    /* last counters phone reported, rx thread only */
+    uint64_t phone_stats[CTRL_STATS];
+};
+
+/*
+ * lookups are lock free: slots are published atomically and accessory
+ * is reclaimed by its shard only after all readers passed quiescent state.
+ * table is indexed by host part of address, sized to configured network.
+ */
+static _Atomic(accessory_t *) *acc_list;
+static size_t acc_list_size;
+
+/* free ids, writers only */
+static id_pool_t acc_ids;
+static pthread_mutex_t acc_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* taken before acc->lock, see stop_accessories() */
+static accessory_t *live_list;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool is_stopping;
+
+bool init_accessory_table(size_t size)
+{
+    if ((acc_list = calloc(size, sizeof(*acc_list))) == NULL ||
+            !id_pool_init(&acc_ids, size)) {
+        fprintf(stderr, "Unable to allocate accessory table\n");
+        free(acc_list);
+        acc_list = NULL;
+        return false;
+    }
+
+    acc_list_size = size;
+
+    id_pool_reserve(&acc_ids, 0);        /* network addr   */
+    id_pool_reserve(&acc_ids, 1);        /* host addr      */
+    id_pool_reserve(&acc_ids, size - 1); /* broadcast addr */
+
+    return true;
+}
+
+static bool is_accessory_id_valid(accessory_id_t id)
+{
+    return id > 1 && id < acc_list_size - 1;
+}
+
+/* must be called with acc_list_lock held */
+static void clear_accessory_id(accessory_t *acc)
+{
+    accessory_t *owner;
+
+    if (!is_accessory_id_valid(acc->id)) {
+        return;
+    }
+
+    owner = atomic_load_explicit(&acc_list[acc->id], memory_order_relaxed);
+
+    /* reconnected phone may own the id already */
+    if (owner == acc || owner == NULL) {
+        atomic_store_explicit(&acc_list[acc->id], NULL,
+                memory_order_release);
+        id_pool_release(&acc_ids, acc->id);
+    }
+}
+
+static void release_accessory_id(accessory_t *acc)
+{
+    pthread_mutex_lock(&acc_list_lock);
+    clear_accessory_id(acc);
+    pthread_mutex_unlock(&acc_list_lock);
+}
+
+/*
+ * must be called with acc_list_lock held, reserves id if it's free.
+ * published id goes only to stale accessory of same phone. reserved one
+ * not published yet is some handshake's: gen_new_serial_string() binds
+ * its phone to the id under this lock, so session table tells whose.
+ */
+static bool can_take_id(accessory_id_t id, const char *usb_serial)
+{
+    accessory_t *owner;
+
+    owner = atomic_load_explicit(&acc_list[id], memory_order_relaxed);
+
+    if (owner) {
+        return *usb_serial && !strcmp(owner->usb_serial, usb_serial);
+    }
+
+    return id_pool_reserve(&acc_ids, id) || find_session_id(usb_serial) == id;
+}
+
+accessory_id_t acquire_accessory_id(void)
+{
+    accessory_id_t ret = 0;
+
+    pthread_mutex_lock(&acc_list_lock);
+
+    if (!id_pool_acquire(&acc_ids, &ret)) {
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&acc_list_lock);
+
+    return ret;
+}
+
+void return_accessory_id(accessory_id_t id)
+{
+    if (!is_accessory_id_valid(id)) {
+        return;
+    }
+
+    pthread_mutex_lock(&acc_list_lock);
+
+    /* accessory of phone may have published it meanwhile */
+    if (atomic_load_explicit(&acc_list[id], memory_order_relaxed) == NULL) {
+        id_pool_release(&acc_ids, id);
+    }
+
+    pthread_mutex_unlock(&acc_list_lock);
+}
+
+void defer_accessory_id(accessory_id_t id)
+{
+    if (!is_accessory_id_valid(id)) {
+        return;
+    }
+
+    pthread_mutex_lock(&acc_list_lock);
+
+    /* released ids go to tail of free list */
+    if (id_pool_reserve(&acc_ids, id)) {
+        id_pool_release(&acc_ids, id);
+    }
+
+    pthread_mutex_unlock(&acc_list_lock);
+}
+
+/*
+ * remembered address of phone, unless another one holds it. handshake
+ * of same phone or its stale accessory may hold it already, then it's
+ * handed over. acc is published right away if given.
+ */
+static bool take_session_id(accessory_id_t id, const char *usb_serial,
+        accessory_t *acc)
+{
+    bool is_taken;
+
+    if (!is_accessory_id_valid(id)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&acc_list_lock);
+
+    if ((is_taken = can_take_id(id, usb_serial)) && acc) {
+        acc->id = id;
+        atomic_store_explicit(&acc_list[id], acc, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&acc_list_lock);
+
+    return is_taken;
+}
+
+/* reserved by handshake of this phone, see is_accessory_present() */
+bool publish_accessory(accessory_t *acc, accessory_id_t id)
+{
+    accessory_t *owner;
+    bool is_taken;
+
+    if (!is_accessory_id_valid(id)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&acc_list_lock);
+
+    owner = atomic_load_explicit(&acc_list[id], memory_order_relaxed);
+
+    /* handshake may have taken it over from stale accessory of phone */
+    if ((is_taken = owner == NULL ||
+                !strcmp(owner->usb_serial, acc->usb_serial))) {
+        acc->id = id;
+        atomic_store_explicit(&acc_list[id], acc, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&acc_list_lock);
+
+    return is_taken;
+}
+
+/*
+ * phone kept address host forgot, e.g. table was lost. address another
+ * phone holds, or reserved in its handshake, is not taken over.
+ */
+static bool rebind_accessory_id(accessory_t *acc, accessory_id_t id)
+{
+    bool is_taken;
+
+    pthread_mutex_lock(&acc_list_lock);
+
+    if ((is_taken = can_take_id(id, acc->usb_serial))) {
+        clear_accessory_id(acc);
+        acc->id = id;
+        atomic_store_explicit(&acc_list[id], acc, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&acc_list_lock);
+
+    return is_taken;
+}
+
+/* caller must be qsbr reader, i.e. shard thread */
+static accessory_t *find_accessory_by_id(accessory_id_t id)
+{
+    if (!is_accessory_id_valid(id)) {
+        return NULL;
+    }
+
+    return atomic_load_explicit(&acc_list[id], memory_order_acquire);
+}
+
+/* must be called with acc->lock held */
+static void stop_accessory_transfers(accessory_t *acc)
+{
+    if (!acc->is_running) {
+        return;
+    }
+
+    acc->is_running = false;
+
+    if (acc->batch_xfer) {
+        packet_free(acc->batch_xfer->pkt);
+        acc->batch_xfer->pkt = NULL;
+        acc->out_free[acc->out_free_cnt++] = acc->batch_xfer;
+        acc->batch_xfer = NULL;
+        atomic_fetch_sub(&acc->shard->pending_batches, 1);
+    }
+
+    for (size_t i = 0; i < acc->xfers_cnt; i++) {
+        libusb_cancel_transfer(acc->xfers[i].transfer);
+    }
+
+    pthread_cond_broadcast(&acc->tx_cond);
+}
+
+/* must be called with acc->lock held */
+static bool is_accessory_drained(accessory_t *acc)
+{
+    return !acc->is_running && !acc->in_flight &&
+        !atomic_load(&acc->tx_scheduled);
+}
+
+static uint64_t get_ping_interval_us(void)
+{
+    uint64_t timeout_us = get_simple_rt_config()->link_timeout_ms * 1000ULL;
+
+    return timeout_us / 3 < CTRL_PING_INTERVAL_US ?
+        timeout_us / 3 : CTRL_PING_INTERVAL_US;
+}
+
+/* phone promised to answer pings, but nothing came for link timeout */
+static bool is_link_dead(accessory_t *acc, uint64_t now)
+{
+    uint64_t rx_ts = atomic_load_explicit(&acc->rx_ts, memory_order_relaxed);
+
+    if (!atomic_load(&acc->has_ctrl) || now <= rx_ts ||
+            now - rx_ts < get_simple_rt_config()->link_timeout_ms * 1000ULL) {
+        return false;
+    }
+
+    fprintf(stderr, "Accessory %u: nothing heard for %llu ms, "
+            "dropping it\n", acc->id,
+            (unsigned long long) (now - rx_ts) / 1000);
+    counter_add(&acc->metrics.link_timeouts, 1);
+    flight_dump_later("link timeout");
+
+    return true;
+}
+
+/* ping payload, tx thread only */
+static void fill_ping(accessory_t *acc, uint8_t *ping, uint64_t now)
+{
+    ping[0] = acc->ping_seq >> 24;
+    ping[1] = acc->ping_seq >> 16;
+    ping[2] = acc->ping_seq >> 8;
+    ping[3] = acc->ping_seq;
+    put_be64(&ping[4], now);
+
+    acc->ping_seq++;
+    counter_add(&acc->metrics.link_pings, 1);
+}
+
+/* rtt is measured on host clock only, phone just echoes ping */
+static void handle_accessory_pong(accessory_t *acc, const uint8_t *data,
+        size_t size)
+{
+    uint64_t now = get_time_us(), ts, rtt, srtt;
+
+    if (size < CTRL_PONG_SIZE || (ts = get_be64(&data[4])) > now) {
+        return;
+    }
+
+    rtt = now - ts;
+    srtt = counter_get(&acc->metrics.link_srtt_us);
+
+    counter_add(&acc->metrics.link_pongs, 1);
+    hist_record(&acc->metrics.link_rtt, rtt);
+    atomic_store_explicit(&acc->metrics.link_srtt_us,
+            srtt ? srtt - srtt / 8 + rtt / 8 : rtt, memory_order_relaxed);
+
+    for (size_t i = 0; i < CTRL_STATS; i++) {
+        acc->phone_stats[i] = get_be64(&data[CTRL_PING_SIZE + i * 8]);
+    }
+
+    atomic_store_explicit(&acc->metrics.phone_tun_dropped,
+            acc->phone_stats[CTRL_STAT_TUN_DROPPED], memory_order_relaxed);
+}
+
+/* rx thread, async io has it on shard list, sync writer waits for pings */
+static void enable_accessory_ctrl(accessory_t *acc)
+{
+    puts("accessory answers keepalives");
+
+    atomic_store_explicit(&acc->rx_ts, get_time_us(), memory_order_relaxed);
+    atomic_store(&acc->has_ctrl, true);
+
+    if (acc->xfers_cnt) {
+        acc->on_ctrl_list = true;
+        acc->ctrl_next = acc->shard->ctrl_list;
+        acc->shard->ctrl_list = acc;
+    } else {
+        pthread_mutex_lock(&acc->lock);
+        pthread_cond_signal(&acc->tx_cond);
+        pthread_mutex_unlock(&acc->lock);
+    }
+}
+
+static void handle_accessory_packet(accessory_t *acc,
+        const uint8_t *data, size_t size)
+{
+    accessory_id_t id;
+
+    /* map acc->id on first valid packet, resumed one is just confirmed */
+    if (!acc->is_id_confirmed) {
+        id = get_acc_id_from_packet(data, size, false);
+        if (!is_accessory_id_valid(id)) {
+            return;
+        }
+
+        /* its packets are dropped, phone owning the address keeps it */
+        if (id != acc->id && !rebind_accessory_id(acc, id)) {
+            if (!acc->is_id_refused) {
+                acc->is_id_refused = true;
+                fprintf(stderr, "Accessory sends from address held by "
+                        "another phone, dropping\n");
+            }
+            return;
+        }
+
+        acc->is_id_confirmed = true;
+        bind_session(acc->usb_serial, id);
+    }
+
+    if (!rate_limit_packet(&acc->limits[RATE_UP], RATE_UP, size)) {
+        counter_add(&acc->metrics.rx_rate_dropped, 1);
+        return;
+    }
+
+    counter_add(&acc->metrics.rx_packets, 1);
+    counter_add(&acc->metrics.rx_bytes, size);
+
+    /* rx buffer is ours, see clamp_uplink_mss() */
+    clamp_uplink_mss((uint8_t *) data, size);
+
+    if (switch_accessory_packet(acc->rx_pkt, data, size, acc->id)) {
+        return;
+    }
+
+    if ((acc->has_gro ? gro_write_packet(&acc->gro, data, size) :
+                send_network_packet(data, size, NULL, acc->id)) < 0) {
+        counter_add(&acc->metrics.rx_errors, 1);
+        pthread_mutex_lock(&acc->lock);
+        stop_accessory_transfers(acc);
+        pthread_mutex_unlock(&acc->lock);
+    }
+}
+
+static ssize_t write_gro_packet(void *arg, const uint8_t *data, size_t size,
+        const tun_gso_t *gso)
+{
+    accessory_t *acc = arg;
+
+    return send_network_packet(data, size, gso, acc->id);
+}
+
+static void handle_accessory_frame(void *arg, uint8_t type, uint8_t flags,
+        const uint8_t *data, size_t size)
+{
+    accessory_t *acc = arg;
+
+    simple_rt_config_t *config = get_simple_rt_config();
+    uint8_t buf[FRAME_BATCH_SIZE];
+    packet_t *rx = acc->rx_pkt;
+    ssize_t len;
+
+    if (type == FRAME_TYPE_CAPS && (flags & FRAME_CAP_LZ4) &&
+            config->compress && !acc->is_lz4) {
+        puts("accessory uses lz4 compression");
+        acc->is_lz4 = true;
+    }
+
+    /* never above ours, both tuns must take the packet */
+    if (type == FRAME_TYPE_CAPS && (flags & FRAME_CAP_MTU) && size >= 2) {
+        unsigned int mtu = data[0] << 8 | data[1];
+
+        if (mtu >= MIN_MTU && mtu <= config->mtu &&
+                mtu != atomic_load(&acc->mtu)) {
+            printf("accessory mtu %u\n", mtu);
+            atomic_store(&acc->mtu, mtu);
+        }
+    }
+
+    if (type == FRAME_TYPE_CAPS && (flags & FRAME_CAP_CTRL) &&
+            config->link_timeout_ms && !atomic_load(&acc->has_ctrl)) {
+        enable_accessory_ctrl(acc);
+    }
+
+    if (type == FRAME_TYPE_CTRL && flags == CTRL_PONG) {
+        handle_accessory_pong(acc, data, size);
+    }
+
+    if (type != FRAME_TYPE_DATA) {
+        return;
+    }
+
+    if (acc->filter_acks &&
+            ack_filter_is_dropped(&acc->rx_acks, acc->rx_frame++)) {
+        counter_add(&acc->metrics.rx_ack_dropped, 1);
+        return;
+    }
+
+    if (!(flags & FRAME_FLAG_LZ4)) {
+        handle_accessory_packet(acc, data, size);
+        return;
+    }
+
+    if ((len = lz_decompress(data, size, buf, sizeof(buf))) < 0) {
+        fprintf(stderr, "Malformed compressed packet, size %zu\n", size);
+        return;
+    }
+
+    /* packet is not in rx buffer anymore, switch must copy it */
+    acc->rx_pkt = NULL;
+    handle_accessory_packet(acc, buf, len);
+    acc->rx_pkt = rx;
+}
+
+/* compressed packets are not looked into, acks rarely are */
+static void collect_accessory_ack(void *arg, uint8_t type, uint8_t flags,
+        const uint8_t *data, size_t size)
+{
+    accessory_t *acc = arg;
+
+    if (type == FRAME_TYPE_DATA) {
+        ack_filter_add(&acc->rx_acks,
+                flags & FRAME_FLAG_LZ4 ? NULL : data, size);
+    }
+}
+
+/* packets are written into tun right from the transfer buffer */
+static void handle_accessory_transfer(accessory_t *acc, packet_t *pkt)
+{
+    acc->rx_pkt = pkt;
+
+    /* any transfer proves link alive, not just pongs */
+    if (atomic_load_explicit(&acc->has_ctrl, memory_order_relaxed)) {
+        atomic_store_explicit(&acc->rx_ts, get_time_us(),
+                memory_order_relaxed);
+    }
+
+    if (!is_framed_transfer(pkt->data, pkt->len)) {
+        handle_accessory_packet(acc, pkt->data, pkt->len);
+    } else {
+        if (!acc->is_framed) {
+            puts("accessory uses framed transfers");
+            acc->is_framed = true;
+        }
+
+        /* whole transfer is seen first, acks with newer ones after it go */
+        if (acc->filter_acks) {
+            ack_filter_reset(&acc->rx_acks);
+            acc->rx_frame = 0;
+            parse_framed_transfer(pkt->data, pkt->len,
+                    collect_accessory_ack, acc);
+        }
+
+        if (parse_framed_transfer(pkt->data, pkt->len,
+                    handle_accessory_frame, acc) < 0) {
+            fprintf(stderr, "Malformed framed transfer, size %zu\n",
+                    pkt->len);
+        }
+    }
+
+    /* segments of one batch are coalesced, nothing waits for next one */
+    if (acc->has_gro && gro_flush(&acc->gro) < 0) {
+        counter_add(&acc->metrics.rx_errors, 1);
+        pthread_mutex_lock(&acc->lock);
+        stop_accessory_transfers(acc);
+        pthread_mutex_unlock(&acc->lock);
+    }
+
+    acc->rx_pkt = NULL;
+}
+
+/* rx buffer is reused unless somebody still holds a slice of it */
+static packet_t *recycle_rx_packet(packet_t *pkt)
+{
+    if (!packet_is_shared(pkt)) {
+        return pkt;
+    }
+
+    packet_free(pkt);
+
+    return packet_alloc_xfer();
+}
+
+/* unplug is no news, anything else is worth a look at what came before */
+static void trace_usb_error(accessory_t *acc, int status)
+{
+    trace_packet(usb_error, acc->id, status);
+
+    if (status != LIBUSB_TRANSFER_NO_DEVICE) {
+        flight_dump_later("usb transfer failed");
+    }
+}
+
+/* packet leaves tx queue, tx thread only */
+static void count_tx_packet(accessory_t *acc, packet_t *pkt, uint64_t now)
+{
+    counter_add(&acc->metrics.tx_packets, 1);
+    counter_add(&acc->metrics.tx_bytes, pkt->len);
+
+    if (pkt->ts) {
+        hist_record(&acc->metrics.tx_residence, now - pkt->ts);
+    }
+}
+
+/* tun threads only hand packets over, flow queues decide what goes next */
+static void pull_tx_queue(accessory_t *acc, uint64_t now)
+{
+    packet_t *pkt;
+
+    while ((pkt = ring_pop(&acc->tx_ring)) != NULL) {
+        fq_enqueue(&acc->fq, pkt, now);
+    }
+}
+
+/* usb write timeouts are retried until accessory stops, see is_link_dead() */
+static ssize_t write_sync_transfer(accessory_t *acc, const uint8_t *data,
+        size_t size)
+{
+    ssize_t ret;
+
+    while ((ret = write_usb_packet(acc->handle, acc->ep_out,
+                    data, size)) == 0 && acc->is_running) {
+    }
+
+    return ret;
+}
+
+/* synchronous io sends ping in a framed transfer of its own */
+static void write_sync_ping(accessory_t *acc, uint64_t now)
+{
+    uint8_t buf[FRAME_BATCH_HDR_SIZE + FRAME_HDR_SIZE + CTRL_PING_SIZE + 1];
+    uint8_t ping[CTRL_PING_SIZE];
+    frame_batch_t batch;
+
+    acc->ping_ts = now;
+    fill_ping(acc, ping, now);
+
+    frame_batch_init(&batch, buf, sizeof(buf));
+    frame_batch_add(&batch, FRAME_TYPE_CTRL, CTRL_PING, ping, sizeof(ping));
+
+    if (write_sync_transfer(acc, buf, frame_batch_finish(&batch)) < 0) {
+        counter_add(&acc->metrics.tx_errors, 1);
+    }
+}
+
+/* must be called with acc->lock held, true once ping is due */
+static bool wait_accessory_writer(accessory_t *acc)
+{
+    uint64_t now, wait_us;
+    struct timespec ts;
+
+    if (!atomic_load(&acc->has_ctrl)) {
+        pthread_cond_wait(&acc->tx_cond, &acc->lock);
+        return false;
+    }
+
+    now = get_time_us();
+    if (now - acc->ping_ts >= get_ping_interval_us()) {
+        return true;
+    }
+
+    /* condvar waits on realtime clock */
+    wait_us = acc->ping_ts + get_ping_interval_us() - now;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (ts.tv_nsec / 1000 + wait_us) / 1000000;
+    ts.tv_nsec = (ts.tv_nsec / 1000 + wait_us) % 1000000 * 1000;
+
+    return pthread_cond_timedwait(&acc->tx_cond, &acc->lock,
+            &ts) == ETIMEDOUT;
+}
+
+/* synchronous io: one packet at a time, slow phone stalls own queue only */
+static void *accessory_writer_proc(void *arg)
+{
+    accessory_t *acc = arg;
+    packet_t *pkt;
+    uint64_t start;
+
+    pin_to_shard_cpu(acc->shard);
+
+    while (acc->is_running) {
+        atomic_store(&acc->tx_scheduled, false);
+
+        while (acc->is_running) {
+            start = get_time_us();
+
+            /* pings go even with busy queue, phone may have nothing to say */
+            if (atomic_load(&acc->has_ctrl) &&
+                    start - acc->ping_ts >= get_ping_interval_us()) {
+                write_sync_ping(acc, start);
+            }
+
+            pull_tx_queue(acc, start);
+
+            if ((pkt = fq_dequeue(&acc->fq, start)) == NULL) {
+                break;
+            }
+
+            count_tx_packet(acc, pkt, start);
+            trace_packet(usb_out_submit, acc->id, pkt->len);
+
+            if (write_sync_transfer(acc, pkt->data, pkt->len) <= 0) {
+                /* seems like accessory removed, just ignore */
+                counter_add(&acc->metrics.tx_errors, 1);
+                trace_usb_error(acc, LIBUSB_TRANSFER_ERROR);
+            } else {
+                hist_record(&acc->metrics.usb_out_latency,
+                        get_time_us() - start);
+                trace_packet(usb_out_done, acc->id, pkt->len);
+            }
+            packet_free(pkt);
+        }
+
+        pthread_mutex_lock(&acc->lock);
+        while (acc->is_running && !atomic_load(&acc->tx_scheduled) &&
+                !wait_accessory_writer(acc)) {
+        }
+        pthread_mutex_unlock(&acc->lock);
+    }
+
+    return NULL;
+}
+
+static void accessory_worker_proc(accessory_t *acc)
+{
+    packet_t *pkt;
+    ssize_t nread;
+
+    puts("accessory connected!");
+
+    /* sync io threads stay near shard of accessory, see -C */
+    pin_to_shard_cpu(acc->shard);
+
+    if ((pkt = packet_alloc_xfer()) == NULL) {
+        fprintf(stderr, "Packet pool exhausted\n");
+        goto end;
+    }
+
+    /* exit may have walked accessories already */
+    pthread_mutex_lock(&acc->lock);
+    acc->is_running = !atomic_load(&is_stopping);
+    pthread_mutex_unlock(&acc->lock);
+
+    if (!acc->is_running) {
+        goto end;
+    }
+
+    if (pthread_create(&acc->writer_thread, NULL,
+                accessory_writer_proc, acc) != 0) {
+        fprintf(stderr, "Unable to start accessory writer\n");
+        goto end;
+    }
+
+    /* switched packets look up peers, see switch_accessory_packet() */
+    qsbr_register_thread();
+
+    /* acc->id is mapped on first valid packet */
+    while (acc->is_running && pkt) {
+        qsbr_offline();
+        nread = read_usb_packet(acc->handle, acc->ep_in,
+                pkt->data, packet_xfer_size());
+        qsbr_online();
+
+        if (nread > 0) {
+            trace_packet(usb_in_done, acc->id, nread);
+            pkt->len = nread;
+            handle_accessory_transfer(acc, pkt);
+            pkt = recycle_rx_packet(pkt);
+        } else if (nread < 0) {
+            counter_add(&acc->metrics.rx_errors, 1);
+            trace_usb_error(acc, LIBUSB_TRANSFER_ERROR);
+            break;
+        } else if (is_link_dead(acc, get_time_us())) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&acc->lock);
+    stop_accessory_transfers(acc);
+    pthread_mutex_unlock(&acc->lock);
+
+    pthread_join(acc->writer_thread, NULL);
+
+    qsbr_unregister_thread();
+
+end:
+    packet_free(pkt);
+    acc->is_running = false;
+    free_accessory(acc);
+}
+
+/* must be called with acc->lock held, xfer->pkt is sent */
+static void submit_out_transfer(accessory_t *acc, acc_xfer_t *xfer,
+        size_t size)
+{
+    xfer->submit_ts = get_time_us();
+    trace_packet(usb_out_submit, acc->id, size);
+
+    if (submit_usb_packet(xfer->transfer, xfer->pkt, size) == 0) {
+        acc->in_flight++;
+        acc->out_in_flight++;
+    } else {
+        packet_free(xfer->pkt);
+        xfer->pkt = NULL;
+        acc->out_free[acc->out_free_cnt++] = xfer;
+        stop_accessory_transfers(acc);
+    }
+}
+
+/* must be called with acc->lock held */
+static void flush_accessory_batch(accessory_t *acc)
+{
+    acc_xfer_t *xfer = acc->batch_xfer;
+
+    if (!xfer) {
+        return;
+    }
+
+    acc->batch_xfer = NULL;
+    atomic_fetch_sub(&acc->shard->pending_batches, 1);
+
+    submit_out_transfer(acc, xfer, frame_batch_finish(&acc->batch));
+}
+
+/* must be called with acc->lock held, xfer->pkt is new batch */
+static void open_accessory_batch(accessory_t *acc, acc_xfer_t *xfer)
+{
+    acc->batch_xfer = xfer;
+    atomic_fetch_add(&acc->shard->pending_batches, 1);
+
+    /* writer runs in shard thread only, so does the list */
+    if (!acc->on_batch_list) {
+        acc->on_batch_list = true;
+        acc->batch_next = acc->shard->batch_list;
+        acc->shard->batch_list = acc;
+    }
+
+    frame_batch_init(&acc->batch, xfer->pkt->data, FRAME_BATCH_SIZE);
+    acc->batch_ts = get_time_us();
+}
+
+/*
+ * must be called with acc->lock held, false if no transfer is free.
+ * takes ownership of pkt on success.
+ */
+static bool write_accessory_packet(accessory_t *acc, packet_t *pkt)
+{
+    acc_xfer_t *xfer;
+    uint8_t lz_buf[FRAME_BATCH_SIZE];
+    const uint8_t *data = pkt->data;
+    size_t len = pkt->len, lz_len;
+    uint8_t flags = 0;
+
+    /* compressed once, goes into current or next batch */
+    if (acc->is_framed && acc->is_lz4 &&
+            (acc->batch_xfer || acc->out_free_cnt) &&
+            (lz_len = compress_packet(&acc->lz_stats, pkt->data, pkt->len,
+                                      lz_buf, sizeof(lz_buf))) != 0) {
+        data = lz_buf;
+        len = lz_len;
+        flags = FRAME_FLAG_LZ4;
+    }
+
+    /* doesn't fit even into empty batch, it's a drop, not a packet sent */
+    if (acc->is_framed && FRAME_BATCH_HDR_SIZE + FRAME_HDR_SIZE + len + 1 >
+            FRAME_BATCH_SIZE) {
+        fprintf(stderr, "Packet too big for batch, size %zu\n", pkt->len);
+        trace_packet(tx_dropped, acc->id, pkt->len);
+        atomic_fetch_add(&acc->tx_dropped, 1);
+        packet_free(pkt);
+        return true;
+    }
+
+    if (acc->is_framed && acc->batch_xfer && frame_batch_add(&acc->batch,
+                FRAME_TYPE_DATA, flags, data, len)) {
+        count_tx_packet(acc, pkt, get_time_us());
+        packet_free(pkt);
+        return true;
+    }
+
+    /* batch is full, send it and start new one */
+    flush_accessory_batch(acc);
+
+    if (!acc->out_free_cnt) {
+        return false;
+    }
+
+    count_tx_packet(acc, pkt, get_time_us());
+    xfer = acc->out_free[--acc->out_free_cnt];
+
+    /* raw packet goes out right from its buffer, framed peer takes it too */
+    if (!acc->is_framed || (xfer->pkt = packet_alloc_xfer()) == NULL) {
+        xfer->pkt = pkt;
+        submit_out_transfer(acc, xfer, pkt->len);
+        return true;
+    }
+
+    /* fits, checked above */
+    open_accessory_batch(acc, xfer);
+    frame_batch_add(&acc->batch, FRAME_TYPE_DATA, flags, data, len);
+    packet_free(pkt);
+
+    return true;
+}
+
+/* async writer, runs in shard thread */
+static void run_accessory_writer(accessory_t *acc)
+{
+    simple_rt_config_t *config = get_simple_rt_config();
+    uint64_t now;
+
+    pthread_mutex_lock(&acc->lock);
+
+    while (acc->is_running) {
+        /* even with no free transfers, so codel sees real queue */
+        now = get_time_us();
+        pull_tx_queue(acc, now);
+
+        if (!acc->tx_held &&
+                (acc->tx_held = fq_dequeue(&acc->fq, now)) == NULL) {
+            break;
+        }
+
+        /* no free transfers, out completion runs writer again */
+        if (!write_accessory_packet(acc, acc->tx_held)) {
+            break;
+        }
+
+        acc->tx_held = NULL;
+    }
 
-static pthread_rwlock_t acc_list_lock = PTHREAD_RWLOCK_INITIALIZER;
+    /*
+     * adaptive flush: batch grows only while previous transfer is on
+     * the wire, but never longer than flush latency budget
+     */
+    if (acc->batch_xfer && (!acc->out_in_flight ||
+                get_time_us() - acc->batch_ts >= config->flush_latency_us)) {
+        flush_accessory_batch(acc);
+    }
 
-static bool is_accessory_id_valid(accessory_id_t id)
-{
-    return id && id < ARRAY_SIZE(acc_list);
+    pthread_mutex_unlock(&acc->lock);
 }
 
-static accessory_id_t acquire_accessory_id(void)
+/*
+ * must be called with acc->lock held. ping joins open batch, which goes
+ * right away, so rtt doesn't include flush latency. with no transfer
+ * free, phone isn't reading and ping waits for next round.
+ */
+static void write_accessory_ping(accessory_t *acc, uint64_t now)
 {
-    accessory_id_t ret = 0;
+    uint8_t ping[CTRL_PING_SIZE];
+    acc_xfer_t *xfer;
 
-    pthread_rwlock_wrlock(&acc_list_lock);
+    acc->ping_ts = now;
 
-    for (uint32_t i = 0; i < ARRAY_SIZE(acc_list); i++) {
-        if (!acc_list[i].used) {
-            acc_list[i].used = true;
-            ret = i;
-            break;
+    if (!acc->batch_xfer || acc->batch.len + FRAME_HDR_SIZE +
+            CTRL_PING_SIZE + 1 > acc->batch.size) {
+        flush_accessory_batch(acc);
+
+        if (!acc->out_free_cnt) {
+            return;
         }
-    }
 
-    pthread_rwlock_unlock(&acc_list_lock);
+        xfer = acc->out_free[acc->out_free_cnt - 1];
+        if ((xfer->pkt = packet_alloc_xfer()) == NULL) {
+            return;
+        }
 
-    return ret;
+        acc->out_free_cnt--;
+        open_accessory_batch(acc, xfer);
+    }
+
+    fill_ping(acc, ping, now);
+    frame_batch_add(&acc->batch, FRAME_TYPE_CTRL, CTRL_PING,
+            ping, sizeof(ping));
+    flush_accessory_batch(acc);
 }
 
-static void release_accessory_id(accessory_id_t id)
+static void kick_accessory_writer(accessory_t *acc)
 {
-    if (!is_accessory_id_valid(id)) {
+    /* writer is going to run anyway, retired one won't need it */
+    if (atomic_load(&acc->is_retired) ||
+            atomic_exchange(&acc->tx_scheduled, true)) {
         return;
     }
 
-    pthread_rwlock_wrlock(&acc_list_lock);
-
-    acc_list[id].acc = NULL;
-    acc_list[id].used = false;
+    if (acc->xfers_cnt) {
+        if (!ring_push(&acc->shard->kick_ring, acc)) {
+            atomic_store(&acc->tx_scheduled, false);
+            return;
+        }
 
-    pthread_rwlock_unlock(&acc_list_lock);
+        /* own shard drains kick ring after current events anyway */
+        if (get_current_shard() != acc->shard) {
+            wakeup_shard(acc->shard);
+        }
+    } else {
+        pthread_mutex_lock(&acc->lock);
+        pthread_cond_signal(&acc->tx_cond);
+        pthread_mutex_unlock(&acc->lock);
+    }
 }
 
-static bool store_accessory_id(accessory_t *acc, accessory_id_t id)
+static void accessory_transfer_done(accessory_t *acc,
+        struct libusb_transfer *transfer)
 {
-    if (!acc || !is_accessory_id_valid(id)) {
-        return false;
+    bool drained;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+            transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "accessory transfer failed, status %d\n",
+                transfer->status);
+        counter_add(transfer->endpoint & LIBUSB_ENDPOINT_IN ?
+                &acc->metrics.rx_errors : &acc->metrics.tx_errors, 1);
+        trace_usb_error(acc, transfer->status);
     }
 
-    pthread_rwlock_wrlock(&acc_list_lock);
+    pthread_mutex_lock(&acc->lock);
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        stop_accessory_transfers(acc);
+    }
 
-    acc->id = id;
-    acc_list[acc->id].acc = acc;
+    acc->in_flight--;
+    drained = is_accessory_drained(acc);
 
-    pthread_rwlock_unlock(&acc_list_lock);
+    pthread_mutex_unlock(&acc->lock);
 
-    return true;
+    if (drained) {
+        free_accessory(acc);
+    }
 }
 
-static accessory_t *find_accessory_by_id(accessory_id_t id)
+static void accessory_in_cb(struct libusb_transfer *transfer)
 {
-    accessory_t *ret;
+    acc_xfer_t *xfer = transfer->user_data;
+    accessory_t *acc = xfer->acc;
 
-    if (!is_accessory_id_valid(id)) {
-        return NULL;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED && acc->is_running) {
+        trace_packet(usb_in_done, acc->id, transfer->actual_length);
+        xfer->pkt->len = transfer->actual_length;
+        handle_accessory_transfer(acc, xfer->pkt);
+
+        /* keep the pipe busy */
+        if (acc->is_running &&
+                (xfer->pkt = recycle_rx_packet(xfer->pkt)) != NULL &&
+                submit_usb_packet(transfer, xfer->pkt,
+                    packet_xfer_size()) == 0) {
+            return;
+        }
+
+        transfer->status = LIBUSB_TRANSFER_ERROR;
     }
 
-    pthread_rwlock_rdlock(&acc_list_lock);
+    accessory_transfer_done(acc, transfer);
+}
+
+static void accessory_out_cb(struct libusb_transfer *transfer)
+{
+    acc_xfer_t *xfer = transfer->user_data;
+    accessory_t *acc = xfer->acc;
 
-    ret = acc_list[id].acc;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        hist_record(&acc->metrics.usb_out_latency,
+                get_time_us() - xfer->submit_ts);
+        trace_packet(usb_out_done, acc->id, transfer->actual_length);
+    }
 
-    pthread_rwlock_unlock(&acc_list_lock);
+    pthread_mutex_lock(&acc->lock);
+    packet_free(xfer->pkt);
+    xfer->pkt = NULL;
+    acc->out_free[acc->out_free_cnt++] = xfer;
+    acc->out_in_flight--;
+    pthread_mutex_unlock(&acc->lock);
 
-    return ret;
+    /* send packets queued while all transfers were busy */
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        run_accessory_writer(acc);
+    }
+
+    accessory_transfer_done(acc, transfer);
 }
 
-static void accessory_worker_proc(accessory_t *acc)
+static bool start_accessory_transfers(accessory_t *acc, size_t cnt)
 {
-    uint8_t acc_buf[ACC_BUF_SIZE];
-    accessory_id_t id = 0;
-    ssize_t nread;
+    acc_xfer_t *xfer;
 
-    puts("accessory connected!");
+    acc->xfers = calloc(cnt * 2, sizeof(*acc->xfers));
+    acc->out_free = calloc(cnt, sizeof(*acc->out_free));
 
-    acc->is_running = true;
+    if (!acc->xfers || !acc->out_free) {
+        return false;
+    }
 
-    /* read first packet and map acc->id */
-    while (acc->is_running) {
-        if ((nread = read_usb_packet(acc->handle, acc->ep_in,
-                        acc_buf, sizeof(acc_buf))) > 0) {
-            if ((id = get_acc_id_from_packet(acc_buf, nread, false)) != 0) {
-                store_accessory_id(acc, id);
-                break;
-            }
-        } else if (nread < 0) {
-            goto end;
-        } else {
-            continue;
+    for (size_t i = 0; i < cnt * 2; i++) {
+        bool is_in = i < cnt;
+
+        xfer = &acc->xfers[i];
+        xfer->acc = acc;
+        xfer->pkt = NULL;
+        xfer->transfer = alloc_usb_transfer(acc->handle,
+                is_in ? acc->ep_in : acc->ep_out,
+                is_in ? accessory_in_cb : accessory_out_cb, xfer);
+        if (!xfer->transfer) {
+            return false;
+        }
+
+        acc->xfers_cnt++;
+
+        /* out transfers get packets when there is something to send */
+        if (!is_in) {
+            acc->out_free[acc->out_free_cnt++] = xfer;
+        } else if ((xfer->pkt = packet_alloc_xfer()) == NULL) {
+            fprintf(stderr, "Packet pool exhausted\n");
+            return false;
         }
     }
 
-    /* read rest packets */
-    while (acc->is_running) {
-        if ((nread = read_usb_packet(acc->handle, acc->ep_in,
-                        acc_buf, sizeof(acc_buf))) > 0) {
-            if (send_network_packet(acc_buf, nread) < 0) {
-                break;
-            }
-        } else if (nread < 0) {
+    puts("accessory connected!");
+
+    pthread_mutex_lock(&acc->lock);
+
+    /* exit may have walked accessories already */
+    if (atomic_load(&is_stopping)) {
+        pthread_mutex_unlock(&acc->lock);
+        return false;
+    }
+
+    acc->is_running = true;
+
+    for (size_t i = 0; i < cnt; i++) {
+        if (submit_usb_packet(acc->xfers[i].transfer, acc->xfers[i].pkt,
+                    packet_xfer_size()) != 0) {
+            stop_accessory_transfers(acc);
             break;
-        } else {
-            continue;
         }
+
+        acc->in_flight++;
     }
 
-end:
-    acc->is_running = false;
-    free_accessory(acc);
+    pthread_mutex_unlock(&acc->lock);
+
+    /* the last completed transfer frees accessory */
+    return acc->in_flight != 0;
 }
 
-accessory_t *new_accessory(struct libusb_device_handle *handle, uint8_t ep_in, uint8_t ep_out)
+accessory_t *new_accessory(struct libusb_device_handle *handle,
+        shard_t *shard, uint8_t ep_in, uint8_t ep_out,
+        const char *usb_serial)
 {
-    accessory_t *acc = NULL;
+    accessory_t *acc;
+    simple_rt_config_t *config = get_simple_rt_config();
 
-    acc = malloc(sizeof(accessory_t));
-    acc->id = 0;
-    acc->is_running = false;
+    /* zeroed, only what doesn't start out as 0 is set below */
+    if ((acc = calloc(1, sizeof(*acc))) == NULL) {
+        fprintf(stderr, "Unable to allocate accessory\n");
+        return NULL;
+    }
+
+    snprintf(acc->usb_serial, sizeof(acc->usb_serial), "%s", usb_serial);
     acc->handle = handle;
+    acc->shard = shard;
     acc->ep_in = ep_in;
     acc->ep_out = ep_out;
 
+    if (!ring_init(&acc->tx_ring, config->tx_queue_len)) {
+        free(acc);
+        return NULL;
+    }
+
+    if (!fq_init(&acc->fq, config->tx_queue_len, config->mtu,
+                &acc->metrics.aqm)) {
+        ring_destroy(&acc->tx_ring);
+        free(acc);
+        return NULL;
+    }
+
+    acc->fq.filter_acks = config->ack_filter;
+    acc->filter_acks = config->ack_filter;
+
+    pthread_mutex_init(&acc->lock, NULL);
+    pthread_cond_init(&acc->tx_cond, NULL);
+
+    atomic_init(&acc->mtu, DEFAULT_MTU);
+
+    for (size_t dir = 0; dir < RATE_DIRS; dir++) {
+        rate_limiter_init(&acc->limits[dir]);
+    }
+
+    acc->has_gro = config->offload && gro_init(&acc->gro, write_gro_packet, acc);
+
+    pthread_mutex_lock(&live_lock);
+    acc->live_next = live_list;
+    live_list = acc;
+    pthread_mutex_unlock(&live_lock);
+
     return acc;
 }
 
-void free_accessory(accessory_t *acc)
+/* reclaims accessory, nobody may reference it anymore */
+static void destroy_accessory(accessory_t *acc)
 {
-    if (!acc) {
-        return;
+    accessory_t **pp;
+    packet_t *pkt;
+
+    pthread_mutex_lock(&live_lock);
+    for (pp = &live_list; *pp != acc; pp = &(*pp)->live_next) {
     }
+    *pp = acc->live_next;
+    pthread_mutex_unlock(&live_lock);
 
-    if (acc->id) {
-        release_accessory_id(acc->id);
+    if (atomic_load(&acc->tx_dropped)) {
+        printf("Accessory %u: %lu packets dropped, tx queue was full\n",
+                acc->id, atomic_load(&acc->tx_dropped));
+    }
+
+    if (counter_get(&acc->metrics.aqm.codel_drops) ||
+            counter_get(&acc->metrics.aqm.ecn_marks) ||
+            counter_get(&acc->metrics.aqm.overlimit_drops)) {
+        printf("Accessory %u: codel %llu dropped, %llu ecn marked, "
+                "%llu dropped over limit\n", acc->id,
+                (unsigned long long) counter_get(&acc->metrics.aqm.codel_drops),
+                (unsigned long long) counter_get(&acc->metrics.aqm.ecn_marks),
+                (unsigned long long)
+                counter_get(&acc->metrics.aqm.overlimit_drops));
+    }
+
+    if (counter_get(&acc->metrics.tx_rate_dropped) ||
+            counter_get(&acc->metrics.rx_rate_dropped)) {
+        printf("Accessory %u: %llu down, %llu up packets over rate limit\n",
+                acc->id,
+                (unsigned long long) counter_get(&acc->metrics.tx_rate_dropped),
+                (unsigned long long) counter_get(&acc->metrics.rx_rate_dropped));
+    }
+
+    if (counter_get(&acc->metrics.rx_ack_dropped) ||
+            counter_get(&acc->metrics.aqm.ack_drops)) {
+        printf("Accessory %u: %llu up, %llu down tcp acks dropped, "
+                "newer ones followed\n", acc->id,
+                (unsigned long long) counter_get(&acc->metrics.rx_ack_dropped),
+                (unsigned long long) counter_get(&acc->metrics.aqm.ack_drops));
+    }
+
+    if (atomic_load(&acc->has_ctrl)) {
+        printf("Accessory %u: rtt %llu us, %llu of %llu pings answered, "
+                "phone tun dropped %llu packets\n", acc->id,
+                (unsigned long long) counter_get(&acc->metrics.link_srtt_us),
+                (unsigned long long) counter_get(&acc->metrics.link_pongs),
+                (unsigned long long) counter_get(&acc->metrics.link_pings),
+                (unsigned long long) acc->phone_stats[CTRL_STAT_TUN_DROPPED]);
+    }
+
+    /* destroyed by own shard, the list is never walked meanwhile */
+    if (acc->on_ctrl_list) {
+        accessory_t **prev = &acc->shard->ctrl_list;
+
+        while (*prev != acc) {
+            prev = &(*prev)->ctrl_next;
+        }
+        *prev = acc->ctrl_next;
+    }
+
+    retire_accessory_metrics(&acc->metrics, atomic_load(&acc->tx_dropped));
+
+    if (acc->lz_stats.packets) {
+        printf("Accessory %u: lz4 %llu -> %llu bytes (%.0f%%), "
+                "%llu packets skipped, %.0f ns per packet\n", acc->id,
+                (unsigned long long) acc->lz_stats.bytes_in,
+                (unsigned long long) acc->lz_stats.bytes_out,
+                100.0 * acc->lz_stats.bytes_out / acc->lz_stats.bytes_in,
+                (unsigned long long) acc->lz_stats.skipped,
+                (double) acc->lz_stats.cpu_ns / acc->lz_stats.packets);
+    }
+
+    if (acc->has_gro) {
+        if (acc->gro.merged) {
+            printf("Accessory %u: %llu tcp segments coalesced, %llu writes\n",
+                    acc->id, (unsigned long long) acc->gro.merged,
+                    (unsigned long long) acc->gro.writes);
+        }
+
+        gro_destroy(&acc->gro);
     }
 
     if (acc->handle) {
@@ -191,45 +1387,358 @@ void free_accessory(accessory_t *acc)
         libusb_close(acc->handle);
     }
 
+    release_shard(acc->shard);
+
+    for (size_t i = 0; i < acc->xfers_cnt; i++) {
+        libusb_free_transfer(acc->xfers[i].transfer);
+        packet_free(acc->xfers[i].pkt);
+    }
+
+    free(acc->xfers);
+    free(acc->out_free);
+
+    while ((pkt = ring_pop(&acc->tx_ring)) != NULL) {
+        packet_free(pkt);
+    }
+
+    packet_free(acc->tx_held);
+    fq_destroy(&acc->fq);
+    ring_destroy(&acc->tx_ring);
+
+    pthread_cond_destroy(&acc->tx_cond);
+    pthread_mutex_destroy(&acc->lock);
+
     free(acc);
 }
 
-int send_accessory_packet(const uint8_t *data, size_t size,
-        accessory_id_t id)
+/*
+ * unpublishes accessory, memory is reclaimed later by its shard: lookups
+ * in flight may still hold it or push it into kick ring
+ */
+void free_accessory(accessory_t *acc)
+{
+    shard_t *shard;
+
+    if (!acc || atomic_exchange(&acc->is_retired, true)) {
+        return;
+    }
+
+    release_accessory_id(acc);
+
+    shard = acc->shard;
+    acc->retire_epoch = qsbr_retire();
+
+    pthread_mutex_lock(&shard->retire_lock);
+    acc->retire_next = shard->retired;
+    shard->retired = acc;
+    atomic_fetch_add(&shard->retired_cnt, 1);
+    pthread_mutex_unlock(&shard->retire_lock);
+
+    if (get_current_shard() != shard) {
+        wakeup_shard(shard);
+    }
+}
+
+/*
+ * exit: io of every accessory is stopped, its shard frees it once drained
+ * and closes its handle. shards must still run, they own usb contexts.
+ */
+void stop_accessories(void)
 {
     accessory_t *acc;
+    uint64_t deadline = get_time_us() + ACC_STOP_TIMEOUT_US;
+    bool is_empty;
+
+    atomic_store(&is_stopping, true);
+
+    pthread_mutex_lock(&live_lock);
+    for (acc = live_list; acc != NULL; acc = acc->live_next) {
+        pthread_mutex_lock(&acc->lock);
+        stop_accessory_transfers(acc);
+        pthread_mutex_unlock(&acc->lock);
+    }
+    pthread_mutex_unlock(&live_lock);
+
+    /* sync io threads notice within one usb timeout */
+    do {
+        pthread_mutex_lock(&live_lock);
+        is_empty = live_list == NULL;
+        pthread_mutex_unlock(&live_lock);
+    } while (!is_empty && get_time_us() < deadline &&
+            usleep(ACC_STOP_POLL_US) == 0);
+
+    if (!is_empty) {
+        fprintf(stderr, "Some accessories didn't stop in time\n");
+    }
+}
+
+/* retired accessories nobody can reference anymore */
+static accessory_t *collect_reclaimable_accessories(shard_t *shard)
+{
+    accessory_t *ret = NULL;
+    accessory_t **pp, *acc;
 
-    if ((acc = find_accessory_by_id(id)) != NULL) {
-        if (write_usb_packet(acc->handle, acc->ep_out, data, size) < 0) {
-            /* seems like accessory removed, just ignore */
+    pthread_mutex_lock(&shard->retire_lock);
+
+    for (pp = &shard->retired; (acc = *pp) != NULL; ) {
+        if (!qsbr_poll(acc->retire_epoch)) {
+            pp = &acc->retire_next;
+            continue;
         }
-    } else {
+
+        *pp = acc->retire_next;
+        acc->retire_next = ret;
+        ret = acc;
+        atomic_fetch_sub(&shard->retired_cnt, 1);
+    }
+
+    pthread_mutex_unlock(&shard->retire_lock);
+
+    return ret;
+}
+
+/* called by tun thread, never blocks on usb */
+int send_accessory_packet(packet_t *pkt, accessory_id_t id)
+{
+    accessory_t *acc;
+    size_t len;
+
+    if ((acc = find_accessory_by_id(id)) == NULL) {
         /* accessory not found, removed? */
+        packet_free(pkt);
+        return -1;
+    }
+
+    /* jumbo packet for phone that didn't confirm jumbo mtu */
+    if (pkt->len > atomic_load_explicit(&acc->mtu, memory_order_relaxed)) {
+        if (pkt->len >= 20 && (pkt->data[6] & 0x40)) {
+            send_frag_needed(pkt->data, pkt->len, atomic_load(&acc->mtu), id);
+        }
+        trace_packet(tx_dropped, id, pkt->len);
+        packet_free(pkt);
+        atomic_fetch_add(&acc->tx_dropped, 1);
+        return -1;
+    }
+
+    /* policed, fq_codel only sees what fits in the rate */
+    if (!rate_limit_packet(&acc->limits[RATE_DOWN], RATE_DOWN, pkt->len)) {
+        trace_packet(tx_dropped, id, pkt->len);
+        packet_free(pkt);
+        atomic_fetch_add(&acc->metrics.tx_rate_dropped, 1);
+        return -1;
+    }
+
+    /* pkt belongs to writer once pushed */
+    len = pkt->len;
+
+    /* queue is full, accessory can't keep up: tail drop */
+    if (!ring_push(&acc->tx_ring, pkt)) {
+        trace_packet(tx_dropped, id, len);
+        packet_free(pkt);
+        atomic_fetch_add(&acc->tx_dropped, 1);
+        return -1;
     }
 
+    trace_packet(tx_queued, id, len);
+    kick_accessory_writer(acc);
+
     return 0;
 }
 
-accessory_id_t gen_new_serial_string(char *str, size_t size)
+void for_each_accessory(accessory_metrics_cb cb, void *arg)
+{
+    accessory_t *acc;
+
+    for (size_t id = 0; id < acc_list_size; id++) {
+        if ((acc = find_accessory_by_id(id)) != NULL) {
+            cb(arg, id, &acc->metrics, atomic_load(&acc->tx_dropped),
+                    ring_count(&acc->tx_ring) +
+                    counter_get(&acc->metrics.aqm.backlog));
+        }
+    }
+}
+
+void for_each_accessory_limits(accessory_limits_cb cb, void *arg)
+{
+    accessory_t *acc;
+
+    for (size_t id = 0; id < acc_list_size; id++) {
+        if ((acc = find_accessory_by_id(id)) != NULL) {
+            cb(arg, id, acc->limits);
+        }
+    }
+}
+
+/*
+ * batch flush latency budget expired for some accessories. accessories
+ * without open batch leave the list, retired ones always do, so it never
+ * points to reclaimed accessory.
+ */
+static void flush_accessory_batches(shard_t *shard)
+{
+    accessory_t *acc, **prev = &shard->batch_list;
+
+    while ((acc = *prev) != NULL) {
+        run_accessory_writer(acc);
+
+        if (acc->batch_xfer) {
+            prev = &acc->batch_next;
+            continue;
+        }
+
+        *prev = acc->batch_next;
+        acc->on_batch_list = false;
+    }
+}
+
+/* keepalive round of shard, dead links are torn down */
+static void ping_accessories(shard_t *shard, uint64_t now)
+{
+    for (accessory_t *acc = shard->ctrl_list; acc; acc = acc->ctrl_next) {
+        pthread_mutex_lock(&acc->lock);
+
+        if (acc->is_running) {
+            if (is_link_dead(acc, now)) {
+                stop_accessory_transfers(acc);
+            } else {
+                write_accessory_ping(acc, now);
+            }
+        }
+
+        pthread_mutex_unlock(&acc->lock);
+    }
+
+    shard->ctrl_next_ts = now + get_ping_interval_us();
+}
+
+/* called by shard thread after each wakeup */
+void handle_accessory_events(shard_t *shard)
+{
+    accessory_t *acc, *reclaimable = NULL;
+    bool drained;
+    uint64_t now;
+
+    /*
+     * grace period is checked before kick ring is drained: readers which
+     * still could push retired accessory there have done it already
+     */
+    if (atomic_load(&shard->retired_cnt)) {
+        reclaimable = collect_reclaimable_accessories(shard);
+    }
+
+    while ((acc = ring_pop(&shard->kick_ring)) != NULL) {
+        atomic_store(&acc->tx_scheduled, false);
+
+        if (atomic_load(&acc->is_retired)) {
+            continue;
+        }
+
+        run_accessory_writer(acc);
+
+        pthread_mutex_lock(&acc->lock);
+        drained = is_accessory_drained(acc);
+        pthread_mutex_unlock(&acc->lock);
+
+        if (drained) {
+            free_accessory(acc);
+        }
+    }
+
+    if (shard->batch_list) {
+        flush_accessory_batches(shard);
+    }
+
+    if (shard->ctrl_list && (now = get_time_us()) >= shard->ctrl_next_ts) {
+        ping_accessories(shard, now);
+    }
+
+    while ((acc = reclaimable) != NULL) {
+        reclaimable = acc->retire_next;
+        destroy_accessory(acc);
+    }
+}
+
+accessory_id_t gen_new_serial_string(const char *usb_serial,
+        char *serial, size_t serial_size, char *uri, size_t uri_size)
 {
     accessory_id_t id;
 
-    if ((id = acquire_accessory_id()) == 0) {
+    pthread_mutex_lock(&acc_list_lock);
+
+    /* phone gets address of its last session back, if it's still free */
+    id = find_session_id(usb_serial);
+    if ((!is_accessory_id_valid(id) || !can_take_id(id, usb_serial)) &&
+            !id_pool_acquire(&acc_ids, &id)) {
+        id = 0;
+    }
+
+    /* under lock, reserved id is known to be this phone's then */
+    if (id) {
+        bind_session(usb_serial, id);
+    }
+
+    pthread_mutex_unlock(&acc_list_lock);
+
+    if (!id) {
         fprintf(stderr, "No free accessory IDs left\n");
         return 0;
     }
 
-    fill_serial_param(str, size, id);
+    fill_serial_param(serial, serial_size, id);
+    fill_uri_param(uri, uri_size);
 
     return id;
 }
 
+/* reconnect time, from accessory arrival to its io */
+static void print_accessory_ready(accessory_t *acc, bool is_bound,
+        uint64_t start_ts)
+{
+    double ms = (get_time_us() - start_ts) / 1000.0;
+    uint32_t addr = htonl(get_acc_addr(acc->id));
+    char addr_str[INET_ADDRSTRLEN];
+
+    if (!is_bound) {
+        printf("Accessory up in %.1f ms, address follows first packet\n", ms);
+        return;
+    }
+
+    inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+    printf("Accessory %s up in %.1f ms\n", addr_str, ms);
+}
+
 static void *usb_device_thread_proc(void *param)
 {
     accessory_t *acc;
-    struct libusb_device *dev = param;
+    usb_probe_t *probe = param;
+    simple_rt_config_t *config = get_simple_rt_config();
+    shard_t *shard = acquire_shard();
+    uint64_t start_ts = get_time_us();
+    bool is_bound;
+
+    acc = probe_usb_device(probe->dev, shard);
+    libusb_unref_device(probe->dev);
+
+    if (acc == NULL) {
+        return_accessory_id(probe->id);
+        release_shard(shard);
+        goto end;
+    }
+
+    /* downlink needs no packet from phone to find it */
+    is_bound = probe->id ? publish_accessory(acc, probe->id) :
+        take_session_id(find_session_id(acc->usb_serial),
+                acc->usb_serial, acc);
 
-    if ((acc = probe_usb_device(dev, gen_new_serial_string)) == NULL) {
+    /* accessory may be gone as soon as its io runs */
+    print_accessory_ready(acc, is_bound, start_ts);
+
+    if (config->usb_transfers) {
+        /* completions are handled by shard thread */
+        if (!start_accessory_transfers(acc, config->usb_transfers)) {
+            fprintf(stderr, "Unable to start accessory transfers\n");
+            free_accessory(acc);
+        }
         goto end;
     }
 
@@ -237,14 +1746,45 @@ static void *usb_device_thread_proc(void *param)
     accessory_worker_proc(acc);
 
 end:
+    free(probe);
     return NULL;
 }
 
-void run_usb_probe_thread_detached(struct libusb_device *dev)
+void handle_usb_device_arrived(struct libusb_device *dev)
 {
     pthread_t th;
     pthread_attr_t attrs;
+    sigset_t sigs, old_sigs;
+    accessory_id_t id;
+    usb_probe_t *probe;
+
+    /* handshake needs no thread, it runs in main loop */
+    if (!is_accessory_present(dev, &id)) {
+        start_aoa_handshake(dev, gen_new_serial_string);
+        return;
+    }
+
+    if ((probe = malloc(sizeof(*probe))) == NULL) {
+        fprintf(stderr, "Unable to allocate accessory probe\n");
+        return;
+    }
+
+    probe->dev = libusb_ref_device(dev);
+    probe->id = id;
+
     pthread_attr_init(&attrs);
     pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
-    pthread_create(&th, &attrs, usb_device_thread_proc, dev);
+    pthread_attr_setstacksize(&attrs, PROBE_THREAD_STACK_SIZE);
+
+    /* signals go to main thread */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+    if (pthread_create(&th, &attrs, usb_device_thread_proc, probe) != 0) {
+        fprintf(stderr, "Unable to start accessory probe thread\n");
+        libusb_unref_device(probe->dev);
+        free(probe);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+    pthread_attr_destroy(&attrs);
 }
@@ -0,0 +1,204 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "ackfilter.h"
+#include "utils.h"
+
+#define IP_PROTO_TCP 6
+
+#define IP_ECN_CE 3
+
+#define TCP_FLAG_ACK 0x10
+
+#define TCP_OPT_EOL 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_SACK 5
+#define TCP_OPT_TIMESTAMP 8
+
+/* sequence space wraps */
+static inline bool seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+static bool parse_tcp_options(const uint8_t *opt, size_t len, tcp_ack_t *ack)
+{
+    size_t off = 0, opt_len;
+
+    while (off < len) {
+        if (opt[off] == TCP_OPT_EOL) {
+            return true;
+        }
+
+        if (opt[off] == TCP_OPT_NOP) {
+            off++;
+            continue;
+        }
+
+        if (off + 2 > len || (opt_len = opt[off + 1]) < 2 ||
+                off + opt_len > len) {
+            return false;
+        }
+
+        if (opt[off] == TCP_OPT_TIMESTAMP && opt_len == 10) {
+            ack->has_ts = true;
+            ack->tsval = get_be32(opt + off + 2);
+        } else if (opt[off] == TCP_OPT_SACK && (opt_len - 2) % 8 == 0 &&
+                (opt_len - 2) / 8 <= ACK_MAX_SACKS) {
+            ack->sack_cnt = (opt_len - 2) / 8;
+            for (size_t i = 0; i < ack->sack_cnt; i++) {
+                ack->sack[i][0] = get_be32(opt + off + 2 + i * 8);
+                ack->sack[i][1] = get_be32(opt + off + 6 + i * 8);
+            }
+        } else {
+            return false;
+        }
+
+        off += opt_len;
+    }
+
+    return true;
+}
+
+bool parse_tcp_ack(const uint8_t *pkt, size_t size, tcp_ack_t *ack)
+{
+    size_t ihl, doff;
+
+    if (size < 40 || (pkt[0] >> 4) != 4 || pkt[9] != IP_PROTO_TCP ||
+            (pkt[1] & 3) == IP_ECN_CE || (get_be16(pkt + 6) & 0x3fff)) {
+        return false;
+    }
+
+    ihl = (pkt[0] & 0xf) * 4;
+    if (ihl < 20 || ihl + 20 > size) {
+        return false;
+    }
+
+    doff = (pkt[ihl + 12] >> 4) * 4;
+    if (doff < 20 || get_be16(pkt + 2) != ihl + doff || ihl + doff > size ||
+            pkt[ihl + 13] != TCP_FLAG_ACK) {
+        return false;
+    }
+
+    memset(ack, 0, sizeof(*ack));
+    ack->saddr = get_be32(pkt + 12);
+    ack->daddr = get_be32(pkt + 16);
+    ack->sport = get_be16(pkt + ihl);
+    ack->dport = get_be16(pkt + ihl + 2);
+    ack->ack = get_be32(pkt + ihl + 8);
+
+    return parse_tcp_options(pkt + ihl + 20, doff - 20, ack);
+}
+
+static inline bool is_same_flow(const tcp_ack_t *a, const tcp_ack_t *b)
+{
+    return a->saddr == b->saddr && a->daddr == b->daddr &&
+        a->sport == b->sport && a->dport == b->dport;
+}
+
+/* range is below cumulative ack or inside one of sack blocks */
+static bool is_range_acked(const tcp_ack_t *ack, uint32_t start, uint32_t end)
+{
+    if (!seq_before(ack->ack, end)) {
+        return true;
+    }
+
+    for (size_t i = 0; i < ack->sack_cnt; i++) {
+        if (!seq_before(start, ack->sack[i][0]) &&
+                !seq_before(ack->sack[i][1], end)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool is_ack_redundant(const tcp_ack_t *older, const tcp_ack_t *newer)
+{
+    if (!is_same_flow(older, newer) || seq_before(newer->ack, older->ack) ||
+            (older->has_ts && (!newer->has_ts ||
+                               seq_before(newer->tsval, older->tsval)))) {
+        return false;
+    }
+
+    for (size_t i = 0; i < older->sack_cnt; i++) {
+        if (!is_range_acked(newer, older->sack[i][0], older->sack[i][1])) {
+            return false;
+        }
+    }
+
+    if (newer->ack != older->ack) {
+        return true;
+    }
+
+    /* same cumulative ack, newer has to carry news in its sacks */
+    if (newer->sack_cnt != older->sack_cnt) {
+        return newer->sack_cnt > older->sack_cnt;
+    }
+
+    return newer->sack_cnt &&
+        memcmp(newer->sack, older->sack,
+                newer->sack_cnt * sizeof(newer->sack[0])) != 0;
+}
+
+void ack_filter_reset(ack_filter_t *f)
+{
+    f->slots_cnt = 0;
+    f->frames = 0;
+    memset(f->dropped, 0, sizeof(f->dropped));
+}
+
+void ack_filter_add(ack_filter_t *f, const uint8_t *pkt, size_t size)
+{
+    size_t frame = f->frames++;
+    tcp_ack_t ack;
+
+    if (!pkt || frame >= ACK_FILTER_MAX_FRAMES ||
+            !parse_tcp_ack(pkt, size, &ack)) {
+        return;
+    }
+
+    /* slot keeps last ack of flow, older one goes if this makes it useless */
+    for (size_t i = 0; i < f->slots_cnt; i++) {
+        ack_filter_slot_t *slot = &f->slots[i];
+
+        if (is_same_flow(&slot->ack, &ack)) {
+            if (is_ack_redundant(&slot->ack, &ack)) {
+                f->dropped[slot->frame / 64] |= 1ULL << (slot->frame % 64);
+            }
+
+            slot->ack = ack;
+            slot->frame = frame;
+            return;
+        }
+    }
+
+    if (f->slots_cnt < ACK_FILTER_FLOWS) {
+        f->slots[f->slots_cnt].ack = ack;
+        f->slots[f->slots_cnt].frame = frame;
+        f->slots_cnt++;
+    }
+}
+
+bool ack_filter_is_dropped(const ack_filter_t *f, size_t frame)
+{
+    return frame < ACK_FILTER_MAX_FRAMES &&
+        (f->dropped[frame / 64] >> (frame % 64)) & 1;
+}
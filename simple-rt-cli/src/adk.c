@@ -17,12 +17,14 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 
 #include "utils.h"
 #include "adk.h"
+#include "session.h"
 
 /* Android Open Accessory protocol defines */
 #define AOA_GET_PROTOCOL            51
@@ -58,6 +60,75 @@
 /* ACC params */
 #define ACC_TIMEOUT 200
 
+/* shard context may learn about new device a bit later */
+#define SHARD_OPEN_RETRIES 20
+#define SHARD_OPEN_DELAY_US 50000
+
+/* handshake runs in main loop, a failed step is retried with backoff */
+#define AOA_CONTROL_TIMEOUT_MS 1000
+#define AOA_RETRY_MIN_US 20000
+#define AOA_RETRY_MAX_US 1000000
+#define AOA_MAX_ATTEMPTS 10
+
+/* device still there after start, handshake is repeated */
+#define AOA_SWITCH_TIMEOUT_US 3000000
+#define AOA_MAX_RESTARTS 3
+
+/* device left, accessory is expected on same port */
+#define AOA_ACCESSORY_WAIT_US 30000000
+
+#define AOA_MAX_STRING 256
+
+/* usb serial is asked for in english, android knows no other */
+#define USB_LANGID_EN_US 0x0409
+
+typedef struct aoa_step_t {
+    const char *str;
+    uint8_t bRequest;
+    uint16_t wIndex;
+    const char *data;
+} aoa_step_t;
+
+typedef enum aoa_state_t {
+    AOA_STATE_HANDSHAKE,    /* control transfers of aoa_steps */
+    AOA_STATE_SWITCHING,    /* start sent, device should leave */
+    AOA_STATE_GONE,         /* device left, waiting for accessory */
+} aoa_state_t;
+
+typedef struct aoa_handshake_t {
+    struct aoa_handshake_t *next;
+    aoa_state_t state;
+
+    struct libusb_device *dev;
+    struct libusb_device_handle *handle;
+    struct libusb_transfer *transfer;
+    uint8_t buf[LIBUSB_CONTROL_SETUP_SIZE + AOA_MAX_STRING];
+
+    size_t step;
+    unsigned int attempts;
+    unsigned int restarts;
+    bool is_started;
+
+    /* next step or check, 0 while transfer is in flight */
+    uint64_t deadline;
+    uint64_t start_ts;
+
+    /* accessory comes back on same port */
+    uint8_t bus;
+    uint8_t ports[7];
+    int ports_cnt;
+
+    gen_new_serial_str_cb gen_new_serial_str;
+    accessory_id_t id;
+    /* device serial, picks remembered address, see session.h */
+    uint8_t usb_serial_idx;
+    char usb_serial[SESSION_SERIAL_SIZE];
+    char serial[128];
+    char uri[AOA_MAX_STRING];
+} aoa_handshake_t;
+
+static aoa_handshake_t *g_handshakes = NULL;
+
 static uint16_t get_accessory_endpoints(struct libusb_device *dev)
 {
     /* default values */
@@ -119,7 +190,60 @@ end:
     return (ep_in << 8) | ep_out;
 }
 
-static bool is_accessory_present(struct libusb_device *dev)
+static void free_aoa_handshake(aoa_handshake_t *hs)
+{
+    aoa_handshake_t **pp = &g_handshakes;
+    bool is_id_shared = false;
+
+    while (*pp != hs) {
+        pp = &(*pp)->next;
+    }
+    *pp = hs->next;
+
+    if (hs->handle) {
+        libusb_close(hs->handle);
+    }
+
+    /* replugged phone got same remembered address in its new handshake */
+    for (aoa_handshake_t *other = g_handshakes; other; other = other->next) {
+        is_id_shared |= hs->id && other->id == hs->id;
+    }
+
+    /* failed phone would keep its address for good */
+    if (!is_id_shared) {
+        return_accessory_id(hs->id);
+    }
+
+    libusb_free_transfer(hs->transfer);
+    libusb_unref_device(hs->dev);
+    free(hs);
+}
+
+/* accessory of own handshake, report how long the switch took */
+static accessory_id_t match_aoa_handshake(struct libusb_device *dev)
+{
+    uint8_t ports[7];
+    int cnt = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    accessory_id_t id;
+
+    for (aoa_handshake_t *hs = g_handshakes; hs != NULL; hs = hs->next) {
+        if (hs->is_started && hs->deadline && cnt == hs->ports_cnt &&
+                libusb_get_bus_number(dev) == hs->bus &&
+                !memcmp(ports, hs->ports, cnt)) {
+            printf("Accessory mode after %.1f ms, %u restart(s)\n",
+                    (get_time_us() - hs->start_ts) / 1000.0, hs->restarts);
+            /* accessory owns the address now */
+            id = hs->id;
+            hs->id = 0;
+            free_aoa_handshake(hs);
+            return id;
+        }
+    }
+
+    return 0;
+}
+
+bool is_accessory_present(struct libusb_device *dev, accessory_id_t *id)
 {
     static const uint16_t aoa_pids[] = {
         AOA_ACCESSORY_PID,
@@ -137,163 +261,435 @@ static bool is_accessory_present(struct libusb_device *dev)
     for (size_t i = 0; i < ARRAY_SIZE(aoa_pids); i++) {
         if (desc.idVendor == AOA_ACCESSORY_VID && desc.idProduct == aoa_pids[i]) {
             printf("Found accessory %4.4x:%4.4x\n", desc.idVendor, desc.idProduct);
+            *id = match_aoa_handshake(dev);
             return true;
         }
     }
 
+    *id = 0;
+
     return false;
 }
 
-accessory_t *probe_usb_device(struct libusb_device *dev,
-        gen_new_serial_str_cb gen_new_serial_str)
+/* same device seen by another libusb context, matched by bus and address */
+static struct libusb_device_handle *open_usb_device_in_context(
+        libusb_context *ctx, struct libusb_device *dev)
 {
-    int ret = 0;
-    uint16_t aoa_version = 0;
-    char serial_str[128] = { 0 };
-
+    int ret = LIBUSB_ERROR_NO_DEVICE;
+    ssize_t cnt;
+    struct libusb_device **list;
     struct libusb_device_handle *handle = NULL;
 
-    if ((ret = libusb_open(dev, &handle)) != 0) {
+    for (int i = 0; i < SHARD_OPEN_RETRIES; i++) {
+        if ((cnt = libusb_get_device_list(ctx, &list)) < 0) {
+            ret = cnt;
+            break;
+        }
+
+        for (ssize_t j = 0; j < cnt; j++) {
+            if (libusb_get_bus_number(list[j]) == libusb_get_bus_number(dev) &&
+                    libusb_get_device_address(list[j]) ==
+                    libusb_get_device_address(dev)) {
+                ret = libusb_open(list[j], &handle);
+                break;
+            }
+        }
+
+        libusb_free_device_list(list, 1);
+
+        if (ret != LIBUSB_ERROR_NO_DEVICE) {
+            break;
+        }
+
+        usleep(SHARD_OPEN_DELAY_US);
+    }
+
+    if (ret != 0) {
         fprintf(stderr, "Error opening usb device: %s\n",
                 libusb_strerror(ret));
         return NULL;
     }
 
-    if (is_accessory_present(dev)) {
-        uint16_t endpoints = get_accessory_endpoints(dev);
+    return handle;
+}
+
+/* accessory mode device, opened in shard context as its io is handled there */
+accessory_t *probe_usb_device(struct libusb_device *dev, shard_t *shard)
+{
+    accessory_t *acc;
+    struct libusb_device_handle *handle = NULL;
+    uint16_t endpoints = get_accessory_endpoints(dev);
+    struct libusb_device_descriptor desc;
+    char usb_serial[SESSION_SERIAL_SIZE] = "";
 
-        /* create accessory struct */
-        return new_accessory(handle, endpoints >> 8, endpoints & 0xff);
+    if ((handle = open_usb_device_in_context(shard->usb_ctx, dev)) == NULL) {
+        return NULL;
     }
 
-    /* Now asking if device supports Android Open Accessory protocol */
-    ret = libusb_control_transfer(handle,
-            LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
-            AOA_GET_PROTOCOL, 0, 0,
-            (uint8_t *) &aoa_version, sizeof(aoa_version), 0);
+    /* phone keeps its serial in accessory mode */
+    libusb_get_device_descriptor(dev, &desc);
+    if (desc.iSerialNumber && libusb_get_string_descriptor_ascii(handle,
+                desc.iSerialNumber, (unsigned char *) usb_serial,
+                sizeof(usb_serial)) < 0) {
+        usb_serial[0] = '\0';
+    }
+
+    /* create accessory struct */
+    if ((acc = new_accessory(handle, shard,
+                    endpoints >> 8, endpoints & 0xff, usb_serial)) == NULL) {
+        libusb_close(handle);
+    }
 
-    /* libusb_control_transfer returns a pipe error if the control request is
-     * not supported by the device. This error code is to be expected when
-     * SimpleRT starts up and it should therefore generate a specialized log
-     * message. For example, the Raspberry Pi ethernet adapter is detected as
-     * an usb device and throws a pipe error. */
-    if (ret < 0 && ret != LIBUSB_ERROR_PIPE) {
+    return acc;
+}
+
+static const aoa_step_t aoa_steps[] = {
+    { "usb serial", LIBUSB_REQUEST_GET_DESCRIPTOR, USB_LANGID_EN_US, NULL },
+    { "protocol", AOA_GET_PROTOCOL, 0, NULL },
+    { "manufacturer", AOA_SEND_IDENT, AOA_STRING_MAN_ID, "Konstantin Menyaev" },
+    { "model", AOA_SEND_IDENT, AOA_STRING_MOD_ID, "SimpleRT" },
+    { "description", AOA_SEND_IDENT, AOA_STRING_DSC_ID,
+        "Simple Reverse Tethering" },
+    { "version", AOA_SEND_IDENT, AOA_STRING_VER_ID, "1.1.2" },
+    { "url", AOA_SEND_IDENT, AOA_STRING_URL_ID, NULL },
+    { "serial number", AOA_SEND_IDENT, AOA_STRING_SER_ID, NULL },
+    { "command", AOA_START_ACCESSORY, 0, NULL },
+};
+
+#define AOA_STEP_SERIAL 0
+#define AOA_STEP_PROTOCOL 1
+#define AOA_STEP_START (ARRAY_SIZE(aoa_steps) - 1)
+
+static const char *get_step_data(aoa_handshake_t *hs, size_t step)
+{
+    if (aoa_steps[step].bRequest != AOA_SEND_IDENT) {
+        return NULL;
+    }
+
+    switch (aoa_steps[step].wIndex) {
+    case AOA_STRING_URL_ID:
+        return hs->uri;
+    case AOA_STRING_SER_ID:
+        return hs->serial;
+    default:
+        return aoa_steps[step].data;
+    }
+}
+
+/* device is gone, hopefully to come back in accessory mode */
+static void wait_for_accessory(aoa_handshake_t *hs)
+{
+    if (!hs->is_started) {
+        fprintf(stderr, "Device left during accessory handshake\n");
+        free_aoa_handshake(hs);
+        return;
+    }
+
+    if (hs->handle) {
+        libusb_close(hs->handle);
+        hs->handle = NULL;
+    }
+
+    hs->state = AOA_STATE_GONE;
+    hs->deadline = get_time_us() + AOA_ACCESSORY_WAIT_US;
+}
+
+/* same step again, backoff doubles up to AOA_RETRY_MAX_US */
+static void retry_aoa_step(aoa_handshake_t *hs, int err)
+{
+    uint64_t delay;
+
+    if (++hs->attempts > AOA_MAX_ATTEMPTS) {
+        fprintf(stderr, "Accessory init failed: %s\n", libusb_strerror(err));
+        free_aoa_handshake(hs);
+        return;
+    }
+
+    delay = AOA_RETRY_MIN_US << (hs->attempts - 1);
+    if (delay > AOA_RETRY_MAX_US) {
+        delay = AOA_RETRY_MAX_US;
+    }
+
+    hs->deadline = get_time_us() + delay;
+}
+
+static void aoa_transfer_cb(struct libusb_transfer *transfer);
+
+static void submit_aoa_step(aoa_handshake_t *hs)
+{
+    int ret;
+    const aoa_step_t *step = &aoa_steps[hs->step];
+    const char *data = get_step_data(hs, hs->step);
+    uint16_t len = data ? strlen(data) + 1 : 0;
+    uint16_t value = 0;
+    uint8_t type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT;
+
+    if (!hs->handle && (ret = libusb_open(hs->dev, &hs->handle)) != 0) {
+        hs->handle = NULL;
         goto error;
     }
 
+    if (step->bRequest == LIBUSB_REQUEST_GET_DESCRIPTOR) {
+        type = LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_ENDPOINT_IN;
+        value = (LIBUSB_DT_STRING << 8) | hs->usb_serial_idx;
+        len = AOA_MAX_STRING - 1;
+    } else if (step->bRequest == AOA_GET_PROTOCOL) {
+        type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN;
+        len = sizeof(uint16_t);
+    } else if (data) {
+        memcpy(hs->buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+    }
+
+    libusb_fill_control_setup(hs->buf, type, step->bRequest, value,
+            step->wIndex, len);
+    libusb_fill_control_transfer(hs->transfer, hs->handle, hs->buf,
+            aoa_transfer_cb, hs, AOA_CONTROL_TIMEOUT_MS);
+
+    if ((ret = libusb_submit_transfer(hs->transfer)) != 0) {
+        goto error;
+    }
+
+    hs->deadline = 0;
+    return;
+
+error:
+    if (ret == LIBUSB_ERROR_NO_DEVICE) {
+        wait_for_accessory(hs);
+    } else {
+        retry_aoa_step(hs, ret);
+    }
+}
+
+/* string descriptor is utf-16le, other than ascii becomes '?' */
+static void read_usb_serial(aoa_handshake_t *hs)
+{
+    uint8_t *data = libusb_control_transfer_get_data(hs->transfer);
+    int len = hs->transfer->actual_length;
+    size_t n = 0;
+
+    if (len < 2 || data[1] != LIBUSB_DT_STRING) {
+        return;
+    }
+
+    if (data[0] < len) {
+        len = data[0];
+    }
+
+    for (int i = 2; i + 1 < len && n < sizeof(hs->usb_serial) - 1; i += 2) {
+        hs->usb_serial[n++] = data[i + 1] || (data[i] & 0x80) ? '?' : data[i];
+    }
+
+    hs->usb_serial[n] = '\0';
+}
+
+/* GET_PROTOCOL answered, false if device is no android */
+static bool check_aoa_protocol(aoa_handshake_t *hs)
+{
+    uint8_t *data = libusb_control_transfer_get_data(hs->transfer);
+    uint16_t aoa_version = 0;
+    struct libusb_device_descriptor desc;
+
+    if (hs->transfer->actual_length == sizeof(aoa_version)) {
+        aoa_version = data[0] | (data[1] << 8);
+    }
+
     if (!aoa_version) {
-        struct libusb_device_descriptor desc;
-        libusb_get_device_descriptor(dev, &desc);
+        libusb_get_device_descriptor(hs->dev, &desc);
         printf("Detected usb device with vendor id %x and product id %x does "
                "not support Android Open Accessory protocol.\n",
-    		desc.idVendor, desc.idProduct);
-        ret = 0;
-        goto error;
+               desc.idVendor, desc.idProduct);
+        return false;
     }
 
-    printf("Device supports AOA %d.0!\n", aoa_version);
+    /* restarted handshake keeps its address */
+    if (!hs->id) {
+        printf("Device supports AOA %d.0!\n", aoa_version);
 
-    if (gen_new_serial_str(serial_str, sizeof(serial_str)) == 0) {
-        ret = 0;
-        goto error;
+        if ((hs->id = hs->gen_new_serial_str(hs->usb_serial, hs->serial,
+                        sizeof(hs->serial), hs->uri, sizeof(hs->uri))) == 0) {
+            return false;
+        }
+
+        printf("Sending identification to the device\n");
     }
 
-    struct acc_control_params_t {
-        const char *str;
-        uint8_t request_type;
-        uint8_t bRequest;
-        uint16_t wValue;
-        uint16_t wIndex;
-        const char *data;
-        uint32_t timeout;
-    } acc_control_params[] = {
-        {
-            .str = "manufacturer",
-            .request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-            .bRequest = AOA_SEND_IDENT,
-            .wIndex = AOA_STRING_MAN_ID,
-            .data = "Konstantin Menyaev",
-        },
-        {
-            .str = "model",
-            .request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-            .bRequest = AOA_SEND_IDENT,
-            .wIndex = AOA_STRING_MOD_ID,
-            .data = "SimpleRT",
-        },
-        {
-            .str = "description",
-            .request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-            .bRequest = AOA_SEND_IDENT,
-            .wIndex = AOA_STRING_DSC_ID,
-            .data = "Simple Reverse Tethering",
-        },
-        {
-            .str = "version",
-            .request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-            .bRequest = AOA_SEND_IDENT,
-            .wIndex = AOA_STRING_VER_ID,
-            .data = "1.1.2",
-        },
-        {
-            .str = "url",
-            .request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-            .bRequest = AOA_SEND_IDENT,
-            .wIndex = AOA_STRING_URL_ID,
-            .data = "https://github.com/vvviperrr/SimpleRT",
-        },
-        {
-            .str = "serial number",
-            .request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-            .bRequest = AOA_SEND_IDENT,
-            .wIndex = AOA_STRING_SER_ID,
-            .data = serial_str,
-        },
-        {
-            .str = "command",
-            .request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
-            .bRequest = AOA_START_ACCESSORY,
-        },
-        { NULL, 0, 0, 0, 0, NULL, 0 },
-    };
+    return true;
+}
 
-    printf("Waiting 10 seconds before sending information to device\n");
-    sleep(10);
-
-    printf("Sending identification to the device\n");
-    for (struct acc_control_params_t *acp = acc_control_params;
-            acp->str != NULL; acp++)
-    {
-        const char *data = acp->data ? acp->data : "start accessory";
-        uint16_t data_len = acp->data ? strlen(acp->data) + 1 : 0;
-
-        printf(" sending %s: %s\n", acp->str, data);
-
-        ret = libusb_control_transfer(handle,
-                acp->request_type,
-                acp->bRequest,
-                acp->wValue,
-                acp->wIndex,
-                (uint8_t *) acp->data,
-                data_len,
-                acp->timeout);
-        if (ret < 0) {
-            goto error;
+static void aoa_transfer_cb(struct libusb_transfer *transfer)
+{
+    aoa_handshake_t *hs = transfer->user_data;
+
+    /* without serial phone just gets fresh address */
+    if (hs->step == AOA_STEP_SERIAL &&
+            transfer->status != LIBUSB_TRANSFER_NO_DEVICE &&
+            transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+            read_usb_serial(hs);
         }
+        hs->step++;
+        submit_aoa_step(hs);
+        return;
     }
 
-    puts("Accessory was initialized successfully!");
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        /*
+         * device doesn't support the request. This is to be expected when
+         * SimpleRT starts up, e.g. the Raspberry Pi ethernet adapter is
+         * detected as an usb device and stalls GET_PROTOCOL.
+         */
+        if (hs->step == AOA_STEP_PROTOCOL && !hs->is_started) {
+            transfer->actual_length = 0;
+            check_aoa_protocol(hs);
+            free_aoa_handshake(hs);
+            return;
+        }
+        retry_aoa_step(hs, LIBUSB_ERROR_PIPE);
+        return;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        wait_for_accessory(hs);
+        return;
+    case LIBUSB_TRANSFER_CANCELLED:
+        free_aoa_handshake(hs);
+        return;
+    default:
+        retry_aoa_step(hs, LIBUSB_ERROR_IO);
+        return;
+    }
 
-error:
-    if (ret < 0) {
-        fprintf(stderr, "Accessory init failed: %s\n", libusb_strerror(ret));
+    if (hs->step == AOA_STEP_PROTOCOL && !check_aoa_protocol(hs)) {
+        free_aoa_handshake(hs);
+        return;
     }
 
-    if (handle) {
-        libusb_close(handle);
+    hs->attempts = 0;
+
+    if (hs->step == AOA_STEP_START) {
+        printf("Accessory was initialized successfully in %.1f ms!\n",
+                (get_time_us() - hs->start_ts) / 1000.0);
+
+        /* phone re-enumerates, unless it ignored us */
+        hs->is_started = true;
+        hs->state = AOA_STATE_SWITCHING;
+        hs->deadline = get_time_us() + AOA_SWITCH_TIMEOUT_US;
+        return;
+    }
+
+    hs->step++;
+    submit_aoa_step(hs);
+}
+
+bool start_aoa_handshake(struct libusb_device *dev,
+        gen_new_serial_str_cb gen_new_serial_str)
+{
+    aoa_handshake_t *hs;
+    struct libusb_device_descriptor desc;
+    int cnt;
+
+    if ((hs = calloc(1, sizeof(*hs))) == NULL ||
+            (hs->transfer = libusb_alloc_transfer(0)) == NULL) {
+        fprintf(stderr, "Unable to allocate accessory handshake\n");
+        free(hs);
+        return false;
+    }
+
+    hs->dev = libusb_ref_device(dev);
+    hs->gen_new_serial_str = gen_new_serial_str;
+    hs->bus = libusb_get_bus_number(dev);
+    cnt = libusb_get_port_numbers(dev, hs->ports, sizeof(hs->ports));
+    hs->ports_cnt = cnt > 0 ? cnt : 0;
+    hs->state = AOA_STATE_HANDSHAKE;
+
+    /* descriptor is cached, serial string itself is first step */
+    libusb_get_device_descriptor(dev, &desc);
+    hs->usb_serial_idx = desc.iSerialNumber;
+    hs->step = desc.iSerialNumber ? AOA_STEP_SERIAL : AOA_STEP_PROTOCOL;
+
+    /* hotplug callback must not do io, first step is run by main loop */
+    hs->start_ts = get_time_us();
+    hs->deadline = hs->start_ts;
+
+    hs->next = g_handshakes;
+    g_handshakes = hs;
+
+    return true;
+}
+
+int64_t handle_aoa_handshakes(void)
+{
+    aoa_handshake_t *hs, *next;
+    uint64_t now = get_time_us();
+    int64_t timeout_us = -1;
+
+    for (hs = g_handshakes; hs != NULL; hs = next) {
+        next = hs->next;
+
+        /* transfer in flight or not due yet */
+        if (!hs->deadline || hs->deadline > now) {
+            continue;
+        }
+
+        switch (hs->state) {
+        case AOA_STATE_HANDSHAKE:
+            submit_aoa_step(hs);
+            break;
+        case AOA_STATE_SWITCHING:
+            /* still answers, start was lost: whole handshake again */
+            if (++hs->restarts > AOA_MAX_RESTARTS) {
+                fprintf(stderr, "Device ignores accessory start\n");
+                free_aoa_handshake(hs);
+                break;
+            }
+            hs->state = AOA_STATE_HANDSHAKE;
+            hs->step = AOA_STEP_PROTOCOL;
+            submit_aoa_step(hs);
+            break;
+        case AOA_STATE_GONE:
+            fprintf(stderr, "Device didn't come back in accessory mode\n");
+            free_aoa_handshake(hs);
+            break;
+        }
+    }
+
+    /* steps above may have scheduled retries */
+    for (hs = g_handshakes; hs != NULL; hs = hs->next) {
+        if (hs->deadline && (timeout_us < 0 ||
+                    (int64_t) (hs->deadline - now) < timeout_us)) {
+            timeout_us = hs->deadline > now ? hs->deadline - now : 0;
+        }
     }
 
-    return NULL;
+    return timeout_us;
+}
+
+void stop_aoa_handshakes(void)
+{
+    struct timeval tv = { 0, AOA_CONTROL_TIMEOUT_MS * 1000 };
+    aoa_handshake_t *hs, *next;
+    bool in_flight;
+
+    /* cancelled transfers free their handshakes */
+    for (hs = g_handshakes; hs != NULL; hs = hs->next) {
+        if (!hs->deadline) {
+            libusb_cancel_transfer(hs->transfer);
+        }
+    }
+
+    do {
+        in_flight = false;
+        for (hs = g_handshakes; hs != NULL; hs = hs->next) {
+            in_flight |= !hs->deadline;
+        }
+    } while (in_flight &&
+            libusb_handle_events_timeout_completed(NULL, &tv, NULL) == 0);
+
+    for (hs = g_handshakes; hs != NULL; hs = next) {
+        next = hs->next;
+        free_aoa_handshake(hs);
+    }
 }
 
 /* FIXME: read_all semantic */
@@ -303,21 +699,18 @@ ssize_t read_usb_packet(struct libusb_device_handle *handle, uint8_t ep,
     int ret;
     int transferred;
 
-    while (true) {
-        ret = libusb_bulk_transfer(handle, ep,
-                data, size, &transferred, ACC_TIMEOUT);
-        if (ret < 0) {
-            if (ret == LIBUSB_ERROR_TIMEOUT) {
-                continue;
-            } else {
-                fprintf(stderr, "read_usb_packet failed: %s\n",
-                        libusb_strerror(ret));
-                return -1;
-            }
-        } else {
-            /* success */
-            break;
-        }
+    ret = libusb_bulk_transfer(handle, ep,
+            data, size, &transferred, ACC_TIMEOUT);
+
+    /* caller checks on link in between, see is_link_dead() */
+    if (ret == LIBUSB_ERROR_TIMEOUT) {
+        return 0;
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "read_usb_packet failed: %s\n",
+                libusb_strerror(ret));
+        return -1;
     }
 
     return transferred;
@@ -330,22 +723,44 @@ ssize_t write_usb_packet(struct libusb_device_handle *handle, uint8_t ep,
     int ret;
     int transferred;
 
-    while (true) {
-        ret = libusb_bulk_transfer(handle, ep,
-                (uint8_t *) data, size, &transferred, ACC_TIMEOUT);
-        if (ret < 0) {
-            if (ret == LIBUSB_ERROR_TIMEOUT) {
-                continue;
-            } else {
-                fprintf(stderr, "write_usb_packet failed: %s\n",
-                        libusb_strerror(ret));
-                return -1;
-            }
-        } else {
-            /* success */
-            break;
-        }
+    ret = libusb_bulk_transfer(handle, ep,
+            (uint8_t *) data, size, &transferred, ACC_TIMEOUT);
+
+    /* phone isn't reading, caller retries while accessory runs */
+    if (ret == LIBUSB_ERROR_TIMEOUT) {
+        return 0;
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "write_usb_packet failed: %s\n",
+                libusb_strerror(ret));
+        return -1;
     }
 
     return transferred;
 }
+
+/* bulk transfer without own buffer, packet buffers are attached on submit */
+struct libusb_transfer *alloc_usb_transfer(struct libusb_device_handle *handle,
+        uint8_t ep, libusb_transfer_cb_fn cb, void *user_data)
+{
+    struct libusb_transfer *transfer;
+
+    if ((transfer = libusb_alloc_transfer(0)) == NULL) {
+        return NULL;
+    }
+
+    libusb_fill_bulk_transfer(transfer, handle, ep, NULL, 0, cb, user_data, 0);
+
+    return transfer;
+}
+
+/* pkt buffer must stay alive until transfer completes */
+int submit_usb_packet(struct libusb_transfer *transfer, packet_t *pkt,
+        size_t size)
+{
+    transfer->buffer = pkt->data;
+    transfer->length = size;
+
+    return libusb_submit_transfer(transfer);
+}
@@ -0,0 +1,1152 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "dns.h"
+#include "metrics.h"
+#include "network.h"
+#include "utils.h"
+
+#define DNS_PORT 53
+
+/* biggest udp answer taken from upstream */
+#define DNS_MAX_MSG 4096
+
+/* client without edns takes classic udp size */
+#define DNS_MIN_UDP_SIZE 512
+
+#define DNS_HDR_SIZE 12
+
+/* lowercase question name, type and class, then dnssec bits of query */
+#define DNS_MAX_KEY (255 + 4 + 1)
+
+/* cache is set associative, power of two sets */
+#define DNS_CACHE_SETS 1024
+#define DNS_CACHE_WAYS 4
+
+/* answer with more records is passed on, not cached */
+#define DNS_MAX_TTLS 64
+
+#define DNS_MAX_TTL 86400
+#define DNS_MAX_NEG_TTL 300
+
+#define DNS_MAX_PENDING 256
+
+/* upstream gets query once more, then phones get servfail */
+#define DNS_RETRY_MS 1000
+#define DNS_TIMEOUT_MS 4000
+
+/* names asked this often are refreshed in last 10% of their ttl */
+#define DNS_PREFETCH_HITS 2
+#define DNS_PREFETCH_PERCENT 10
+
+/* each upstream query goes out from random port above that */
+#define DNS_MIN_PORT 1024
+#define DNS_PORT_TRIES 8
+
+/* stop flag and upstream timeouts are checked that often */
+#define DNS_POLL_MS 100
+
+/* phones ask again over tcp after truncated answer, relayed upstream */
+#define DNS_MAX_TCP 16
+#define DNS_TCP_BUF 4096
+#define DNS_TCP_IDLE_MS 10000
+
+#define DNS_TYPE_OPT 41
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_CD 0x0010
+#define DNS_OPCODE_MASK 0x7800
+#define DNS_RCODE_MASK 0x000f
+
+/* in flags of opt record, where ttl of others is */
+#define DNS_OPT_DO 0x8000
+
+/* upstream answers these differently, they are part of cache key */
+#define DNS_KEY_CD 0x01
+#define DNS_KEY_DO 0x02
+
+#define DNS_RCODE_FORMERR 1
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+typedef struct dns_query_t {
+    uint8_t key[DNS_MAX_KEY];
+    size_t key_len;
+    uint32_t hash;
+    /* end of question section */
+    size_t question_end;
+    uint16_t max_size;
+    bool has_edns;
+} dns_query_t;
+
+typedef struct dns_entry_t {
+    uint8_t key[DNS_MAX_KEY];
+    size_t key_len;
+    uint8_t *msg;
+    size_t msg_len;
+    uint16_t ttl_offs[DNS_MAX_TTLS];
+    size_t ttl_cnt;
+    uint64_t stored_ms;
+    uint64_t expire_ms;
+    uint64_t prefetch_ms;
+    uint32_t hits;
+} dns_entry_t;
+
+typedef struct dns_waiter_t {
+    struct sockaddr_in addr;
+    uint16_t id;
+    uint16_t max_size;
+    bool has_edns;
+    /* echoed as asked, case of name may be randomized */
+    uint8_t question[DNS_MAX_KEY];
+} dns_waiter_t;
+
+/* query sent upstream, phones asking the same wait for it */
+typedef struct dns_pending_t {
+    bool is_used;
+    /* socket of its own, answer must match port and id */
+    int fd;
+    uint16_t id;
+    dns_query_t q;
+    uint8_t *msg;
+    size_t msg_len;
+    dns_waiter_t *waiters;
+    size_t waiters_cnt;
+    size_t waiters_size;
+    uint64_t first_ms;
+    bool is_retried;
+} dns_pending_t;
+
+/* bytes one side of tcp relay sent, not yet taken by the other */
+typedef struct dns_tcp_dir_t {
+    uint8_t buf[DNS_TCP_BUF];
+    size_t off;
+    size_t len;
+    bool is_eof;
+    bool is_shut;
+} dns_tcp_dir_t;
+
+/* tcp connection of phone and the one opened upstream for it */
+typedef struct dns_tcp_t {
+    bool is_used;
+    /* phone, upstream; dirs[i] goes from fds[i] to the other */
+    int fds[2];
+    dns_tcp_dir_t dirs[2];
+    uint64_t active_ms;
+} dns_tcp_t;
+
+static const char *mode_names[] = {
+    [DNS_MODE_OFF]      = "off",
+    [DNS_MODE_CACHE]    = "cache",
+    [DNS_MODE_PREFETCH] = "prefetch",
+};
+
+static struct {
+    int fd;
+    int tcp_fd;
+    struct sockaddr_in upstream;
+    pthread_t thread;
+    volatile bool is_running;
+    uint64_t rand_state;
+    dns_entry_t cache[DNS_CACHE_SETS][DNS_CACHE_WAYS];
+    dns_pending_t pending[DNS_MAX_PENDING];
+    dns_tcp_t tcp[DNS_MAX_TCP];
+
+    /* dns thread writes, metrics thread reads */
+    counter_t queries;
+    counter_t hits;
+    counter_t misses;
+    counter_t coalesced;
+    counter_t prefetches;
+    counter_t upstream_timeouts;
+    counter_t entries;
+} g_dns = { .fd = -1, .tcp_fd = -1 };
+
+bool parse_dns_mode(const char *str, dns_mode_t *mode)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(mode_names); i++) {
+        if (!strcmp(str, mode_names[i])) {
+            *mode = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *get_dns_mode_name(dns_mode_t mode)
+{
+    return mode_names[mode];
+}
+
+static uint64_t get_time_ms(void)
+{
+    return get_time_us() / 1000;
+}
+
+/* xorshift64*, seeded from urandom: upstream ids must be unguessable */
+static uint16_t gen_query_id(void)
+{
+    g_dns.rand_state ^= g_dns.rand_state >> 12;
+    g_dns.rand_state ^= g_dns.rand_state << 25;
+    g_dns.rand_state ^= g_dns.rand_state >> 27;
+
+    return (g_dns.rand_state * 0x2545f4914f6cdd1dULL) >> 48;
+}
+
+static uint32_t hash_key(const uint8_t *key, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ key[i]) * 16777619u;
+    }
+
+    return h;
+}
+
+/* offset after possibly compressed name, 0 if it's broken */
+static size_t skip_name(const uint8_t *msg, size_t size, size_t off)
+{
+    while (off < size) {
+        if (msg[off] == 0) {
+            return off + 1;
+        }
+
+        if ((msg[off] & 0xc0) == 0xc0) {
+            return off + 2 <= size ? off + 2 : 0;
+        }
+
+        if (msg[off] & 0xc0) {
+            return 0;
+        }
+
+        off += msg[off] + 1;
+    }
+
+    return 0;
+}
+
+/* question into cache key, name is compared case insensitive */
+static bool parse_question(const uint8_t *msg, size_t size, dns_query_t *q)
+{
+    size_t off = DNS_HDR_SIZE, len = 0;
+
+    if (size < DNS_HDR_SIZE || get_be16(msg + 4) != 1) {
+        return false;
+    }
+
+    while (off < size && msg[off] != 0) {
+        if ((msg[off] & 0xc0) || off + msg[off] + 1 > size ||
+                len + msg[off] + 1 > DNS_MAX_KEY - 6) {
+            return false;
+        }
+
+        q->key[len++] = msg[off];
+        for (size_t i = 1; i <= msg[off]; i++) {
+            uint8_t c = msg[off + i];
+            q->key[len++] = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+        }
+
+        off += msg[off] + 1;
+    }
+
+    /* root label, type and class */
+    if (off + 5 > size) {
+        return false;
+    }
+
+    q->key[len++] = 0;
+    memcpy(q->key + len, msg + off + 1, 4);
+    q->key_len = len + 4;
+    q->question_end = off + 5;
+    q->hash = hash_key(q->key, q->key_len);
+
+    return true;
+}
+
+/* standard query, edns payload size of client if it has one */
+static bool parse_query(const uint8_t *msg, size_t size, dns_query_t *q)
+{
+    size_t off;
+    unsigned int rrs;
+    uint8_t key_flags = 0;
+
+    if (!parse_question(msg, size, q) ||
+            (get_be16(msg + 2) & (DNS_FLAG_QR | DNS_OPCODE_MASK))) {
+        return false;
+    }
+
+    q->max_size = DNS_MIN_UDP_SIZE;
+    q->has_edns = false;
+    off = q->question_end;
+    rrs = get_be16(msg + 6) + get_be16(msg + 8) + get_be16(msg + 10);
+
+    if (get_be16(msg + 2) & DNS_FLAG_CD) {
+        key_flags |= DNS_KEY_CD;
+    }
+
+    for (unsigned int i = 0; i < rrs; i++) {
+        if ((off = skip_name(msg, size, off)) == 0 || off + 10 > size) {
+            break;
+        }
+
+        if (get_be16(msg + off) == DNS_TYPE_OPT) {
+            q->has_edns = true;
+            if (get_be16(msg + off + 2) > DNS_MIN_UDP_SIZE) {
+                q->max_size = get_be16(msg + off + 2);
+            }
+            if (get_be16(msg + off + 6) & DNS_OPT_DO) {
+                key_flags |= DNS_KEY_DO;
+            }
+        }
+
+        off += 10 + get_be16(msg + off + 8);
+    }
+
+    q->key[q->key_len++] = key_flags;
+    q->hash = hash_key(q->key, q->key_len);
+
+    return true;
+}
+
+/* opt record in additional section, its offset or 0 if there is none */
+static size_t find_opt(const uint8_t *msg, size_t size, size_t off,
+        size_t *opt_len)
+{
+    unsigned int skip = get_be16(msg + 6) + get_be16(msg + 8);
+    unsigned int rrs = skip + get_be16(msg + 10);
+    size_t start;
+
+    for (unsigned int i = 0; i < rrs; i++) {
+        start = off;
+        if ((off = skip_name(msg, size, off)) == 0 || off + 10 > size ||
+                off + 10 + get_be16(msg + off + 8) > size) {
+            return 0;
+        }
+
+        if (i >= skip && get_be16(msg + off) == DNS_TYPE_OPT) {
+            *opt_len = off + 10 + get_be16(msg + off + 8) - start;
+            return start;
+        }
+
+        off += 10 + get_be16(msg + off + 8);
+    }
+
+    return 0;
+}
+
+/*
+ * ttl fields of cacheable answer and its lifetime, s. negative answers
+ * live as long as soa in authority says, capped.
+ */
+static bool parse_answer_ttls(const uint8_t *msg, size_t size,
+        size_t off, dns_entry_t *e, uint32_t *ttl)
+{
+    uint16_t flags = get_be16(msg + 2);
+    unsigned int rrs = get_be16(msg + 6) + get_be16(msg + 8) +
+        get_be16(msg + 10);
+    uint8_t rcode = flags & DNS_RCODE_MASK;
+    bool has_ttl = false;
+
+    if ((flags & DNS_FLAG_TC) || (rcode && rcode != DNS_RCODE_NXDOMAIN)) {
+        return false;
+    }
+
+    *ttl = DNS_MAX_TTL;
+    e->ttl_cnt = 0;
+
+    for (unsigned int i = 0; i < rrs; i++) {
+        if ((off = skip_name(msg, size, off)) == 0 || off + 10 > size ||
+                off + 10 + get_be16(msg + off + 8) > size) {
+            return false;
+        }
+
+        /* opt has flags where ttl is */
+        if (get_be16(msg + off) != DNS_TYPE_OPT) {
+            if (e->ttl_cnt == DNS_MAX_TTLS) {
+                return false;
+            }
+
+            e->ttl_offs[e->ttl_cnt++] = off + 4;
+            if (get_be32(msg + off + 4) < *ttl) {
+                *ttl = get_be32(msg + off + 4);
+            }
+            has_ttl = true;
+        }
+
+        off += 10 + get_be16(msg + off + 8);
+    }
+
+    if (!get_be16(msg + 6) && *ttl > DNS_MAX_NEG_TTL) {
+        *ttl = DNS_MAX_NEG_TTL;
+    }
+
+    return has_ttl && *ttl > 0;
+}
+
+static void send_reply(const uint8_t *msg, size_t len,
+        const struct sockaddr_in *addr)
+{
+    if (sendto(g_dns.fd, msg, len, 0, (const struct sockaddr *) addr,
+                sizeof(*addr)) < 0) {
+        /* phone is gone, it retries anyway */
+    }
+}
+
+/* header and question only, e.g. servfail or truncated answer */
+static void send_empty_reply(const uint8_t *msg, size_t question_end,
+        uint16_t id, uint16_t flags, const struct sockaddr_in *addr)
+{
+    uint8_t buf[DNS_HDR_SIZE + DNS_MAX_KEY];
+
+    memcpy(buf, msg, question_end);
+    put_be16(buf, id);
+    put_be16(buf + 2, flags | DNS_FLAG_QR);
+    memset(buf + 6, 0, 6);
+
+    send_reply(buf, question_end, addr);
+}
+
+/*
+ * answer of waiter, question as it was asked, truncated if too big.
+ * opt of upstream is left out for client that sent none.
+ */
+static void send_answer(uint8_t *msg, size_t len, size_t question_end,
+        const dns_waiter_t *w)
+{
+    uint8_t buf[DNS_MAX_MSG];
+    size_t off, opt_len;
+
+    put_be16(msg, w->id);
+    memcpy(msg + DNS_HDR_SIZE, w->question, question_end - DNS_HDR_SIZE);
+
+    /* msg goes to other waiters as well, stripped one is a copy */
+    if (!w->has_edns &&
+            (off = find_opt(msg, len, question_end, &opt_len)) != 0) {
+        memcpy(buf, msg, off);
+        memcpy(buf + off, msg + off + opt_len, len - off - opt_len);
+        put_be16(buf + 10, get_be16(msg + 10) - 1);
+        msg = buf;
+        len -= opt_len;
+    }
+
+    if (len > w->max_size) {
+        send_empty_reply(msg, question_end, w->id,
+                get_be16(msg + 2) | DNS_FLAG_TC, &w->addr);
+        return;
+    }
+
+    send_reply(msg, len, &w->addr);
+}
+
+static dns_entry_t *find_entry(const dns_query_t *q)
+{
+    dns_entry_t *set = g_dns.cache[q->hash & (DNS_CACHE_SETS - 1)];
+
+    for (size_t i = 0; i < DNS_CACHE_WAYS; i++) {
+        if (set[i].msg && set[i].key_len == q->key_len &&
+                !memcmp(set[i].key, q->key, q->key_len)) {
+            return &set[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* same name, then free or expired slot, then the one expiring first */
+static void store_entry(const dns_query_t *q, const uint8_t *msg,
+        size_t len, uint64_t now)
+{
+    dns_entry_t *set = g_dns.cache[q->hash & (DNS_CACHE_SETS - 1)];
+    dns_entry_t *e, tmp;
+    uint32_t ttl, hits = 0;
+    uint8_t *copy;
+
+    if (!parse_answer_ttls(msg, len, q->question_end, &tmp, &ttl) ||
+            (copy = malloc(len)) == NULL) {
+        return;
+    }
+
+    if ((e = find_entry(q)) != NULL) {
+        hits = e->hits;
+    } else {
+        e = &set[0];
+        for (size_t i = 0; i < DNS_CACHE_WAYS; i++) {
+            if (!set[i].msg || set[i].expire_ms <= now) {
+                e = &set[i];
+                break;
+            }
+
+            if (set[i].expire_ms < e->expire_ms) {
+                e = &set[i];
+            }
+        }
+    }
+
+    if (!e->msg) {
+        counter_add(&g_dns.entries, 1);
+    }
+
+    free(e->msg);
+
+    memcpy(e->key, q->key, q->key_len);
+    e->key_len = q->key_len;
+    e->msg = copy;
+    memcpy(e->msg, msg, len);
+    e->msg_len = len;
+    memcpy(e->ttl_offs, tmp.ttl_offs, tmp.ttl_cnt * sizeof(tmp.ttl_offs[0]));
+    e->ttl_cnt = tmp.ttl_cnt;
+    e->stored_ms = now;
+    e->expire_ms = now + (uint64_t) ttl * 1000;
+    e->prefetch_ms = 0;
+    e->hits = hits;
+}
+
+static dns_pending_t *find_pending_by_key(const dns_query_t *q)
+{
+    for (size_t i = 0; i < DNS_MAX_PENDING; i++) {
+        dns_pending_t *p = &g_dns.pending[i];
+
+        if (p->is_used && p->q.key_len == q->key_len &&
+                !memcmp(p->q.key, q->key, q->key_len)) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static dns_pending_t *find_pending_by_id(uint16_t id)
+{
+    for (size_t i = 0; i < DNS_MAX_PENDING; i++) {
+        if (g_dns.pending[i].is_used && g_dns.pending[i].id == id) {
+            return &g_dns.pending[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool add_waiter(dns_pending_t *p, const uint8_t *msg,
+        const dns_query_t *q, const struct sockaddr_in *addr)
+{
+    dns_waiter_t *waiters;
+
+    if (p->waiters_cnt == p->waiters_size) {
+        size_t size = p->waiters_size ? p->waiters_size * 2 : 4;
+
+        if ((waiters = realloc(p->waiters, size * sizeof(*waiters))) == NULL) {
+            return false;
+        }
+        p->waiters = waiters;
+        p->waiters_size = size;
+    }
+
+    p->waiters[p->waiters_cnt].addr = *addr;
+    p->waiters[p->waiters_cnt].id = get_be16(msg);
+    p->waiters[p->waiters_cnt].max_size = q->max_size;
+    p->waiters[p->waiters_cnt].has_edns = q->has_edns;
+    memcpy(p->waiters[p->waiters_cnt].question, msg + DNS_HDR_SIZE,
+            q->question_end - DNS_HDR_SIZE);
+    p->waiters_cnt++;
+
+    return true;
+}
+
+static void free_pending(dns_pending_t *p)
+{
+    close(p->fd);
+    free(p->msg);
+    free(p->waiters);
+    memset(p, 0, sizeof(*p));
+}
+
+static void send_upstream(dns_pending_t *p)
+{
+    if (send(p->fd, p->msg, p->msg_len, 0) < 0) {
+        /* retried on timeout */
+    }
+}
+
+/*
+ * fresh socket on random port for each query, so a spoofed answer has
+ * to guess port as well as id (rfc 5452). kernel picks the port if all
+ * tries are taken.
+ */
+static int open_upstream_socket(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < DNS_PORT_TRIES; i++) {
+        addr.sin_port = htons(DNS_MIN_PORT +
+                gen_query_id() % (65536 - DNS_MIN_PORT));
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            break;
+        }
+    }
+
+    if (connect(fd, (struct sockaddr *) &g_dns.upstream,
+                sizeof(g_dns.upstream)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* query of client goes upstream under id of our own */
+static dns_pending_t *start_pending(const uint8_t *msg, size_t len,
+        const dns_query_t *q, uint64_t now)
+{
+    dns_pending_t *p = NULL;
+
+    for (size_t i = 0; i < DNS_MAX_PENDING && !p; i++) {
+        if (!g_dns.pending[i].is_used) {
+            p = &g_dns.pending[i];
+        }
+    }
+
+    if (!p || (p->fd = open_upstream_socket()) < 0) {
+        return NULL;
+    }
+
+    if ((p->msg = malloc(len)) == NULL) {
+        close(p->fd);
+        return NULL;
+    }
+
+    p->is_used = true;
+
+    do {
+        p->id = gen_query_id();
+    } while (find_pending_by_id(p->id) != p);
+
+    p->q = *q;
+    memcpy(p->msg, msg, len);
+    put_be16(p->msg, p->id);
+    p->msg_len = len;
+    p->first_ms = now;
+
+    send_upstream(p);
+
+    return p;
+}
+
+static void handle_query(void)
+{
+    uint8_t msg[DNS_MAX_MSG], buf[DNS_MAX_MSG];
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    dns_query_t q;
+    dns_entry_t *e;
+    dns_pending_t *p;
+    dns_waiter_t w;
+    uint64_t now = get_time_ms(), age;
+    ssize_t len;
+
+    if ((len = recvfrom(g_dns.fd, msg, sizeof(msg), 0,
+                    (struct sockaddr *) &addr, &addr_len)) < DNS_HDR_SIZE) {
+        return;
+    }
+
+    counter_add(&g_dns.queries, 1);
+
+    if (!parse_query(msg, len, &q)) {
+        if (!(get_be16(msg + 2) & DNS_FLAG_QR)) {
+            send_empty_reply(msg, DNS_HDR_SIZE, get_be16(msg),
+                    DNS_RCODE_FORMERR, &addr);
+        }
+        return;
+    }
+
+    if ((e = find_entry(&q)) != NULL && e->expire_ms > now) {
+        counter_add(&g_dns.hits, 1);
+        e->hits++;
+
+        /* records age while cached */
+        memcpy(buf, e->msg, e->msg_len);
+        age = (now - e->stored_ms) / 1000;
+        for (size_t i = 0; i < e->ttl_cnt; i++) {
+            uint32_t ttl = get_be32(buf + e->ttl_offs[i]);
+            put_be32(buf + e->ttl_offs[i], ttl > age ? ttl - age : 0);
+        }
+
+        w.addr = addr;
+        w.id = get_be16(msg);
+        w.max_size = q.max_size;
+        w.has_edns = q.has_edns;
+        memcpy(w.question, msg + DNS_HDR_SIZE, q.question_end - DNS_HDR_SIZE);
+        send_answer(buf, e->msg_len, q.question_end, &w);
+
+        /* refreshed in background, nobody waits for it */
+        if (get_simple_rt_config()->dns_mode == DNS_MODE_PREFETCH &&
+                e->hits >= DNS_PREFETCH_HITS &&
+                (e->expire_ms - now) * 100 <
+                (e->expire_ms - e->stored_ms) * DNS_PREFETCH_PERCENT &&
+                now - e->prefetch_ms > DNS_TIMEOUT_MS &&
+                !find_pending_by_key(&q) &&
+                start_pending(msg, len, &q, now) != NULL) {
+            e->prefetch_ms = now;
+            counter_add(&g_dns.prefetches, 1);
+        }
+        return;
+    }
+
+    counter_add(&g_dns.misses, 1);
+
+    if ((p = find_pending_by_key(&q)) != NULL) {
+        counter_add(&g_dns.coalesced, 1);
+    } else if ((p = start_pending(msg, len, &q, now)) == NULL) {
+        send_empty_reply(msg, q.question_end, get_be16(msg),
+                DNS_RCODE_SERVFAIL, &addr);
+        return;
+    }
+
+    if (!add_waiter(p, msg, &q, &addr)) {
+        send_empty_reply(msg, q.question_end, get_be16(msg),
+                DNS_RCODE_SERVFAIL, &addr);
+    }
+}
+
+static void handle_upstream_answer(dns_pending_t *p)
+{
+    uint8_t msg[DNS_MAX_MSG];
+    dns_query_t q;
+    ssize_t len;
+
+    /* connected socket, only upstream gets here */
+    if ((len = recv(p->fd, msg, sizeof(msg), 0)) < DNS_HDR_SIZE ||
+            !(get_be16(msg + 2) & DNS_FLAG_QR) || get_be16(msg) != p->id) {
+        return;
+    }
+
+    /* id matched, question must too, or it's a spoofing attempt */
+    if (!parse_question(msg, len, &q) || q.key_len + 1 != p->q.key_len ||
+            memcmp(q.key, p->q.key, q.key_len)) {
+        return;
+    }
+
+    /* key of query, with its dnssec bits */
+    store_entry(&p->q, msg, len, get_time_ms());
+
+    for (size_t i = 0; i < p->waiters_cnt; i++) {
+        send_answer(msg, len, q.question_end, &p->waiters[i]);
+    }
+
+    free_pending(p);
+}
+
+static void check_pending(void)
+{
+    uint8_t buf[DNS_HDR_SIZE + DNS_MAX_KEY];
+    uint64_t now = get_time_ms();
+
+    for (size_t i = 0; i < DNS_MAX_PENDING; i++) {
+        dns_pending_t *p = &g_dns.pending[i];
+
+        if (!p->is_used) {
+            continue;
+        }
+
+        if (now - p->first_ms >= DNS_TIMEOUT_MS) {
+            counter_add(&g_dns.upstream_timeouts, 1);
+
+            /* each waiter gets its question back as it was asked */
+            memcpy(buf, p->msg, DNS_HDR_SIZE);
+            for (size_t j = 0; j < p->waiters_cnt; j++) {
+                memcpy(buf + DNS_HDR_SIZE, p->waiters[j].question,
+                        p->q.question_end - DNS_HDR_SIZE);
+                send_empty_reply(buf, p->q.question_end,
+                        p->waiters[j].id, DNS_RCODE_SERVFAIL,
+                        &p->waiters[j].addr);
+            }
+
+            free_pending(p);
+        } else if (!p->is_retried && now - p->first_ms >= DNS_RETRY_MS) {
+            p->is_retried = true;
+            send_upstream(p);
+        }
+    }
+}
+
+static bool set_nonblock(int fd)
+{
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0;
+}
+
+static void close_tcp(dns_tcp_t *c)
+{
+    close(c->fds[0]);
+    close(c->fds[1]);
+    memset(c, 0, sizeof(*c));
+}
+
+/* not cached, phone talks to upstream through connection of its own */
+static void accept_tcp(void)
+{
+    dns_tcp_t *c = NULL;
+    int fd, upstream_fd;
+
+    if ((fd = accept(g_dns.tcp_fd, NULL, NULL)) < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < DNS_MAX_TCP && !c; i++) {
+        if (!g_dns.tcp[i].is_used) {
+            c = &g_dns.tcp[i];
+        }
+    }
+
+    if (!c || !set_nonblock(fd) ||
+            (upstream_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        close(fd);
+        return;
+    }
+
+    if (!set_nonblock(upstream_fd) ||
+            (connect(upstream_fd, (struct sockaddr *) &g_dns.upstream,
+                     sizeof(g_dns.upstream)) < 0 && errno != EINPROGRESS)) {
+        close(upstream_fd);
+        close(fd);
+        return;
+    }
+
+    c->is_used = true;
+    c->fds[0] = fd;
+    c->fds[1] = upstream_fd;
+    c->active_ms = get_time_ms();
+}
+
+/* reads while other side can't take more, writes what the other sent */
+static short get_tcp_events(const dns_tcp_t *c, size_t side)
+{
+    const dns_tcp_dir_t *in = &c->dirs[side], *out = &c->dirs[!side];
+    short events = 0;
+
+    if (!in->len && !in->is_eof) {
+        events |= POLLIN;
+    }
+
+    if (out->len || (out->is_eof && !out->is_shut)) {
+        events |= POLLOUT;
+    }
+
+    return events;
+}
+
+static bool read_tcp(dns_tcp_t *c, size_t side)
+{
+    dns_tcp_dir_t *d = &c->dirs[side];
+    ssize_t len;
+
+    if ((len = recv(c->fds[side], d->buf, sizeof(d->buf), 0)) < 0) {
+        return errno == EAGAIN || errno == EINTR;
+    }
+
+    d->off = 0;
+    d->len = len;
+    d->is_eof = !len;
+
+    return true;
+}
+
+/* sigpipe is blocked here, peer that is gone shows up as epipe */
+static bool write_tcp(dns_tcp_t *c, size_t side)
+{
+    dns_tcp_dir_t *d = &c->dirs[!side];
+    ssize_t len;
+
+    if (d->len) {
+        if ((len = send(c->fds[side], d->buf + d->off, d->len, 0)) < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+
+        d->off += len;
+        d->len -= len;
+    }
+
+    if (!d->len && d->is_eof && !d->is_shut) {
+        shutdown(c->fds[side], SHUT_WR);
+        d->is_shut = true;
+    }
+
+    return true;
+}
+
+static void handle_tcp(dns_tcp_t *c, const struct pollfd *pfds, uint64_t now)
+{
+    for (size_t side = 0; side < 2; side++) {
+        if (!pfds[side].revents) {
+            continue;
+        }
+
+        if (((pfds[side].events & POLLIN) && !read_tcp(c, side)) ||
+                ((pfds[side].events & POLLOUT) && !write_tcp(c, side))) {
+            close_tcp(c);
+            return;
+        }
+
+        c->active_ms = now;
+    }
+
+    if ((c->dirs[0].is_shut && c->dirs[1].is_shut) ||
+            now - c->active_ms >= DNS_TCP_IDLE_MS) {
+        close_tcp(c);
+    }
+}
+
+static void *dns_thread_proc(void *arg)
+{
+    struct pollfd pfds[2 + DNS_MAX_PENDING + 2 * DNS_MAX_TCP] = {
+        { .fd = g_dns.fd, .events = POLLIN },
+        { .fd = g_dns.tcp_fd, .events = POLLIN },
+    };
+    struct pollfd *pending_pfds = &pfds[2];
+    struct pollfd *tcp_pfds = &pfds[2 + DNS_MAX_PENDING];
+
+    while (g_dns.is_running) {
+        for (size_t i = 0; i < DNS_MAX_PENDING; i++) {
+            pending_pfds[i].fd = g_dns.pending[i].is_used ?
+                g_dns.pending[i].fd : -1;
+            pending_pfds[i].events = POLLIN;
+            pending_pfds[i].revents = 0;
+        }
+
+        /* side with nothing to do is left out, hangup would spin poll */
+        for (size_t i = 0; i < DNS_MAX_TCP; i++) {
+            for (size_t side = 0; side < 2; side++) {
+                struct pollfd *pfd = &tcp_pfds[2 * i + side];
+
+                pfd->events = g_dns.tcp[i].is_used ?
+                    get_tcp_events(&g_dns.tcp[i], side) : 0;
+                pfd->fd = pfd->events ? g_dns.tcp[i].fds[side] : -1;
+                pfd->revents = 0;
+            }
+        }
+
+        if (poll(pfds, ARRAY_SIZE(pfds), DNS_POLL_MS) < 0 && errno != EINTR) {
+            perror("dns poll");
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            handle_query();
+        }
+
+        /* new queries above went to free slots, these saw no events */
+        for (size_t i = 0; i < DNS_MAX_PENDING; i++) {
+            if (pending_pfds[i].revents & POLLIN) {
+                handle_upstream_answer(&g_dns.pending[i]);
+            }
+        }
+
+        for (size_t i = 0; i < DNS_MAX_TCP; i++) {
+            if (g_dns.tcp[i].is_used) {
+                handle_tcp(&g_dns.tcp[i], &tcp_pfds[2 * i], get_time_ms());
+            }
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            accept_tcp();
+        }
+
+        check_pending();
+    }
+
+    return NULL;
+}
+
+static bool seed_query_ids(void)
+{
+    int fd;
+    bool ret;
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) < 0) {
+        return false;
+    }
+
+    ret = read(fd, &g_dns.rand_state, sizeof(g_dns.rand_state)) ==
+        sizeof(g_dns.rand_state) && g_dns.rand_state;
+    close(fd);
+
+    return ret;
+}
+
+bool start_dns(void)
+{
+    simple_rt_config_t *config = get_simple_rt_config();
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+        .sin_addr.s_addr = htonl(get_acc_addr(1)),
+    };
+    struct sockaddr_in upstream = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+    };
+    sigset_t sigs, old_sigs;
+    int one = 1;
+
+    if (config->dns_mode == DNS_MODE_OFF) {
+        return true;
+    }
+
+    if (inet_pton(AF_INET, config->nameserver, &upstream.sin_addr) != 1) {
+        fprintf(stderr, "Dns forwarder needs ipv4 upstream, got %s\n",
+                config->nameserver);
+        return false;
+    }
+
+    if (!seed_query_ids()) {
+        fprintf(stderr, "Unable to seed dns query ids\n");
+        return false;
+    }
+
+    /* bound to tun address, other resolvers of host are not in the way */
+    if ((g_dns.fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+            setsockopt(g_dns.fd, SOL_SOCKET, SO_REUSEADDR,
+                &one, sizeof(one)) < 0 ||
+            bind(g_dns.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            (g_dns.tcp_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+            setsockopt(g_dns.tcp_fd, SOL_SOCKET, SO_REUSEADDR,
+                &one, sizeof(one)) < 0 ||
+            bind(g_dns.tcp_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(g_dns.tcp_fd, DNS_MAX_TCP) < 0 ||
+            !set_nonblock(g_dns.tcp_fd)) {
+        fprintf(stderr, "Unable to start dns forwarder: %s\n",
+                strerror(errno));
+        goto error;
+    }
+
+    g_dns.upstream = upstream;
+
+    g_dns.is_running = true;
+
+    /* signals are handled by main thread */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+
+    if (pthread_create(&g_dns.thread, NULL, dns_thread_proc, NULL) != 0) {
+        pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+        fprintf(stderr, "Unable to start dns thread\n");
+        g_dns.is_running = false;
+        goto error;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+    printf("dns forwarder on %s, upstream %s, %s\n",
+            inet_ntoa(addr.sin_addr), config->nameserver,
+            get_dns_mode_name(config->dns_mode));
+
+    return true;
+
+error:
+    if (g_dns.fd >= 0) {
+        close(g_dns.fd);
+        g_dns.fd = -1;
+    }
+
+    if (g_dns.tcp_fd >= 0) {
+        close(g_dns.tcp_fd);
+        g_dns.tcp_fd = -1;
+    }
+
+    return false;
+}
+
+void stop_dns(void)
+{
+    dns_stats_t stats;
+
+    if (!g_dns.is_running) {
+        return;
+    }
+
+    g_dns.is_running = false;
+    pthread_join(g_dns.thread, NULL);
+
+    get_dns_stats(&stats);
+    if (stats.queries) {
+        printf("dns: %llu queries, %.0f%% from cache, %llu coalesced, "
+                "%llu prefetched, %llu upstream timeouts\n",
+                (unsigned long long) stats.queries,
+                100.0 * stats.hits / stats.queries,
+                (unsigned long long) stats.coalesced,
+                (unsigned long long) stats.prefetches,
+                (unsigned long long) stats.upstream_timeouts);
+    }
+
+    for (size_t i = 0; i < DNS_MAX_PENDING; i++) {
+        if (g_dns.pending[i].is_used) {
+            free_pending(&g_dns.pending[i]);
+        }
+    }
+
+    for (size_t i = 0; i < DNS_MAX_TCP; i++) {
+        if (g_dns.tcp[i].is_used) {
+            close_tcp(&g_dns.tcp[i]);
+        }
+    }
+
+    for (size_t i = 0; i < DNS_CACHE_SETS; i++) {
+        for (size_t j = 0; j < DNS_CACHE_WAYS; j++) {
+            free(g_dns.cache[i][j].msg);
+            g_dns.cache[i][j].msg = NULL;
+        }
+    }
+
+    close(g_dns.fd);
+    close(g_dns.tcp_fd);
+    g_dns.fd = g_dns.tcp_fd = -1;
+}
+
+bool is_dns_running(void)
+{
+    return g_dns.is_running;
+}
+
+void get_dns_stats(dns_stats_t *stats)
+{
+    stats->queries = counter_get(&g_dns.queries);
+    stats->hits = counter_get(&g_dns.hits);
+    stats->misses = counter_get(&g_dns.misses);
+    stats->coalesced = counter_get(&g_dns.coalesced);
+    stats->prefetches = counter_get(&g_dns.prefetches);
+    stats->upstream_timeouts = counter_get(&g_dns.upstream_timeouts);
+    stats->entries = counter_get(&g_dns.entries);
+}
@@ -0,0 +1,387 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "ackfilter.h"
+#include "fq.h"
+#include "offload.h"
+#include "utils.h"
+
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+
+/* flows in dropping state restart from previous rate if seen again soon */
+#define FQ_CODEL_MEMORY_US (16 * FQ_CODEL_INTERVAL_US)
+
+/* most packets dropped per scan for fattest flow, as linux fq_codel does */
+#define FQ_DROP_BATCH 64
+
+static inline uint32_t mix_hash(uint32_t h, uint32_t val)
+{
+    h ^= val;
+    h *= 0x9e3779b1;
+
+    return h ^ (h >> 16);
+}
+
+/* fragments of a datagram stay in one flow, ports are in first one only */
+static uint32_t flow_hash(const fq_t *fq, const uint8_t *pkt, size_t size)
+{
+    uint32_t h = fq->perturb;
+    size_t ihl;
+
+    if (size < 20 || (pkt[0] >> 4) != 4) {
+        return h;
+    }
+
+    h = mix_hash(h, get_be32(pkt + 12));
+    h = mix_hash(h, get_be32(pkt + 16));
+    h = mix_hash(h, pkt[9]);
+
+    ihl = (pkt[0] & 0xf) * 4;
+
+    if ((pkt[9] == IP_PROTO_TCP || pkt[9] == IP_PROTO_UDP) &&
+            !(get_be32(pkt + 4) & 0x3fff) && ihl + 4 <= size) {
+        h = mix_hash(h, get_be32(pkt + ihl));
+    }
+
+    return h;
+}
+
+static void list_push(fq_list_t *list, fq_flow_t *flow)
+{
+    flow->next = NULL;
+
+    if (list->tail) {
+        list->tail->next = flow;
+    } else {
+        list->head = flow;
+    }
+
+    list->tail = flow;
+}
+
+static fq_flow_t *list_pop(fq_list_t *list)
+{
+    fq_flow_t *flow = list->head;
+
+    if ((list->head = flow->next) == NULL) {
+        list->tail = NULL;
+    }
+
+    flow->next = NULL;
+
+    return flow;
+}
+
+static packet_t *flow_pop(fq_t *fq, fq_flow_t *flow)
+{
+    packet_t *pkt = flow->head;
+
+    if (!pkt) {
+        return NULL;
+    }
+
+    if ((flow->head = pkt->next) == NULL) {
+        flow->tail = NULL;
+    }
+
+    pkt->next = NULL;
+    flow->backlog -= pkt->len;
+    fq->len--;
+
+    return pkt;
+}
+
+static void update_backlog(fq_t *fq)
+{
+    atomic_store_explicit(&fq->stats->backlog, fq->len, memory_order_relaxed);
+}
+
+bool fq_init(fq_t *fq, size_t limit, uint32_t quantum, aqm_stats_t *stats)
+{
+    memset(fq, 0, sizeof(*fq));
+
+    if ((fq->flows = calloc(FQ_FLOWS, sizeof(fq_flow_t))) == NULL) {
+        return false;
+    }
+
+    fq->limit = limit;
+    fq->quantum = quantum;
+    fq->stats = stats;
+    /* hash collisions differ between accessories and runs */
+    fq->perturb = mix_hash((uint32_t) get_time_us(), (uint32_t) (uintptr_t) fq);
+
+    return true;
+}
+
+void fq_destroy(fq_t *fq)
+{
+    packet_t *pkt;
+
+    if (!fq->flows) {
+        return;
+    }
+
+    for (size_t i = 0; i < FQ_FLOWS; i++) {
+        while ((pkt = flow_pop(fq, &fq->flows[i])) != NULL) {
+            packet_free(pkt);
+        }
+    }
+
+    free(fq->flows);
+    fq->flows = NULL;
+    update_backlog(fq);
+}
+
+/*
+ * head drop from flow holding most bytes, it is the one to blame. half
+ * of its backlog goes at once, so the scan over all flows runs once per
+ * batch instead of on every enqueue while the queue stays full.
+ */
+static void drop_fattest(fq_t *fq)
+{
+    fq_flow_t *fattest = &fq->flows[0];
+    uint32_t threshold;
+    uint64_t dropped = 0;
+
+    for (size_t i = 1; i < FQ_FLOWS; i++) {
+        if (fq->flows[i].backlog > fattest->backlog) {
+            fattest = &fq->flows[i];
+        }
+    }
+
+    threshold = fattest->backlog / 2;
+    do {
+        packet_free(flow_pop(fq, fattest));
+        dropped++;
+    } while (fattest->backlog > threshold && dropped < FQ_DROP_BATCH);
+
+    counter_add(&fq->stats->overlimit_drops, dropped);
+}
+
+/* acks still queued in flow are useless once newer one is there */
+static void drop_stale_acks(fq_t *fq, fq_flow_t *flow, const tcp_ack_t *ack)
+{
+    packet_t **link = &flow->head, *prev = NULL, *pkt;
+    tcp_ack_t queued;
+
+    while ((pkt = *link) != NULL) {
+        if (!parse_tcp_ack(pkt->data, pkt->len, &queued) ||
+                !is_ack_redundant(&queued, ack)) {
+            prev = pkt;
+            link = &pkt->next;
+            continue;
+        }
+
+        if ((*link = pkt->next) == NULL) {
+            flow->tail = prev;
+        }
+
+        flow->backlog -= pkt->len;
+        fq->len--;
+        packet_free(pkt);
+        counter_add(&fq->stats->ack_drops, 1);
+    }
+}
+
+void fq_enqueue(fq_t *fq, packet_t *pkt, uint64_t now)
+{
+    fq_flow_t *flow = &fq->flows[flow_hash(fq, pkt->data, pkt->len) &
+        (FQ_FLOWS - 1)];
+    tcp_ack_t ack;
+
+    if (fq->filter_acks && flow->head &&
+            parse_tcp_ack(pkt->data, pkt->len, &ack)) {
+        drop_stale_acks(fq, flow, &ack);
+    }
+
+    /* switched packets were not read from tun */
+    if (!pkt->ts) {
+        pkt->ts = now;
+    }
+
+    pkt->next = NULL;
+
+    if (flow->tail) {
+        flow->tail->next = pkt;
+    } else {
+        flow->head = pkt;
+    }
+
+    flow->tail = pkt;
+    flow->backlog += pkt->len;
+    fq->len++;
+
+    if (!flow->is_listed) {
+        flow->is_listed = true;
+        flow->deficit = fq->quantum;
+        list_push(&fq->new_flows, flow);
+    }
+
+    if (fq->len > fq->limit) {
+        drop_fattest(fq);
+    }
+
+    update_backlog(fq);
+}
+
+/* ts may be taken after caller sampled now */
+static inline uint64_t get_sojourn(const packet_t *pkt, uint64_t now)
+{
+    return now > pkt->ts ? now - pkt->ts : 0;
+}
+
+static uint64_t codel_control_law(uint64_t ts, uint32_t count)
+{
+    return ts + (uint64_t) (FQ_CODEL_INTERVAL_US / sqrt(count));
+}
+
+/* queue stayed above target for a whole interval */
+static bool codel_should_drop(fq_t *fq, fq_flow_t *flow, packet_t *pkt,
+        uint64_t now)
+{
+    if (!pkt || get_sojourn(pkt, now) < FQ_CODEL_TARGET_US ||
+            flow->backlog <= fq->quantum) {
+        flow->first_above_ts = 0;
+        return false;
+    }
+
+    if (!flow->first_above_ts) {
+        flow->first_above_ts = now + FQ_CODEL_INTERVAL_US;
+        return false;
+    }
+
+    return now >= flow->first_above_ts;
+}
+
+/* ecn capable packet is marked and kept, true if pkt is still to be sent */
+static bool codel_signal(fq_t *fq, packet_t *pkt)
+{
+    if (mark_ecn_ce(pkt->data, pkt->len)) {
+        counter_add(&fq->stats->ecn_marks, 1);
+        return true;
+    }
+
+    counter_add(&fq->stats->codel_drops, 1);
+    packet_free(pkt);
+
+    return false;
+}
+
+/* rfc 8289 dequeue for one flow */
+static packet_t *codel_dequeue(fq_t *fq, fq_flow_t *flow, uint64_t now)
+{
+    packet_t *pkt = flow_pop(fq, flow);
+    bool drop = codel_should_drop(fq, flow, pkt, now);
+    uint32_t delta;
+
+    if (!pkt) {
+        flow->is_dropping = false;
+        return NULL;
+    }
+
+    if (flow->is_dropping) {
+        if (!drop) {
+            flow->is_dropping = false;
+        }
+
+        while (flow->is_dropping && now >= flow->drop_next) {
+            flow->count++;
+
+            if (codel_signal(fq, pkt)) {
+                flow->drop_next = codel_control_law(flow->drop_next,
+                        flow->count);
+                return pkt;
+            }
+
+            pkt = flow_pop(fq, flow);
+
+            if (!codel_should_drop(fq, flow, pkt, now)) {
+                flow->is_dropping = false;
+            } else {
+                flow->drop_next = codel_control_law(flow->drop_next,
+                        flow->count);
+            }
+        }
+    } else if (drop) {
+        flow->is_dropping = true;
+
+        delta = flow->count - flow->last_count;
+        flow->count = delta > 1 &&
+            (int64_t) (now - flow->drop_next) < FQ_CODEL_MEMORY_US ?
+            delta : 1;
+        flow->last_count = flow->count;
+        flow->drop_next = codel_control_law(now, flow->count);
+
+        if (!codel_signal(fq, pkt)) {
+            pkt = flow_pop(fq, flow);
+        }
+    }
+
+    return pkt;
+}
+
+packet_t *fq_dequeue(fq_t *fq, uint64_t now)
+{
+    fq_list_t *list;
+    fq_flow_t *flow;
+    packet_t *pkt;
+
+    while (true) {
+        if (fq->new_flows.head) {
+            list = &fq->new_flows;
+        } else if (fq->old_flows.head) {
+            list = &fq->old_flows;
+        } else {
+            update_backlog(fq);
+            return NULL;
+        }
+
+        flow = list->head;
+
+        /* used up its share this round, goes behind others */
+        if (flow->deficit <= 0) {
+            flow->deficit += fq->quantum;
+            list_push(&fq->old_flows, list_pop(list));
+            continue;
+        }
+
+        if ((pkt = codel_dequeue(fq, flow, now)) == NULL) {
+            list_pop(list);
+
+            /* emptied new flow waits one round, it can't stay new forever */
+            if (list == &fq->new_flows && fq->old_flows.head) {
+                list_push(&fq->old_flows, flow);
+            } else {
+                flow->is_listed = false;
+            }
+            continue;
+        }
+
+        flow->deficit -= (int32_t) pkt->len;
+
+        hist_record(&fq->stats->sojourn, get_sojourn(pkt, now));
+        update_backlog(fq);
+
+        return pkt;
+    }
+}
@@ -0,0 +1,115 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "framing.h"
+#include "utils.h"
+
+void frame_batch_init(frame_batch_t *batch, uint8_t *buf, size_t size)
+{
+    batch->buf = buf;
+    batch->size = size;
+    batch->len = FRAME_BATCH_HDR_SIZE;
+    batch->count = 0;
+
+    buf[0] = FRAME_MAGIC;
+    buf[1] = FRAME_VERSION;
+    put_be16(&buf[2], 0);
+}
+
+bool frame_batch_add(frame_batch_t *batch, uint8_t type, uint8_t flags,
+        const uint8_t *data, size_t size)
+{
+    uint8_t *p = batch->buf + batch->len;
+
+    /* keep one byte for padding */
+    if (size > UINT16_MAX || batch->count == UINT16_MAX ||
+            batch->len + FRAME_HDR_SIZE + size + 1 > batch->size) {
+        return false;
+    }
+
+    put_be16(&p[0], size);
+    p[2] = type;
+    p[3] = flags;
+    memcpy(&p[FRAME_HDR_SIZE], data, size);
+
+    batch->len += FRAME_HDR_SIZE + size;
+    batch->count++;
+    put_be16(&batch->buf[2], batch->count);
+
+    return true;
+}
+
+size_t frame_batch_finish(frame_batch_t *batch)
+{
+    if (batch->len % FRAME_PAD_ALIGN == 0) {
+        batch->buf[batch->len++] = 0;
+    }
+
+    return batch->len;
+}
+
+bool is_framed_transfer(const uint8_t *data, size_t size)
+{
+    return size >= FRAME_BATCH_HDR_SIZE && data[0] == FRAME_MAGIC;
+}
+
+/* returns number of frames, -1 on malformed transfer */
+int parse_framed_transfer(const uint8_t *data, size_t size,
+        frame_cb cb, void *arg)
+{
+    const uint8_t *end = data + size;
+    int frames = 0;
+
+    /* transfers may be merged by usb, so several batches can follow */
+    while (end - data >= FRAME_BATCH_HDR_SIZE && data[0] == FRAME_MAGIC) {
+        uint16_t count = get_be16(&data[2]);
+
+        if (data[1] != FRAME_VERSION) {
+            return -1;
+        }
+
+        data += FRAME_BATCH_HDR_SIZE;
+
+        for (uint16_t i = 0; i < count; i++) {
+            uint16_t len;
+
+            if (end - data < FRAME_HDR_SIZE) {
+                return -1;
+            }
+
+            len = get_be16(&data[0]);
+            if (end - data - FRAME_HDR_SIZE < len) {
+                return -1;
+            }
+
+            cb(arg, data[2], data[3], &data[FRAME_HDR_SIZE], len);
+
+            data += FRAME_HDR_SIZE + len;
+            frames++;
+        }
+
+        /* skip padding */
+        while (data < end && *data == 0) {
+            data++;
+        }
+    }
+
+    return frames;
+}
@@ -0,0 +1,103 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "idpool.h"
+
+/* id is not in free list */
+#define ID_USED UINT32_MAX
+
+/* list head lives at index size */
+#define HEAD(pool) ((pool)->size)
+
+bool id_pool_init(id_pool_t *pool, uint32_t size)
+{
+    pool->size = size;
+    pool->free_cnt = size;
+    pool->next = calloc(size + 1, sizeof(*pool->next));
+    pool->prev = calloc(size + 1, sizeof(*pool->prev));
+
+    if (!pool->next || !pool->prev) {
+        id_pool_destroy(pool);
+        return false;
+    }
+
+    /* circular list: head -> 0 -> 1 -> ... -> size - 1 -> head */
+    for (uint32_t i = 0; i <= size; i++) {
+        pool->next[i] = i == size ? 0 : i + 1;
+        pool->prev[i] = i == 0 ? size : i - 1;
+    }
+
+    if (!size) {
+        pool->next[HEAD(pool)] = pool->prev[HEAD(pool)] = HEAD(pool);
+    }
+
+    return true;
+}
+
+void id_pool_destroy(id_pool_t *pool)
+{
+    free(pool->next);
+    free(pool->prev);
+
+    pool->next = pool->prev = NULL;
+    pool->size = pool->free_cnt = 0;
+}
+
+bool id_pool_reserve(id_pool_t *pool, uint32_t id)
+{
+    if (id >= pool->size || pool->next[id] == ID_USED) {
+        return false;
+    }
+
+    pool->next[pool->prev[id]] = pool->next[id];
+    pool->prev[pool->next[id]] = pool->prev[id];
+    pool->next[id] = pool->prev[id] = ID_USED;
+    pool->free_cnt--;
+
+    return true;
+}
+
+bool id_pool_acquire(id_pool_t *pool, uint32_t *id)
+{
+    if (!pool->free_cnt) {
+        return false;
+    }
+
+    *id = pool->next[HEAD(pool)];
+
+    return id_pool_reserve(pool, *id);
+}
+
+void id_pool_release(id_pool_t *pool, uint32_t id)
+{
+    uint32_t tail;
+
+    if (id >= pool->size || pool->next[id] != ID_USED) {
+        return;
+    }
+
+    tail = pool->prev[HEAD(pool)];
+
+    pool->next[tail] = id;
+    pool->prev[id] = tail;
+    pool->next[id] = HEAD(pool);
+    pool->prev[HEAD(pool)] = id;
+    pool->free_cnt++;
+}
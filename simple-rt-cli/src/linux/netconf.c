@@ -0,0 +1,519 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include "netconf.h"
+
+/* whole setup fits in one message buffer */
+#define NL_BUF_SIZE 8192
+
+/* no reply within this time means something went badly wrong */
+#define NL_TIMEOUT_SEC 2
+
+#define NFT_TABLE_NAME "simple_rt"
+#define NFT_CHAIN_NAME "postrouting"
+
+#define IP_FORWARD_PATH "/proc/sys/net/ipv4/ip_forward"
+
+typedef struct nl_buf_t {
+    uint8_t data[NL_BUF_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    size_t len;
+    size_t msg;
+    /* replies outside first_seq..seq are left over from earlier batch */
+    uint32_t first_seq;
+    uint32_t seq;
+    uint32_t ack_seq;
+    bool overflow;
+} nl_buf_t;
+
+static uint32_t g_nl_seq;
+
+/* owns nftables table, kernel drops table when it's closed */
+static int g_nft_fd = -1;
+
+static void nl_buf_init(nl_buf_t *b)
+{
+    b->len = b->msg = 0;
+    b->first_seq = b->seq = b->ack_seq = 0;
+    b->overflow = false;
+
+    if (!g_nl_seq) {
+        g_nl_seq = time(NULL);
+    }
+}
+
+static void *nl_put(nl_buf_t *b, size_t len)
+{
+    void *ret = b->data + b->len;
+
+    if (b->len + NLMSG_ALIGN(len) > sizeof(b->data)) {
+        b->overflow = true;
+        return NULL;
+    }
+
+    memset(ret, 0, NLMSG_ALIGN(len));
+    b->len += NLMSG_ALIGN(len);
+    ((struct nlmsghdr *) (b->data + b->msg))->nlmsg_len = b->len - b->msg;
+
+    return ret;
+}
+
+/* new message, attributes below go into it */
+static void nl_msg(nl_buf_t *b, uint16_t type, uint16_t flags,
+        const void *hdr, size_t hdr_len)
+{
+    struct nlmsghdr *nlh;
+    size_t off = b->len;
+
+    if (b->len + NLMSG_LENGTH(0) > sizeof(b->data)) {
+        b->overflow = true;
+        return;
+    }
+
+    b->msg = off;
+    if ((nlh = nl_put(b, NLMSG_LENGTH(0))) == NULL) {
+        return;
+    }
+
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nlh->nlmsg_seq = b->seq = ++g_nl_seq;
+    nlh->nlmsg_len = NLMSG_LENGTH(0);
+
+    if (!b->first_seq) {
+        b->first_seq = b->seq;
+    }
+
+    if (flags & NLM_F_ACK) {
+        b->ack_seq = b->seq;
+    }
+
+    if (hdr_len) {
+        void *p = nl_put(b, hdr_len);
+
+        if (p) {
+            memcpy(p, hdr, hdr_len);
+        }
+    }
+}
+
+static void nl_attr(nl_buf_t *b, uint16_t type, const void *data, size_t len)
+{
+    struct nlattr *nla;
+
+    if ((nla = nl_put(b, NLA_HDRLEN + len)) == NULL) {
+        return;
+    }
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy((uint8_t *) nla + NLA_HDRLEN, data, len);
+}
+
+static void nl_attr_u32(nl_buf_t *b, uint16_t type, uint32_t val)
+{
+    nl_attr(b, type, &val, sizeof(val));
+}
+
+static void nl_attr_str(nl_buf_t *b, uint16_t type, const char *str)
+{
+    nl_attr(b, type, str, strlen(str) + 1);
+}
+
+static size_t nl_nest_begin(nl_buf_t *b, uint16_t type)
+{
+    size_t off = b->len;
+    struct nlattr *nla;
+
+    if ((nla = nl_put(b, NLA_HDRLEN)) != NULL) {
+        nla->nla_type = NLA_F_NESTED | type;
+    }
+
+    return off;
+}
+
+static void nl_nest_end(nl_buf_t *b, size_t off)
+{
+    if (!b->overflow) {
+        ((struct nlattr *) (b->data + off))->nla_len = b->len - off;
+    }
+}
+
+static int nl_open(int proto)
+{
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+    struct timeval tv = { .tv_sec = NL_TIMEOUT_SEC };
+    int fd;
+
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, proto)) < 0) {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * sends all messages at once, waits until last one is acked. failed
+ * batch is drained up to that ack too, first error is reported.
+ */
+static bool nl_talk(int fd, nl_buf_t *b)
+{
+    uint8_t buf[NL_BUF_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *nlh;
+    struct nlmsgerr *err;
+    ssize_t len;
+    int error = 0;
+
+    if (b->overflow) {
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    if (send(fd, b->data, b->len, 0) < 0) {
+        return false;
+    }
+
+    for (;;) {
+        /* kernel may stop batch early, timeout ends the wait then */
+        if ((len = recv(fd, buf, sizeof(buf), 0)) < 0) {
+            errno = error ? error : errno;
+            return false;
+        }
+
+        for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, (size_t) len);
+                nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR ||
+                    nlh->nlmsg_seq < b->first_seq ||
+                    nlh->nlmsg_seq > b->seq) {
+                continue;
+            }
+
+            err = NLMSG_DATA(nlh);
+            if (err->error && !error) {
+                error = -err->error;
+            }
+
+            if (nlh->nlmsg_seq == b->ack_seq) {
+                errno = error;
+                return !error;
+            }
+        }
+    }
+}
+
+static bool set_link_addr(const netconf_t *conf, unsigned int ifindex)
+{
+    nl_buf_t b;
+    int fd;
+    bool ret;
+
+    uint32_t local = htonl(conf->host_addr);
+    uint32_t brd = htonl(conf->net_addr | ~(0xffffffffu << (32 - conf->prefix)));
+
+    struct ifaddrmsg ifa = {
+        .ifa_family = AF_INET,
+        .ifa_prefixlen = conf->prefix,
+        .ifa_index = ifindex,
+    };
+
+    struct ifinfomsg ifi = {
+        .ifi_family = AF_UNSPEC,
+        .ifi_index = ifindex,
+        .ifi_flags = IFF_UP,
+        .ifi_change = IFF_UP,
+    };
+
+    if ((fd = nl_open(NETLINK_ROUTE)) < 0) {
+        return false;
+    }
+
+    nl_buf_init(&b);
+
+    /* prefix route comes with address */
+    nl_msg(&b, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK,
+            &ifa, sizeof(ifa));
+    nl_attr(&b, IFA_LOCAL, &local, sizeof(local));
+    nl_attr(&b, IFA_ADDRESS, &local, sizeof(local));
+    nl_attr(&b, IFA_BROADCAST, &brd, sizeof(brd));
+
+    nl_msg(&b, RTM_NEWLINK, NLM_F_ACK, &ifi, sizeof(ifi));
+    nl_attr_u32(&b, IFLA_MTU, conf->mtu);
+
+    ret = nl_talk(fd, &b);
+    close(fd);
+
+    return ret;
+}
+
+static bool enable_ip_forward(void)
+{
+    int fd;
+    bool ret;
+
+    if ((fd = open(IP_FORWARD_PATH, O_WRONLY | O_CLOEXEC)) < 0) {
+        return false;
+    }
+
+    ret = write(fd, "1", 1) == 1;
+    close(fd);
+
+    return ret;
+}
+
+static void nft_msg(nl_buf_t *b, uint16_t type, uint16_t flags,
+        uint8_t family)
+{
+    struct nfgenmsg nfg = {
+        .nfgen_family = family,
+        .version = NFNETLINK_V0,
+        .res_id = htons(NFNL_SUBSYS_NFTABLES),
+    };
+
+    if (type != NFNL_MSG_BATCH_BEGIN && type != NFNL_MSG_BATCH_END) {
+        type |= NFNL_SUBSYS_NFTABLES << 8;
+    }
+
+    nl_msg(b, type, flags, &nfg, sizeof(nfg));
+}
+
+static void nft_expr_begin(nl_buf_t *b, const char *name,
+        size_t *elem, size_t *data)
+{
+    *elem = nl_nest_begin(b, NFTA_LIST_ELEM);
+    nl_attr_str(b, NFTA_EXPR_NAME, name);
+    *data = nl_nest_begin(b, NFTA_EXPR_DATA);
+}
+
+static void nft_expr_end(nl_buf_t *b, size_t elem, size_t data)
+{
+    nl_nest_end(b, data);
+    nl_nest_end(b, elem);
+}
+
+static void nft_data(nl_buf_t *b, uint16_t type, const void *data, size_t len)
+{
+    size_t nest = nl_nest_begin(b, type);
+
+    nl_attr(b, NFTA_DATA_VALUE, data, len);
+    nl_nest_end(b, nest);
+}
+
+/* ip saddr net/prefix oifname out_iface masquerade */
+static void nft_masq_rule(nl_buf_t *b, const netconf_t *conf)
+{
+    char ifname[IFNAMSIZ] = { 0 };
+    uint32_t net = htonl(conf->net_addr);
+    uint32_t mask = htonl(0xffffffffu << (32 - conf->prefix));
+    uint32_t zero = 0;
+    size_t exprs, elem, data;
+
+    strncpy(ifname, conf->out_iface, sizeof(ifname) - 1);
+
+    nft_msg(b, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND | NLM_F_ACK,
+            NFPROTO_IPV4);
+    nl_attr_str(b, NFTA_RULE_TABLE, NFT_TABLE_NAME);
+    nl_attr_str(b, NFTA_RULE_CHAIN, NFT_CHAIN_NAME);
+
+    exprs = nl_nest_begin(b, NFTA_RULE_EXPRESSIONS);
+
+    nft_expr_begin(b, "payload", &elem, &data);
+    nl_attr_u32(b, NFTA_PAYLOAD_DREG, htonl(NFT_REG_1));
+    nl_attr_u32(b, NFTA_PAYLOAD_BASE, htonl(NFT_PAYLOAD_NETWORK_HEADER));
+    nl_attr_u32(b, NFTA_PAYLOAD_OFFSET, htonl(12));
+    nl_attr_u32(b, NFTA_PAYLOAD_LEN, htonl(sizeof(net)));
+    nft_expr_end(b, elem, data);
+
+    nft_expr_begin(b, "bitwise", &elem, &data);
+    nl_attr_u32(b, NFTA_BITWISE_SREG, htonl(NFT_REG_1));
+    nl_attr_u32(b, NFTA_BITWISE_DREG, htonl(NFT_REG_1));
+    nl_attr_u32(b, NFTA_BITWISE_LEN, htonl(sizeof(mask)));
+    nft_data(b, NFTA_BITWISE_MASK, &mask, sizeof(mask));
+    nft_data(b, NFTA_BITWISE_XOR, &zero, sizeof(zero));
+    nft_expr_end(b, elem, data);
+
+    nft_expr_begin(b, "cmp", &elem, &data);
+    nl_attr_u32(b, NFTA_CMP_SREG, htonl(NFT_REG_1));
+    nl_attr_u32(b, NFTA_CMP_OP, htonl(NFT_CMP_EQ));
+    nft_data(b, NFTA_CMP_DATA, &net, sizeof(net));
+    nft_expr_end(b, elem, data);
+
+    nft_expr_begin(b, "meta", &elem, &data);
+    nl_attr_u32(b, NFTA_META_DREG, htonl(NFT_REG_1));
+    nl_attr_u32(b, NFTA_META_KEY, htonl(NFT_META_OIFNAME));
+    nft_expr_end(b, elem, data);
+
+    nft_expr_begin(b, "cmp", &elem, &data);
+    nl_attr_u32(b, NFTA_CMP_SREG, htonl(NFT_REG_1));
+    nl_attr_u32(b, NFTA_CMP_OP, htonl(NFT_CMP_EQ));
+    nft_data(b, NFTA_CMP_DATA, ifname, sizeof(ifname));
+    nft_expr_end(b, elem, data);
+
+    nft_expr_begin(b, "masq", &elem, &data);
+    nft_expr_end(b, elem, data);
+
+    nl_nest_end(b, exprs);
+}
+
+/*
+ * whole table is replaced in one transaction, other rulesets are not
+ * touched. owned table goes away with its socket, even if we crash.
+ */
+static bool setup_nat(const netconf_t *conf, bool owned)
+{
+    nl_buf_t b;
+    size_t hook;
+
+    nl_buf_init(&b);
+
+    nft_msg(&b, NFNL_MSG_BATCH_BEGIN, 0, AF_UNSPEC);
+
+    /* add + delete drops leftovers of unclean exit without failing batch */
+    nft_msg(&b, NFT_MSG_NEWTABLE, NLM_F_CREATE | NLM_F_ACK, NFPROTO_IPV4);
+    nl_attr_str(&b, NFTA_TABLE_NAME, NFT_TABLE_NAME);
+
+    nft_msg(&b, NFT_MSG_DELTABLE, NLM_F_ACK, NFPROTO_IPV4);
+    nl_attr_str(&b, NFTA_TABLE_NAME, NFT_TABLE_NAME);
+
+    nft_msg(&b, NFT_MSG_NEWTABLE, NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK,
+            NFPROTO_IPV4);
+    nl_attr_str(&b, NFTA_TABLE_NAME, NFT_TABLE_NAME);
+    if (owned) {
+        nl_attr_u32(&b, NFTA_TABLE_FLAGS, htonl(NFT_TABLE_F_OWNER));
+    }
+
+    nft_msg(&b, NFT_MSG_NEWCHAIN, NLM_F_CREATE | NLM_F_ACK, NFPROTO_IPV4);
+    nl_attr_str(&b, NFTA_CHAIN_TABLE, NFT_TABLE_NAME);
+    nl_attr_str(&b, NFTA_CHAIN_NAME, NFT_CHAIN_NAME);
+    nl_attr_str(&b, NFTA_CHAIN_TYPE, "nat");
+    hook = nl_nest_begin(&b, NFTA_CHAIN_HOOK);
+    nl_attr_u32(&b, NFTA_HOOK_HOOKNUM, htonl(NF_INET_POST_ROUTING));
+    nl_attr_u32(&b, NFTA_HOOK_PRIORITY, htonl(NF_IP_PRI_NAT_SRC));
+    nl_nest_end(&b, hook);
+
+    nft_masq_rule(&b, conf);
+
+    nft_msg(&b, NFNL_MSG_BATCH_END, 0, AF_UNSPEC);
+
+    return nl_talk(g_nft_fd, &b);
+}
+
+static bool delete_nat(void)
+{
+    nl_buf_t b;
+
+    nl_buf_init(&b);
+
+    nft_msg(&b, NFNL_MSG_BATCH_BEGIN, 0, AF_UNSPEC);
+    nft_msg(&b, NFT_MSG_DELTABLE, NLM_F_ACK, NFPROTO_IPV4);
+    nl_attr_str(&b, NFTA_TABLE_NAME, NFT_TABLE_NAME);
+    nft_msg(&b, NFNL_MSG_BATCH_END, 0, AF_UNSPEC);
+
+    return nl_talk(g_nft_fd, &b);
+}
+
+bool netconf_up(const netconf_t *conf)
+{
+    unsigned int ifindex;
+    char addr_str[INET_ADDRSTRLEN];
+    uint32_t addr = htonl(conf->host_addr);
+
+    if (if_nametoindex(conf->out_iface) == 0) {
+        fprintf(stderr, "Supply valid local interface! %s: %s\n",
+                conf->out_iface, strerror(errno));
+        return false;
+    }
+
+    if ((ifindex = if_nametoindex(conf->dev)) == 0 ||
+            !set_link_addr(conf, ifindex)) {
+        fprintf(stderr, "Unable to configure %s: %s\n", conf->dev,
+                strerror(errno));
+        return false;
+    }
+
+    if (!enable_ip_forward()) {
+        fprintf(stderr, "Unable to enable ip forwarding: %s\n",
+                strerror(errno));
+        return false;
+    }
+
+    if ((g_nft_fd = nl_open(NETLINK_NETFILTER)) < 0) {
+        fprintf(stderr, "Unable to open nftables socket: %s\n",
+                strerror(errno));
+        return false;
+    }
+
+    /* table owner flag is linux 5.12+, older ones take it as invalid */
+    if (!setup_nat(conf, true) &&
+            ((errno != EOPNOTSUPP && errno != EINVAL) ||
+             !setup_nat(conf, false))) {
+        fprintf(stderr, "Unable to set up nftables masquerading: %s\n",
+                strerror(errno));
+        close(g_nft_fd);
+        g_nft_fd = -1;
+        return false;
+    }
+
+    inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+    printf("%s: %s/%u, masquerading via %s\n", conf->dev, addr_str,
+            conf->prefix, conf->out_iface);
+
+    return true;
+}
+
+bool netconf_down(void)
+{
+    bool ret;
+
+    /* address and routes go away with tun device */
+    if (g_nft_fd < 0) {
+        return true;
+    }
+
+    if (!(ret = delete_nat())) {
+        fprintf(stderr, "Unable to delete nftables table: %s\n",
+                strerror(errno));
+    }
+
+    close(g_nft_fd);
+    g_nft_fd = -1;
+
+    return ret;
+}
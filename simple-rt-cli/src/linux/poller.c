@@ -0,0 +1,129 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "poller.h"
+
+#define POLLER_MAX_EVENTS 64
+
+struct poller_t {
+    int epoll_fd;
+    int wakeup_fd;
+};
+
+poller_t *poller_new(void)
+{
+    poller_t *poller;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+    if ((poller = malloc(sizeof(*poller))) == NULL) {
+        return NULL;
+    }
+
+    poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    poller->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (poller->epoll_fd < 0 || poller->wakeup_fd < 0 ||
+            epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD,
+                poller->wakeup_fd, &ev) < 0) {
+        perror("Unable to create poller");
+        poller_free(poller);
+        return NULL;
+    }
+
+    return poller;
+}
+
+void poller_free(poller_t *poller)
+{
+    if (!poller) {
+        return;
+    }
+
+    if (poller->epoll_fd >= 0) {
+        close(poller->epoll_fd);
+    }
+
+    if (poller->wakeup_fd >= 0) {
+        close(poller->wakeup_fd);
+    }
+
+    free(poller);
+}
+
+bool poller_add(poller_t *poller, int fd, short events, void *data)
+{
+    struct epoll_event ev = { .events = 0, .data.ptr = data };
+
+    if (events & POLLIN) {
+        ev.events |= EPOLLIN;
+    }
+
+    if (events & POLLOUT) {
+        ev.events |= EPOLLOUT;
+    }
+
+    return epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void poller_del(poller_t *poller, int fd)
+{
+    epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int poller_wait(poller_t *poller, void **data, int max, int64_t timeout_us)
+{
+    int cnt, ret = 0;
+    uint64_t val;
+    struct epoll_event events[POLLER_MAX_EVENTS];
+    int timeout_ms = timeout_us < 0 ? -1 : (int) ((timeout_us + 999) / 1000);
+
+    if (max > POLLER_MAX_EVENTS) {
+        max = POLLER_MAX_EVENTS;
+    }
+
+    if ((cnt = epoll_wait(poller->epoll_fd, events, max, timeout_ms)) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        if (events[i].data.ptr) {
+            data[ret++] = events[i].data.ptr;
+        } else if (read(poller->wakeup_fd, &val, sizeof(val)) < 0) {
+            /* already drained */
+        }
+    }
+
+    return ret;
+}
+
+void poller_wakeup(poller_t *poller)
+{
+    uint64_t val = 1;
+
+    if (write(poller->wakeup_fd, &val, sizeof(val)) < 0) {
+        /* counter is already signalled */
+    }
+}
@@ -20,21 +20,44 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <netinet/ip.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "tun.h"
+#include "utils.h"
+
+#define TUN_OFFLOADS (TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN)
 
 static const char clonedev[] = "/dev/net/tun";
 
+/* every packet is prepended by virtio_net_hdr, same for all queues */
+static bool g_vnet_hdr = false;
+
 bool is_tun_present(void)
 {
     return access(clonedev, F_OK) == 0;
 }
 
-int tun_alloc(char *dev_name, size_t dev_name_size)
+bool tun_has_offload(void)
+{
+    return true;
+}
+
+size_t tun_max_queues(void)
+{
+    return MAX_TUN_QUEUES;
+}
+
+/* empty dev_name creates new device, otherwise queue is attached to it */
+int tun_alloc(char *dev_name, size_t dev_name_size, bool multi_queue,
+        bool offload)
 {
     int fd;
     int err;
@@ -48,25 +71,108 @@ int tun_alloc(char *dev_name, size_t dev_name_size)
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
 
+    if (multi_queue) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+        strncpy(ifr.ifr_name, dev_name, sizeof(ifr.ifr_name) - 1);
+    }
+
+    if (offload) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+
     if ((err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0) {
         close(fd);
         perror("error create tun");
         return err;
     }
 
+    /* kernel hands over tso super packets with partial checksums */
+    if (offload && (err = ioctl(fd, TUNSETOFFLOAD, TUN_OFFLOADS)) < 0) {
+        close(fd);
+        perror("error set tun offload");
+        return err;
+    }
+
+    g_vnet_hdr = offload;
+
     memset(dev_name, 0, dev_name_size);
     strncpy(dev_name, ifr.ifr_name, dev_name_size - 1);
 
     return fd;
 }
 
-ssize_t tun_read_ip_packet(int fd, uint8_t *packet, size_t size)
+ssize_t tun_read_ip_packet(int fd, uint8_t *packet, size_t size,
+        tun_gso_t *gso)
 {
-    return read(fd, packet, size);
+    ssize_t nread;
+    struct virtio_net_hdr hdr;
+    struct iovec iv[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = packet, .iov_len = size },
+    };
+
+    if (gso) {
+        memset(gso, 0, sizeof(*gso));
+    }
+
+    if (!g_vnet_hdr) {
+        return read(fd, packet, size);
+    }
+
+    if ((nread = readv(fd, iv, ARRAY_SIZE(iv))) <= 0) {
+        return nread;
+    }
+
+    if (nread < (ssize_t) sizeof(hdr)) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (gso) {
+        gso->needs_csum = hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        gso->csum_start = hdr.csum_start;
+        gso->csum_offset = hdr.csum_offset;
+        gso->hdr_len = hdr.hdr_len;
+
+        if ((hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+                VIRTIO_NET_HDR_GSO_TCPV4) {
+            gso->gso_size = hdr.gso_size;
+        }
+    }
+
+    return nread - sizeof(hdr);
 }
 
-ssize_t tun_write_ip_packet(int fd, const uint8_t *packet, size_t size)
+ssize_t tun_write_ip_packet(int fd, const uint8_t *packet, size_t size,
+        const tun_gso_t *gso)
 {
-    return write(fd, packet, size);
+    ssize_t nwrite;
+    struct virtio_net_hdr hdr = { 0 };
+    struct iovec iv[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (uint8_t *) packet, .iov_len = size },
+    };
+
+    if (!g_vnet_hdr) {
+        return write(fd, packet, size);
+    }
+
+    if (gso && gso->needs_csum) {
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.csum_start = gso->csum_start;
+        hdr.csum_offset = gso->csum_offset;
+    }
+
+    if (gso && gso->gso_size) {
+        hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.gso_size = gso->gso_size;
+        hdr.hdr_len = gso->hdr_len;
+    }
+
+    if ((nwrite = writev(fd, iv, ARRAY_SIZE(iv))) < (ssize_t) sizeof(hdr)) {
+        return nwrite < 0 ? nwrite : 0;
+    }
+
+    return nwrite - sizeof(hdr);
 }
 
@@ -16,11 +16,36 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
 #include "utils.h"
 
 static simple_rt_config_t simple_rt_config = {
     .interface = "eth0",
     .nameserver = DEFAULT_NAMESERVER,
+    .network = DEFAULT_NETWORK,
+    .usb_transfers = DEFAULT_USB_TRANSFERS,
+    .flush_latency_us = DEFAULT_FLUSH_LATENCY_US,
+    .tx_queue_len = DEFAULT_TX_QUEUE_LEN,
+    .tun_queues = DEFAULT_TUN_QUEUES,
+    .shards = DEFAULT_SHARDS,
+    .pool_size_mb = DEFAULT_POOL_SIZE_MB,
+    .offload = false,
+    .switch_policy = SWITCH_POLICY_KERNEL,
+    .compress = false,
+    .metrics_path = NULL,
+    .mtu = DEFAULT_MTU,
+    .rate_limits_path = NULL,
+    .busy_poll_us = 0,
+    .cpu_list = NULL,
+    .dns_mode = DNS_MODE_OFF,
+    .ack_filter = false,
+    .link_timeout_ms = DEFAULT_LINK_TIMEOUT_MS,
+    .sessions_path = NULL,
 };
 
 simple_rt_config_t *get_simple_rt_config(void)
@@ -28,3 +53,56 @@ simple_rt_config_t *get_simple_rt_config(void)
     return &simple_rt_config;
 }
 
+
+bool pin_thread_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+/* first xhci or ehci controller, phones are rarely spread over several */
+char *get_usb_irq_cpu_list(char *buf, size_t size)
+{
+    FILE *f;
+    char line[4096], path[64];
+    unsigned int irq;
+    bool is_found = false;
+
+    if ((f = fopen("/proc/interrupts", "r")) == NULL) {
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, " %u:", &irq) == 1 &&
+                (strstr(line, "xhci") || strstr(line, "ehci"))) {
+            is_found = true;
+            break;
+        }
+    }
+
+    fclose(f);
+
+    if (!is_found) {
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "/proc/irq/%u/smp_affinity_list", irq);
+
+    if ((f = fopen(path, "r")) == NULL) {
+        return NULL;
+    }
+
+    if (fgets(buf, size, f) == NULL) {
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+
+    return buf;
+}
@@ -28,11 +28,24 @@
 #include <sys/file.h>
 
 #include "accessory.h"
+#include "adk.h"
+#include "dns.h"
+#include "framing.h"
+#include "metrics.h"
 #include "network.h"
+#include "packet.h"
+#include "ratelimit.h"
+#include "session.h"
+#include "shard.h"
+#include "switch.h"
+#include "trace.h"
 #include "utils.h"
 
 #define PID_FILE "/var/run/simple_rt.pid"
 
+/* same as libusb_handle_events() */
+#define MAIN_LOOP_TIMEOUT_US 60000000
+
 static int hotplug_callback(struct libusb_context *ctx,
         struct libusb_device *dev,
         libusb_hotplug_event event,
@@ -43,11 +56,30 @@ static int hotplug_callback(struct libusb_context *ctx,
         return 0;
     }
 
-    run_usb_probe_thread_detached(dev);
+    handle_usb_device_arrived(dev);
 
     return 0;
 }
 
+/* no hotplug, devices attached at startup still get their accessory */
+static void enumerate_usb_devices(void)
+{
+    ssize_t cnt;
+    struct libusb_device **list;
+
+    if ((cnt = libusb_get_device_list(NULL, &list)) < 0) {
+        fprintf(stderr, "Unable to list usb devices: %s\n",
+                libusb_strerror(cnt));
+        return;
+    }
+
+    for (ssize_t i = 0; i < cnt; i++) {
+        handle_usb_device_arrived(list[i]);
+    }
+
+    libusb_free_device_list(list, 1);
+}
+
 static bool is_instance_already_running(void)
 {
     int pid_file = open(PID_FILE, O_CREAT | O_RDWR, 0666);
@@ -63,6 +95,23 @@ static bool is_instance_already_running(void)
     return false;
 }
 
+static void print_packet_pool_stats(void)
+{
+    static const char *names[PACKET_CLASSES] = { "packet", "transfer" };
+    packet_pool_stats_t stats;
+
+    for (size_t i = 0; i < PACKET_CLASSES; i++) {
+        packet_pool_get_stats(i, &stats);
+
+        printf("%s pool: %zu x %zu bytes%s, peak %zu used, "
+                "%llu allocations failed\n", names[i],
+                stats.bufs_total, stats.buf_size,
+                stats.is_hugepage ? " (hugepages)" : "",
+                stats.bufs_peak,
+                (unsigned long long) stats.alloc_failed);
+    }
+}
+
 static volatile sig_atomic_t g_exit_flag = 0;
 
 static void exit_signal_handler(int signo)
@@ -71,25 +120,87 @@ static void exit_signal_handler(int signo)
     puts("");
 }
 
+static volatile sig_atomic_t g_dump_flag = 0;
+
+static void dump_signal_handler(int signo)
+{
+    g_dump_flag = 1;
+}
+
+static volatile sig_atomic_t g_reload_flag = 0;
+
+static void reload_signal_handler(int signo)
+{
+    g_reload_flag = 1;
+}
+
 int main(int argc, char *argv[])
 {
     int rc = 0;
     libusb_hotplug_callback_handle callback_handle;
+    struct timeval tv;
+    int64_t timeout_us, rate_timeout_us, sessions_timeout_us;
 
     simple_rt_config_t *config = get_simple_rt_config();
 
     libusb_init(NULL);
 
     signal(SIGINT, exit_signal_handler);
+    signal(SIGUSR1, dump_signal_handler);
+    signal(SIGHUP, reload_signal_handler);
 
-    while ((rc = getopt (argc, argv, "hdi:n:")) != -1) {
+    while ((rc = getopt (argc, argv, "hdi:n:a:x:l:q:T:S:P:Op:zm:M:r:B:C:D:Ak:s:")) != -1) {
         switch (rc) {
         case 'h':
-            printf("usage: sudo %s [-h] [-i interface] [-n nameserver|\"local\" ]\n"
-                    "default params: -i %s -n %s\n",
+            printf("usage: sudo %s [-h] [-i interface] [-n nameserver|\"local\" ]"
+                    " [-a network/prefix] [-x usb_transfers] [-l latency_us] [-q tx_queue_len]"
+                    " [-T tun_queues] [-S shards] [-P pool_mb] [-O]"
+                    " [-p kernel|switch|drop] [-z] [-m metrics_socket] [-M mtu]"
+                    " [-r rate_limits] [-B busy_poll_us] [-C cpu_list|irq]"
+                    " [-D cache|prefetch] [-A] [-k link_timeout_ms]"
+                    " [-s sessions_file]\n"
+                    "default params: -i %s -n %s -a %s -x %u -l %u -q %u -T %u -S %u"
+                    " -P %u -p %s -M %u -B %u -k %u\n"
+                    "  -a: accessory network, /16 to /30, host takes first address\n"
+                    "  -x: usb transfers in flight per direction, "
+                    "0 for synchronous io\n"
+                    "  -l: max time packet waits to be batched, "
+                    "0 disables framed transfers\n"
+                    "  -q: packets queued per accessory, "
+                    "rest are dropped\n"
+                    "  -T: tun queues, spread over shards\n"
+                    "  -S: data plane threads, accessories are spread over them\n"
+                    "  -P: memory cap of packet buffer pool, MB\n"
+                    "  -O: tcp segmentation offload on tun (linux only)\n"
+                    "  -p: traffic between accessories: routed by kernel,"
+                    " switched in place or dropped\n"
+                    "  -z: lz4 compression of framed transfers, if app supports it\n"
+                    "  -m: serve metrics in prometheus text format on unix socket\n"
+                    "  -M: tun mtu, up to %u, phones confirm it over framed transfers\n"
+                    "  -r: rate limits file, reloaded on SIGHUP, see README\n"
+                    "  -B: shards spin this long for packets before sleeping\n"
+                    "  -C: pin shards to cpus, e.g. 2,4-5, irq for usb controller ones\n"
+                    "  -D: phones ask host for names, answers are cached,"
+                    " prefetch refreshes popular ones\n"
+                    "  -A: drop tcp acks made useless by newer ones, both ways\n"
+                    "  -k: drop phone that stops answering keepalives, 0 disables"
+                    " them\n"
+                    "  -s: remember phone addresses across restarts in file\n",
                     argv[0],
                     config->interface,
-                    config->nameserver);
+                    config->nameserver,
+                    config->network,
+                    config->usb_transfers,
+                    config->flush_latency_us,
+                    config->tx_queue_len,
+                    config->tun_queues,
+                    config->shards,
+                    config->pool_size_mb,
+                    get_switch_policy_name(config->switch_policy),
+                    config->mtu,
+                    config->busy_poll_us,
+                    config->link_timeout_ms,
+                    MAX_MTU);
             return EXIT_SUCCESS;
         case 'd':
             puts("debug mode enabled");
@@ -105,6 +216,74 @@ int main(int argc, char *argv[])
                 config->nameserver = optarg;
             }
             break;
+        case 'a':
+            config->network = optarg;
+            break;
+        case 'x':
+            config->usb_transfers = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            config->flush_latency_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            config->tx_queue_len = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            config->tun_queues = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            config->shards = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            config->pool_size_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'O':
+            config->offload = true;
+            break;
+        case 'p':
+            if (!parse_switch_policy(optarg, &config->switch_policy)) {
+                fprintf(stderr, "Unknown switch policy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'z':
+            config->compress = true;
+            break;
+        case 'm':
+            config->metrics_path = optarg;
+            break;
+        case 'M':
+            config->mtu = strtoul(optarg, NULL, 10);
+            if (config->mtu < MIN_MTU || config->mtu > MAX_MTU) {
+                fprintf(stderr, "Mtu must be %u to %u\n", MIN_MTU, MAX_MTU);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            config->rate_limits_path = optarg;
+            break;
+        case 'B':
+            config->busy_poll_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'C':
+            config->cpu_list = optarg;
+            break;
+        case 'D':
+            if (!parse_dns_mode(optarg, &config->dns_mode) ||
+                    config->dns_mode == DNS_MODE_OFF) {
+                fprintf(stderr, "Unknown dns mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'A':
+            config->ack_filter = true;
+            break;
+        case 'k':
+            config->link_timeout_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config->sessions_path = optarg;
+            break;
         case '?':
         default:
             return EXIT_FAILURE;
@@ -121,30 +300,112 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (!setup_address_plan() || !init_accessory_table(get_network_size())) {
+        return EXIT_FAILURE;
+    }
+
+    /* without file addresses are still kept while running */
+    if (config->sessions_path && !start_sessions(config->sessions_path)) {
+        return EXIT_FAILURE;
+    }
+
+    if (config->rate_limits_path &&
+            !start_rate_limits(config->rate_limits_path)) {
+        return EXIT_FAILURE;
+    }
+
+    /* queued packets take mtu, usb batches and rx transfers whole buffer */
+    if (!packet_pool_init(config->mtu, FRAME_BATCH_SIZE,
+                (size_t) config->pool_size_mb << 20)) {
+        fprintf(stderr, "Unable to allocate packet pool!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!start_shards(config->shards)) {
+        fprintf(stderr, "Unable to start data plane!\n");
+        return EXIT_FAILURE;
+    }
+
     if (!start_network()) {
         fprintf(stderr, "Unable to start network!\n");
+        stop_shards();
         return EXIT_FAILURE;
     }
 
+    /* phones are given -n server then */
+    if (!start_dns()) {
+        fprintf(stderr, "Dns forwarder disabled\n");
+    }
+
+    /* no metrics is no reason to leave phones offline */
+    if (config->metrics_path && !start_metrics(config->metrics_path)) {
+        fprintf(stderr, "Unable to serve metrics on %s\n",
+                config->metrics_path);
+    }
+
     rc = libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
             LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
             LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
             hotplug_callback, NULL, &callback_handle);
 
+    /* attached devices are reported right away, see ENUMERATE */
     if (rc != LIBUSB_SUCCESS) {
-        fprintf(stderr, "Error creating a hotplug callback\n");
-        return EXIT_FAILURE;
+        fprintf(stderr, "Error creating a hotplug callback, "
+                "only devices attached now are used\n");
+        enumerate_usb_devices();
     }
 
     puts("SimpleRT started!");
 
+    /* main thread serves hotplug and handshakes, data plane runs in shards */
     while (!g_exit_flag) {
-        libusb_handle_events_completed(NULL, NULL);
+        timeout_us = handle_aoa_handshakes();
+        rate_timeout_us = handle_rate_limits();
+        if (rate_timeout_us >= 0 &&
+                (timeout_us < 0 || rate_timeout_us < timeout_us)) {
+            timeout_us = rate_timeout_us;
+        }
+        sessions_timeout_us = handle_sessions();
+        if (sessions_timeout_us >= 0 &&
+                (timeout_us < 0 || sessions_timeout_us < timeout_us)) {
+            timeout_us = sessions_timeout_us;
+        }
+        if (timeout_us < 0 || timeout_us > MAIN_LOOP_TIMEOUT_US) {
+            timeout_us = MAIN_LOOP_TIMEOUT_US;
+        }
+
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+        libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+
+        if (g_dump_flag) {
+            g_dump_flag = 0;
+            flight_dump("SIGUSR1");
+        }
+
+        handle_flight_dump();
+
+        if (g_reload_flag) {
+            g_reload_flag = 0;
+            reload_rate_limits();
+        }
     }
 
+    stop_aoa_handshakes();
+    stop_metrics();
+    stop_dns();
+    stop_accessories();
+    stop_shards();
     stop_network();
+    stop_rate_limits();
+    stop_sessions();
 
-    libusb_hotplug_deregister_callback(NULL, callback_handle);
+    print_switch_stats();
+    print_packet_pool_stats();
+
+    if (rc == LIBUSB_SUCCESS) {
+        libusb_hotplug_deregister_callback(NULL, callback_handle);
+    }
     libusb_exit(NULL);
 
     return EXIT_SUCCESS;
@@ -0,0 +1,557 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <stddef.h>
+
+#include "accessory.h"
+#include "dns.h"
+#include "metrics.h"
+#include "network.h"
+#include "packet.h"
+#include "qsbr.h"
+#include "utils.h"
+
+/* stop flag is checked that often */
+#define METRICS_POLL_MS 500
+
+/* client gets this long to send its request */
+#define METRICS_REQUEST_MS 100
+
+/* and this long to take every chunk of response */
+#define METRICS_SEND_MS 1000
+
+/* histograms are exported up to 2^25 us, rest goes to +Inf */
+#define METRICS_HIST_MAX_MSB 25
+
+/* class label of pool buffers, see packet.h */
+static const char *pool_class_names[PACKET_CLASSES] = { "packet", "transfer" };
+
+typedef struct acc_snapshot_t {
+    accessory_id_t id;
+    acc_metrics_t *m;
+    uint64_t tx_dropped;
+    size_t tx_queued;
+} acc_snapshot_t;
+
+typedef struct scrape_t {
+    FILE *out;
+    acc_snapshot_t *accs;
+    size_t cnt;
+    size_t size;
+} scrape_t;
+
+static struct {
+    int fd;
+    pthread_t thread;
+    volatile bool is_running;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+} g_metrics = { .fd = -1 };
+
+/* accessories which are gone, many writers */
+static acc_metrics_t g_retired;
+static atomic_uint_least64_t g_retired_tx_dropped;
+
+static void merge_hist(hist_t *dst, hist_t *src)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        atomic_fetch_add(&dst->buckets[i], counter_get(&src->buckets[i]));
+    }
+
+    atomic_fetch_add(&dst->sum, counter_get(&src->sum));
+    atomic_fetch_add(&dst->count, counter_get(&src->count));
+}
+
+void retire_accessory_metrics(acc_metrics_t *m, uint64_t tx_dropped)
+{
+    atomic_fetch_add(&g_retired.rx_packets, counter_get(&m->rx_packets));
+    atomic_fetch_add(&g_retired.rx_bytes, counter_get(&m->rx_bytes));
+    atomic_fetch_add(&g_retired.rx_errors, counter_get(&m->rx_errors));
+    atomic_fetch_add(&g_retired.tx_packets, counter_get(&m->tx_packets));
+    atomic_fetch_add(&g_retired.tx_bytes, counter_get(&m->tx_bytes));
+    atomic_fetch_add(&g_retired.tx_errors, counter_get(&m->tx_errors));
+    atomic_fetch_add(&g_retired.rx_rate_dropped,
+            counter_get(&m->rx_rate_dropped));
+    atomic_fetch_add(&g_retired.tx_rate_dropped,
+            counter_get(&m->tx_rate_dropped));
+    atomic_fetch_add(&g_retired.rx_ack_dropped,
+            counter_get(&m->rx_ack_dropped));
+    atomic_fetch_add(&g_retired_tx_dropped, tx_dropped);
+
+    merge_hist(&g_retired.usb_out_latency, &m->usb_out_latency);
+    merge_hist(&g_retired.tx_residence, &m->tx_residence);
+
+    atomic_fetch_add(&g_retired.aqm.codel_drops,
+            counter_get(&m->aqm.codel_drops));
+    atomic_fetch_add(&g_retired.aqm.ecn_marks, counter_get(&m->aqm.ecn_marks));
+    atomic_fetch_add(&g_retired.aqm.overlimit_drops,
+            counter_get(&m->aqm.overlimit_drops));
+    atomic_fetch_add(&g_retired.aqm.ack_drops, counter_get(&m->aqm.ack_drops));
+    merge_hist(&g_retired.aqm.sojourn, &m->aqm.sojourn);
+
+    atomic_fetch_add(&g_retired.link_pings, counter_get(&m->link_pings));
+    atomic_fetch_add(&g_retired.link_pongs, counter_get(&m->link_pongs));
+    atomic_fetch_add(&g_retired.link_timeouts, counter_get(&m->link_timeouts));
+    atomic_fetch_add(&g_retired.phone_tun_dropped,
+            counter_get(&m->phone_tun_dropped));
+    merge_hist(&g_retired.link_rtt, &m->link_rtt);
+}
+
+static void collect_accessory(void *arg, accessory_id_t id,
+        acc_metrics_t *m, uint64_t tx_dropped, size_t tx_queued)
+{
+    scrape_t *s = arg;
+    acc_snapshot_t *accs;
+
+    if (s->cnt == s->size) {
+        s->size = s->size ? s->size * 2 : 16;
+        if ((accs = realloc(s->accs, s->size * sizeof(*accs))) == NULL) {
+            return;
+        }
+        s->accs = accs;
+    }
+
+    s->accs[s->cnt++] = (acc_snapshot_t) { id, m, tx_dropped, tx_queued };
+}
+
+static void print_family(FILE *out, const char *name, const char *type,
+        const char *help)
+{
+    fprintf(out, "# HELP simplert_%s %s\n# TYPE simplert_%s %s\n",
+            name, help, name, type);
+}
+
+static void fill_acc_label(char *buf, size_t size, accessory_id_t id)
+{
+    char addr_str[INET_ADDRSTRLEN];
+    uint32_t addr = htonl(get_acc_addr(id));
+
+    inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+    snprintf(buf, size, "accessory=\"%s\"", addr_str);
+}
+
+/* counter of every accessory, then total including gone ones */
+static void print_counter(scrape_t *s, const char *name, const char *help,
+        size_t offset, counter_t *retired)
+{
+    char label[64];
+    uint64_t val, total = counter_get(retired);
+
+    print_family(s->out, name, "counter", help);
+
+    for (size_t i = 0; i < s->cnt; i++) {
+        val = counter_get((counter_t *) ((uint8_t *) s->accs[i].m + offset));
+        total += val;
+
+        fill_acc_label(label, sizeof(label), s->accs[i].id);
+        fprintf(s->out, "simplert_%s{%s} %llu\n", name, label,
+                (unsigned long long) val);
+    }
+
+    fprintf(s->out, "simplert_%s %llu\n", name, (unsigned long long) total);
+}
+
+static uint64_t hist_bucket_max(unsigned int idx)
+{
+    unsigned int msb = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    unsigned int sub = idx & ((1u << HIST_SUB_BITS) - 1);
+
+    if (idx < (1u << HIST_SUB_BITS)) {
+        return idx;
+    }
+
+    return ((uint64_t) ((1u << HIST_SUB_BITS) | sub) << (msb - HIST_SUB_BITS)) +
+        ((uint64_t) 1 << (msb - HIST_SUB_BITS)) - 1;
+}
+
+/* buckets are exported per power of two, le is inclusive */
+static void print_hist_samples(FILE *out, const char *name,
+        const char *label, hist_t **hists, size_t cnt)
+{
+    uint64_t cum = 0, sum = 0, count = 0;
+    unsigned int last = (METRICS_HIST_MAX_MSB - HIST_SUB_BITS + 2) <<
+        HIST_SUB_BITS;
+
+    for (unsigned int idx = 0; idx < last; idx++) {
+        for (size_t i = 0; i < cnt; i++) {
+            cum += counter_get(&hists[i]->buckets[idx]);
+        }
+
+        if ((idx & ((1u << HIST_SUB_BITS) - 1)) ==
+                (1u << HIST_SUB_BITS) - 1) {
+            fprintf(out, "simplert_%s_bucket{%s%sle=\"%llu\"} %llu\n", name,
+                    label, *label ? "," : "",
+                    (unsigned long long) hist_bucket_max(idx),
+                    (unsigned long long) cum);
+        }
+    }
+
+    for (size_t i = 0; i < cnt; i++) {
+        sum += counter_get(&hists[i]->sum);
+        count += counter_get(&hists[i]->count);
+    }
+
+    fprintf(out, "simplert_%s_bucket{%s%sle=\"+Inf\"} %llu\n"
+            "simplert_%s_sum%s%s%s %llu\nsimplert_%s_count%s%s%s %llu\n",
+            name, label, *label ? "," : "", (unsigned long long) count,
+            name, *label ? "{" : "", label, *label ? "}" : "",
+            (unsigned long long) sum,
+            name, *label ? "{" : "", label, *label ? "}" : "",
+            (unsigned long long) count);
+}
+
+static void print_hist(scrape_t *s, const char *name, const char *help,
+        size_t offset, hist_t *retired)
+{
+    char label[64];
+    hist_t *hists[s->cnt + 1];
+
+    print_family(s->out, name, "histogram", help);
+
+    for (size_t i = 0; i < s->cnt; i++) {
+        hists[i] = (hist_t *) ((uint8_t *) s->accs[i].m + offset);
+
+        fill_acc_label(label, sizeof(label), s->accs[i].id);
+        print_hist_samples(s->out, name, label, &hists[i], 1);
+    }
+
+    hists[s->cnt] = retired;
+    print_hist_samples(s->out, name, "", hists, s->cnt + 1);
+}
+
+static void print_dns_metrics(FILE *out)
+{
+    dns_stats_t dns;
+
+    get_dns_stats(&dns);
+
+#define DNS_COUNTER(field, name, help) \
+    print_family(out, "dns_" name "_total", "counter", help); \
+    fprintf(out, "simplert_dns_" name "_total %llu\n", \
+            (unsigned long long) dns.field)
+
+    DNS_COUNTER(queries, "queries", "Dns queries from accessories.");
+    DNS_COUNTER(hits, "cache_hits", "Dns queries answered from cache.");
+    DNS_COUNTER(misses, "cache_misses",
+            "Dns queries sent or joined upstream.");
+    DNS_COUNTER(coalesced, "coalesced",
+            "Dns misses joined query already in flight.");
+    DNS_COUNTER(prefetches, "prefetches",
+            "Cached dns answers refreshed before expiry.");
+    DNS_COUNTER(upstream_timeouts, "upstream_timeouts",
+            "Dns queries upstream didn't answer, servfail was sent.");
+
+#undef DNS_COUNTER
+
+    print_family(out, "dns_cache_entries", "gauge", "Dns cache slots in use.");
+    fprintf(out, "simplert_dns_cache_entries %llu\n",
+            (unsigned long long) dns.entries);
+}
+
+static void print_metrics(FILE *out)
+{
+    scrape_t s = { .out = out };
+    packet_pool_stats_t pool;
+    tun_stats_t tun;
+    char label[64];
+    uint64_t dropped = atomic_load(&g_retired_tx_dropped);
+
+    /* accessories stay alive until next quiescent state */
+    for_each_accessory(collect_accessory, &s);
+
+    print_family(out, "accessories", "gauge", "Accessories connected.");
+    fprintf(out, "simplert_accessories %zu\n", s.cnt);
+
+#define COUNTER(field, help) \
+    print_counter(&s, #field "_total", help, \
+            offsetof(acc_metrics_t, field), &g_retired.field)
+
+    COUNTER(rx_packets, "Packets from accessory to tun.");
+    COUNTER(rx_bytes, "Bytes from accessory to tun.");
+    COUNTER(rx_errors, "Failed usb reads and tun writes.");
+    COUNTER(tx_packets, "Packets from tun to accessory.");
+    COUNTER(tx_bytes, "Bytes from tun to accessory.");
+    COUNTER(tx_errors, "Failed usb writes.");
+    COUNTER(rx_rate_dropped, "Packets from accessory over rate limit.");
+    COUNTER(tx_rate_dropped, "Packets to accessory over rate limit.");
+    COUNTER(rx_ack_dropped,
+            "Tcp acks from accessory dropped, newer one was in transfer.");
+    COUNTER(link_pings, "Keepalive pings sent to accessory.");
+    COUNTER(link_pongs, "Keepalive pings accessory answered.");
+    COUNTER(link_timeouts, "Accessories dropped, nothing came for -k ms.");
+    COUNTER(phone_tun_dropped, "Packets phone tun refused, phone reports it.");
+
+#undef COUNTER
+
+#define AQM_COUNTER(field, help) \
+    print_counter(&s, "aqm_" #field "_total", help, \
+            offsetof(acc_metrics_t, aqm.field), &g_retired.aqm.field)
+
+    AQM_COUNTER(codel_drops, "Packets dropped by codel, queue stayed long.");
+    AQM_COUNTER(ecn_marks, "Packets marked ecn ce instead of codel drop.");
+    AQM_COUNTER(overlimit_drops,
+            "Packets dropped from fattest flow, flow queues were full.");
+    AQM_COUNTER(ack_drops,
+            "Tcp acks to accessory dropped, newer one was queued.");
+
+#undef AQM_COUNTER
+
+    print_family(out, "tx_dropped_total", "counter",
+            "Packets dropped, accessory tx queue was full.");
+    for (size_t i = 0; i < s.cnt; i++) {
+        dropped += s.accs[i].tx_dropped;
+        fill_acc_label(label, sizeof(label), s.accs[i].id);
+        fprintf(out, "simplert_tx_dropped_total{%s} %llu\n", label,
+                (unsigned long long) s.accs[i].tx_dropped);
+    }
+    fprintf(out, "simplert_tx_dropped_total %llu\n",
+            (unsigned long long) dropped);
+
+    print_family(out, "tx_queue_depth", "gauge",
+            "Packets waiting in accessory tx queue and flow queues.");
+    for (size_t i = 0; i < s.cnt; i++) {
+        fill_acc_label(label, sizeof(label), s.accs[i].id);
+        fprintf(out, "simplert_tx_queue_depth{%s} %zu\n", label,
+                s.accs[i].tx_queued);
+    }
+
+    print_hist(&s, "usb_out_latency_us",
+            "Out usb transfer latency, submit to completion.",
+            offsetof(acc_metrics_t, usb_out_latency),
+            &g_retired.usb_out_latency);
+    print_hist(&s, "tx_residence_us",
+            "Time from tun read until packet is handed to usb.",
+            offsetof(acc_metrics_t, tx_residence),
+            &g_retired.tx_residence);
+    print_hist(&s, "aqm_sojourn_us",
+            "Time from tun read until packet leaves flow queues.",
+            offsetof(acc_metrics_t, aqm.sojourn),
+            &g_retired.aqm.sojourn);
+
+    print_hist(&s, "link_rtt_us",
+            "Keepalive ping round trip, host to phone and back.",
+            offsetof(acc_metrics_t, link_rtt), &g_retired.link_rtt);
+
+    print_family(out, "link_srtt_us", "gauge",
+            "Smoothed keepalive round trip, 1/8 gain.");
+    for (size_t i = 0; i < s.cnt; i++) {
+        fill_acc_label(label, sizeof(label), s.accs[i].id);
+        fprintf(out, "simplert_link_srtt_us{%s} %llu\n", label,
+                (unsigned long long) counter_get(&s.accs[i].m->link_srtt_us));
+    }
+
+    get_tun_stats(&tun);
+    print_family(out, "tun_reads_total", "counter", "Tun read syscalls.");
+    fprintf(out, "simplert_tun_reads_total %llu\n",
+            (unsigned long long) tun.reads);
+    print_family(out, "tun_writes_total", "counter", "Tun write syscalls.");
+    fprintf(out, "simplert_tun_writes_total %llu\n",
+            (unsigned long long) tun.writes);
+    print_family(out, "tun_bytes_total", "counter", "Bytes through tun.");
+    fprintf(out, "simplert_tun_bytes_total %llu\n",
+            (unsigned long long) tun.bytes);
+
+    print_family(out, "pool_buffers", "gauge", "Packet pool buffers.");
+    for (size_t i = 0; i < PACKET_CLASSES; i++) {
+        packet_pool_get_stats(i, &pool);
+        fprintf(out, "simplert_pool_buffers{class=\"%s\"} %zu\n",
+                pool_class_names[i], pool.bufs_total);
+    }
+    print_family(out, "pool_buffers_used", "gauge",
+            "Packet pool buffers in use.");
+    for (size_t i = 0; i < PACKET_CLASSES; i++) {
+        packet_pool_get_stats(i, &pool);
+        fprintf(out, "simplert_pool_buffers_used{class=\"%s\"} %zu\n",
+                pool_class_names[i], pool.bufs_used);
+    }
+    print_family(out, "pool_alloc_failed_total", "counter",
+            "Packets dropped, pool was exhausted.");
+    for (size_t i = 0; i < PACKET_CLASSES; i++) {
+        packet_pool_get_stats(i, &pool);
+        fprintf(out, "simplert_pool_alloc_failed_total{class=\"%s\"} %llu\n",
+                pool_class_names[i], (unsigned long long) pool.alloc_failed);
+    }
+
+    if (is_dns_running()) {
+        print_dns_metrics(out);
+    }
+
+    free(s.accs);
+}
+
+static void serve_client(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timeval tv = { .tv_sec = METRICS_SEND_MS / 1000,
+        .tv_usec = METRICS_SEND_MS % 1000 * 1000 };
+    char req[1024];
+    char *buf = NULL;
+    size_t len = 0, off = 0;
+    ssize_t ret;
+    FILE *out;
+
+    /* request itself doesn't matter, but unread one would reset socket */
+    if (poll(&pfd, 1, METRICS_REQUEST_MS) > 0) {
+        if (recv(fd, req, sizeof(req), 0) < 0) {
+            close(fd);
+            return;
+        }
+    }
+
+    if ((out = open_memstream(&buf, &len)) == NULL) {
+        close(fd);
+        return;
+    }
+
+    fputs("HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Connection: close\r\n\r\n", out);
+
+    /* rendered in memory, slow client mustn't stall grace periods */
+    qsbr_online();
+    print_metrics(out);
+    qsbr_offline();
+
+    if (fclose(out) != 0) {
+        free(buf);
+        close(fd);
+        return;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while (off < len) {
+        if ((ret = send(fd, buf + off, len - off, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        off += ret;
+    }
+
+    free(buf);
+    close(fd);
+}
+
+static void *metrics_thread_proc(void *arg)
+{
+    struct pollfd pfd = { .fd = g_metrics.fd, .events = POLLIN };
+    int fd;
+
+    /* reads accessory table, holds no references between scrapes */
+    qsbr_register_thread();
+    qsbr_offline();
+
+    while (g_metrics.is_running) {
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) {
+            continue;
+        }
+
+        if ((fd = accept(g_metrics.fd, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                perror("metrics accept");
+            }
+            continue;
+        }
+
+        serve_client(fd);
+    }
+
+    qsbr_unregister_thread();
+
+    return NULL;
+}
+
+bool start_metrics(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    sigset_t sigs, old_sigs;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Metrics socket path is too long: %s\n", path);
+        return false;
+    }
+
+    strcpy(addr.sun_path, path);
+    strcpy(g_metrics.path, path);
+
+    /* left by previous run, single instance is enforced already */
+    unlink(path);
+
+    if ((g_metrics.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            bind(g_metrics.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(g_metrics.fd, 8) < 0) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", path,
+                strerror(errno));
+        goto error;
+    }
+
+    g_metrics.is_running = true;
+
+    /* signals are handled by main thread */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+
+    if (pthread_create(&g_metrics.thread, NULL,
+                metrics_thread_proc, NULL) != 0) {
+        pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+        fprintf(stderr, "Unable to start metrics thread\n");
+        g_metrics.is_running = false;
+        goto error;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+    printf("metrics available on %s\n", path);
+
+    return true;
+
+error:
+    if (g_metrics.fd >= 0) {
+        close(g_metrics.fd);
+        g_metrics.fd = -1;
+    }
+    unlink(path);
+    return false;
+}
+
+void stop_metrics(void)
+{
+    if (!g_metrics.is_running) {
+        return;
+    }
+
+    g_metrics.is_running = false;
+    pthread_join(g_metrics.thread, NULL);
+
+    close(g_metrics.fd);
+    g_metrics.fd = -1;
+    unlink(g_metrics.path);
+}
@@ -21,48 +21,70 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
-#include <pthread.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
 
+#include "netconf.h"
+#include "dns.h"
 #include "tun.h"
+#include "offload.h"
+#include "packet.h"
+#include "shard.h"
 #include "network.h"
+#include "trace.h"
 #include "utils.h"
 
 #ifndef IFNAMSIZ
 #define IFNAMSIZ 16
 #endif
 
-#define SIMPLERT_NETWORK_ADDRESS_BUILDER(a,b,c,d) ( \
-        (uint32_t) ((a) << 24) |                    \
-        (uint32_t) ((b) << 16) |                    \
-        (uint32_t) ((c) << 8)  |                    \
-        (uint32_t) ((d) << 0)                       \
-)
+/* accessory networks wider than /16 would need ids above 16 bits */
+#define MIN_NETWORK_PREFIX 16
+#define MAX_NETWORK_PREFIX 30
 
-#define SIMPLERT_NETWORK_ADDRESS \
-    SIMPLERT_NETWORK_ADDRESS_BUILDER(10,10,10,0)
+#define SIMPLERT_URI "https://github.com/vvviperrr/SimpleRT"
 
-#define NETWORK_ADDRESS(addr) \
-    ((addr) & 0xffffff00)
+/* tun queue, read by shard thread owning it */
+typedef struct tun_queue_t {
+    int fd;
+    shard_t *shard;
+    shard_io_t io;
+    packet_t *pkt;
+    uint8_t *gso_buf;
+} tun_queue_t;
 
-#define ACC_ID_FROM_ADDR(addr) \
-    ((addr) & 0xff)
+/* packets read at once, then other fds of shard get their turn */
+#define TUN_READ_BUDGET 64
 
-#ifndef IFACE_UP_SH_PATH
- #define IFACE_UP_SH_PATH "./iface_up.sh"
-#endif
+/* address plan, see setup_address_plan() */
+static uint32_t g_net_addr;
+static uint32_t g_net_mask;
+static unsigned int g_net_prefix;
+
+/* phone syns leaving through uplink get this mss, 0 if no need */
+static uint16_t g_uplink_mss;
 
 /* tun stuff */
-static int g_tun_fd = 0;
-static pthread_t g_tun_thread;
+static tun_queue_t g_tun[MAX_TUN_QUEUES];
+static size_t g_tun_queues = 0;
 static volatile bool g_tun_is_running = false;
 
+/* syscalls per transferred data, offload shrinks it */
+static struct {
+    atomic_uint_least64_t reads;
+    atomic_uint_least64_t writes;
+    atomic_uint_least64_t bytes;
+} g_tun_stats;
+
 static inline void dump_addr_info(uint32_t addr, size_t size)
 {
     uint32_t tmp = htonl(addr);
     printf("packet size = %zu, dest addr = %s, device id = %d\n", size,
             inet_ntoa(*(struct in_addr *) &tmp),
-            addr & 0xff);
+            addr & ~g_net_mask);
 }
 
 accessory_id_t get_acc_id_from_packet(const uint8_t *data, size_t size, bool dst_addr)
@@ -82,85 +104,329 @@ accessory_id_t get_acc_id_from_packet(const uint8_t *data, size_t size, bool dst
         (uint32_t) (data[addr_offset + 2] << 8)  |
         (uint32_t) (data[addr_offset + 3] << 0);
 
-    if (NETWORK_ADDRESS(addr) == SIMPLERT_NETWORK_ADDRESS) {
+    if ((addr & g_net_mask) == g_net_addr) {
         /* dump_addr_info(addr, size); */
-        return ACC_ID_FROM_ADDR(addr);
+        return addr & ~g_net_mask;
     }
 
 end:
     return 0;
 }
 
-static void *tun_thread_proc(void *arg)
+/* finished packet or segments of super packet go to accessory one by one */
+static void send_gso_packet(uint8_t *data, size_t size,
+        const tun_gso_t *gso, accessory_id_t id)
+{
+    gso_iter_t it;
+    packet_t *pkt;
+    uint64_t ts = get_time_us();
+
+    if (!gso->gso_size) {
+        if (size > packet_buf_size() || !finish_packet_csum(data, size, gso) ||
+                (pkt = packet_alloc()) == NULL) {
+            return;
+        }
+
+        memcpy(pkt->data, data, size);
+        pkt->len = size;
+        pkt->ts = ts;
+        send_accessory_packet(pkt, id);
+        return;
+    }
+
+    if (!gso_iter_init(&it, data, size, gso)) {
+        return;
+    }
+
+    /* rest of segments is dropped if pool is exhausted */
+    while ((pkt = packet_alloc()) != NULL) {
+        if ((pkt->len = gso_next_segment(&it, pkt->data,
+                        packet_buf_size())) == 0) {
+            packet_free(pkt);
+            break;
+        }
+
+        pkt->ts = ts;
+        send_accessory_packet(pkt, id);
+    }
+}
+
+/* returns size of packet passed to accessory or dropped, 0 or -1 if none */
+static ssize_t read_tun_queue(tun_queue_t *q)
 {
     ssize_t nread;
-    uint8_t acc_buf[ACC_BUF_SIZE];
+    tun_gso_t gso;
+    uint8_t drop_buf[MAX_MTU];
     accessory_id_t id = 0;
 
-    g_tun_is_running = true;
+    /* offload: one read per tso super packet instead of per segment */
+    if (q->gso_buf) {
+        if ((nread = tun_read_ip_packet(q->fd, q->gso_buf,
+                        TUN_GSO_MAX_SIZE, &gso)) > 0 &&
+                (id = get_acc_id_from_packet(q->gso_buf, nread, true)) != 0) {
+            trace_packet(tun_read, id, nread);
+            send_gso_packet(q->gso_buf, nread, &gso, id);
+        }
+
+        return nread;
+    }
+
+    if (!q->pkt && (q->pkt = packet_alloc()) == NULL) {
+        /* pool exhausted, keep tun drained and drop */
+        return tun_read_ip_packet(q->fd, drop_buf, sizeof(drop_buf), NULL);
+    }
+
+    if ((nread = tun_read_ip_packet(q->fd, q->pkt->data,
+                    packet_buf_size(), NULL)) <= 0) {
+        return nread;
+    }
+
+    if ((id = get_acc_id_from_packet(q->pkt->data, nread, true)) != 0) {
+        /* accessory takes ownership */
+        trace_packet(tun_read, id, nread);
+        q->pkt->len = nread;
+        q->pkt->ts = get_time_us();
+        send_accessory_packet(q->pkt, id);
+        q->pkt = NULL;
+    } else {
+        /* invalid packet received, ignore */
+    }
+
+    return nread;
+}
+
+static void handle_tun_queue(void *arg)
+{
+    tun_queue_t *q = arg;
+    ssize_t nread;
+
+    for (int i = 0; i < TUN_READ_BUDGET; i++) {
+        if ((nread = read_tun_queue(q)) > 0) {
+            atomic_fetch_add(&g_tun_stats.reads, 1);
+            atomic_fetch_add(&g_tun_stats.bytes, nread);
+            continue;
+        }
+
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR)) {
+            return;
+        }
 
-    while (g_tun_is_running) {
-        if ((nread = tun_read_ip_packet(g_tun_fd, acc_buf, sizeof(acc_buf))) > 0) {
-            if ((id = get_acc_id_from_packet(acc_buf, nread, true)) != 0) {
-                send_accessory_packet(acc_buf, nread, id);
-            } else {
-                /* invalid packet received, ignore */
-            }
-        } else if (nread < 0) {
+        if (nread < 0) {
             fprintf(stderr, "Error reading from tun: %s\n", strerror(errno));
-            break;
         } else {
             /* EOF received */
-            break;
         }
+
+        shard_del_io(q->shard, q->fd);
+        return;
     }
+}
+
+void get_tun_stats(tun_stats_t *stats)
+{
+    stats->reads = atomic_load(&g_tun_stats.reads);
+    stats->writes = atomic_load(&g_tun_stats.writes);
+    stats->bytes = atomic_load(&g_tun_stats.bytes);
+}
+
+static void print_tun_stats(void)
+{
+    uint64_t calls = atomic_load(&g_tun_stats.reads) +
+        atomic_load(&g_tun_stats.writes);
+    uint64_t bytes = atomic_load(&g_tun_stats.bytes);
 
-    g_tun_is_running = false;
+    if (!bytes) {
+        return;
+    }
 
-    return NULL;
+    printf("tun: %llu reads, %llu writes, %.1f syscalls per MB\n",
+            (unsigned long long) atomic_load(&g_tun_stats.reads),
+            (unsigned long long) atomic_load(&g_tun_stats.writes),
+            calls / ((double) bytes / (1 << 20)));
 }
 
-/* FIXME */
 static bool iface_up(const char *dev)
 {
-    char cmd[1024] = { 0 };
-    char net_addr_str[32] = { 0 };
-    char host_addr_str[32] = { 0 };
+    simple_rt_config_t *config = get_simple_rt_config();
+    uint64_t start = get_time_us();
+    bool ret;
+
+    netconf_t conf = {
+        .dev = dev,
+        .net_addr = g_net_addr,
+        .host_addr = g_net_addr | 0x1,
+        .prefix = g_net_prefix,
+        .nameserver = config->nameserver,
+        .out_iface = config->interface,
+        .mtu = config->mtu,
+    };
+
+    ret = netconf_up(&conf);
+    printf("network setup took %.1f ms\n", (get_time_us() - start) / 1000.0);
+
+    return ret;
+}
+
+static bool iface_down(void)
+{
+    uint64_t start = get_time_us();
+    bool ret;
+
+    ret = netconf_down();
+    printf("network teardown took %.1f ms\n",
+            (get_time_us() - start) / 1000.0);
+
+    return ret;
+}
 
+static void close_tun_queues(void)
+{
+    for (size_t i = 0; i < g_tun_queues; i++) {
+        close(g_tun[i].fd);
+        packet_free(g_tun[i].pkt);
+        free(g_tun[i].gso_buf);
+    }
+
+    memset(g_tun, 0, sizeof(g_tun));
+    g_tun_queues = 0;
+}
+
+bool setup_address_plan(void)
+{
+    char addr_str[32] = { 0 };
+    char *prefix_str;
+    struct in_addr addr;
+    unsigned long prefix;
     simple_rt_config_t *config = get_simple_rt_config();
 
-    uint32_t net_addr = htonl(SIMPLERT_NETWORK_ADDRESS);
-    uint32_t host_addr = htonl(SIMPLERT_NETWORK_ADDRESS | 0x1);
-    uint32_t mask = __builtin_popcount(NETWORK_ADDRESS(-1));
+    snprintf(addr_str, sizeof(addr_str), "%s", config->network);
 
-    snprintf(net_addr_str, sizeof(net_addr_str), "%s",
-            inet_ntoa(*(struct in_addr *) &net_addr));
+    if ((prefix_str = strchr(addr_str, '/')) == NULL) {
+        fprintf(stderr, "Network must be given as addr/prefix: %s\n",
+                config->network);
+        return false;
+    }
 
-    snprintf(host_addr_str, sizeof(host_addr_str), "%s",
-            inet_ntoa(*(struct in_addr *) &host_addr));
+    *prefix_str++ = '\0';
+    prefix = strtoul(prefix_str, NULL, 10);
 
-    snprintf(cmd, sizeof(cmd), "%s %s start %s %s %s %u %s %s\n",
-            IFACE_UP_SH_PATH, PLATFORM, dev, net_addr_str, host_addr_str, mask,
-            config->nameserver,
-            config->interface);
+    if (inet_pton(AF_INET, addr_str, &addr) != 1) {
+        fprintf(stderr, "Invalid network address: %s\n", addr_str);
+        return false;
+    }
+
+    if (prefix < MIN_NETWORK_PREFIX || prefix > MAX_NETWORK_PREFIX) {
+        fprintf(stderr, "Network prefix must be /%d to /%d\n",
+                MIN_NETWORK_PREFIX, MAX_NETWORK_PREFIX);
+        return false;
+    }
 
-    return system(cmd) == 0;
+    g_net_prefix = prefix;
+    g_net_mask = (uint32_t) (0xffffffffu << (32 - prefix));
+    g_net_addr = ntohl(addr.s_addr) & g_net_mask;
+
+    if (g_net_addr != ntohl(addr.s_addr)) {
+        fprintf(stderr, "Host bits of network %s are ignored\n",
+                config->network);
+    }
+
+    return true;
 }
 
-static bool iface_down(void)
+uint32_t get_acc_addr(accessory_id_t id)
+{
+    return g_net_addr | id;
+}
+
+/* addresses in network, accessory id is host part of address */
+size_t get_network_size(void)
+{
+    return (size_t) ~g_net_mask + 1;
+}
+
+/* host part of address in accessory network, 0 if it's not a phone */
+accessory_id_t parse_acc_addr(const char *str)
+{
+    struct in_addr addr;
+    uint32_t id;
+
+    if (inet_pton(AF_INET, str, &addr) != 1) {
+        return 0;
+    }
+
+    id = ntohl(addr.s_addr) - get_acc_addr(0);
+
+    /* host takes first address */
+    return id > 1 && id < get_network_size() - 1 ? id : 0;
+}
+
+static unsigned int get_iface_mtu(const char *name)
 {
-    char cmd[1024] = { 0 };
+    struct ifreq ifr = { 0 };
+    int fd;
+    unsigned int mtu = 0;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return 0;
+    }
+
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+    if (ioctl(fd, SIOCGIFMTU, &ifr) == 0) {
+        mtu = ifr.ifr_mtu;
+    }
 
-    snprintf(cmd, sizeof(cmd), "%s %s stop",
-            IFACE_UP_SH_PATH, PLATFORM);
+    close(fd);
 
-    return system(cmd) == 0;
+    return mtu;
+}
+
+/* tcp and ip headers without options */
+#define TCP4_HDR_SIZE 40
+
+/* jumbo mtu ends at uplink, phones learn it from mss of own syns */
+static void setup_uplink_mss(void)
+{
+    simple_rt_config_t *config = get_simple_rt_config();
+    unsigned int uplink_mtu = get_iface_mtu(config->interface);
+
+    if (!uplink_mtu) {
+        uplink_mtu = DEFAULT_MTU;
+    }
+
+    if (config->mtu > uplink_mtu) {
+        g_uplink_mss = uplink_mtu - TCP4_HDR_SIZE;
+        printf("mtu %u, mss toward %s clamped to %u\n", config->mtu,
+                config->interface, g_uplink_mss);
+    }
+}
+
+void clamp_uplink_mss(uint8_t *data, size_t size)
+{
+    /* host and peers are reached over tun, no clamping for them */
+    if (g_uplink_mss && get_acc_id_from_packet(data, size, true) == 0) {
+        clamp_tcp_mss(data, size, g_uplink_mss);
+    }
+}
+
+void send_frag_needed(const uint8_t *data, size_t size, uint16_t mtu,
+        accessory_id_t id)
+{
+    uint8_t buf[128];
+    size_t len;
+
+    if ((len = build_icmp_frag_needed(buf, sizeof(buf), data, size,
+                    g_net_addr | 0x1, mtu)) != 0) {
+        send_network_packet(buf, len, NULL, id);
+    }
 }
 
 bool start_network(void)
 {
     int tun_fd = 0;
     char tun_name[IFNAMSIZ] = { 0 };
+    simple_rt_config_t *config = get_simple_rt_config();
+    size_t queues = config->tun_queues;
 
     if (g_tun_is_running) {
         fprintf(stderr, "Network already started!\n");
@@ -174,63 +440,141 @@ bool start_network(void)
         return false;
     }
 
-    if ((tun_fd = tun_alloc(tun_name, sizeof(tun_name))) < 0) {
-        perror("tun_alloc failed");
-        return false;
+    if (!queues) {
+        queues = 1;
+    }
+
+    if (config->offload && !tun_has_offload()) {
+        fprintf(stderr, "Tun offload is not supported, disabled\n");
+        config->offload = false;
+    }
+
+    if (queues > tun_max_queues()) {
+        fprintf(stderr, "Only %zu tun queues supported\n", tun_max_queues());
+        queues = tun_max_queues();
+    }
+
+    /* first queue creates device, rest attach to it by name */
+    for (size_t i = 0; i < queues; i++) {
+        if ((tun_fd = tun_alloc(tun_name, sizeof(tun_name),
+                        queues > 1, config->offload)) < 0) {
+            perror("tun_alloc failed");
+            close_tun_queues();
+            return false;
+        }
+
+        g_tun[g_tun_queues++].fd = tun_fd;
     }
 
     if (!iface_up(tun_name)) {
         fprintf(stderr, "Unable to set interface %s up\n", tun_name);
-        close(tun_fd);
+        close_tun_queues();
         return false;
     }
 
-    g_tun_fd = tun_fd;
-    printf("%s interface configured!\n", tun_name);
+    printf("%s interface configured, %zu queue(s)%s!\n", tun_name,
+            g_tun_queues, config->offload ? ", offload on" : "");
+
+    setup_uplink_mss();
+
+    /* queues are spread over shards, read when ready */
+    for (size_t i = 0; i < g_tun_queues; i++) {
+        tun_queue_t *q = &g_tun[i];
+
+        q->shard = get_shard(i);
+        q->io.handle = handle_tun_queue;
+        q->io.arg = q;
+
+        if (config->offload &&
+                (q->gso_buf = malloc(TUN_GSO_MAX_SIZE)) == NULL) {
+            fprintf(stderr, "Unable to allocate tun buffer\n");
+            goto error;
+        }
+
+        if (fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL) | O_NONBLOCK) < 0 ||
+                !shard_add_io(q->shard, q->fd, &q->io)) {
+            perror("Unable to watch tun queue");
+            goto error;
+        }
+    }
 
-    pthread_create(&g_tun_thread, NULL, tun_thread_proc, NULL);
+    g_tun_is_running = true;
 
     return true;
+
+error:
+    iface_down();
+    close_tun_queues();
+    return false;
 }
 
 void stop_network(void)
 {
+    /* shards are stopped already, nobody reads queues */
     if (g_tun_is_running) {
         puts("stopping network");
         g_tun_is_running = false;
-        pthread_cancel(g_tun_thread);
-        pthread_join(g_tun_thread, NULL);
+
         iface_down();
+        print_tun_stats();
     }
 
-    if (g_tun_fd) {
-        close(g_tun_fd);
-        g_tun_fd = 0;
-    }
+    close_tun_queues();
 }
 
-ssize_t send_network_packet(const uint8_t *data, size_t size)
+/*
+ * accessory always writes into the same queue, kernel steers replies
+ * of its flows back to that queue, so flows are never reordered
+ */
+ssize_t send_network_packet(const uint8_t *data, size_t size,
+        const tun_gso_t *gso, accessory_id_t id)
 {
     ssize_t nwrite;
 
-    nwrite = tun_write_ip_packet(g_tun_fd, data, size);
+    nwrite = tun_write_ip_packet(g_tun[id % g_tun_queues].fd,
+            data, size, gso);
     if (nwrite < 0) {
+        trace_packet(tun_error, id, errno);
         fprintf(stderr, "Error writing into tun: %s\n",
                 strerror(errno));
+        flight_dump_later("tun write failed");
         return -1;
     }
 
+    trace_packet(tun_write, id, nwrite);
+
+    atomic_fetch_add(&g_tun_stats.writes, 1);
+    atomic_fetch_add(&g_tun_stats.bytes, nwrite);
+
     return nwrite;
 }
 
 char *fill_serial_param(char *buf, size_t size, accessory_id_t id)
 {
     simple_rt_config_t *config = get_simple_rt_config();
-    uint32_t addr = htonl(SIMPLERT_NETWORK_ADDRESS | id);
+    uint32_t addr = htonl(g_net_addr | id);
+    uint32_t host_addr = htonl(get_acc_addr(1));
+    char addr_str[INET_ADDRSTRLEN];
+
+    /* inet_ntoa buffer is static, can't take two addresses at once */
+    inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+    snprintf(buf, size, "%s,%s", addr_str,
+            is_dns_running() ?
+            inet_ntoa(*(struct in_addr *) &host_addr) : config->nameserver);
+
+    return buf;
+}
+
+/* host options, old android apps ignore uri query */
+char *fill_uri_param(char *buf, size_t size)
+{
+    simple_rt_config_t *config = get_simple_rt_config();
 
-    snprintf(buf, size, "%s,%s",
-            inet_ntoa(*(struct in_addr *) &addr),
-            config->nameserver);
+    snprintf(buf, size, "%s?frame=%d&prefix=%u&lz4=%d&mtu=%u&ctrl=%d",
+            SIMPLERT_URI, config->flush_latency_us != 0, g_net_prefix,
+            config->flush_latency_us != 0 && config->compress,
+            config->mtu,
+            config->flush_latency_us != 0 && config->link_timeout_ms != 0);
 
     return buf;
 }
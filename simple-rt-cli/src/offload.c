@@ -0,0 +1,504 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "offload.h"
+#include "utils.h"
+
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < size; i += 2) {
+        sum += get_be16(data + i);
+    }
+
+    if (size & 1) {
+        sum += data[size - 1] << 8;
+    }
+
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return sum;
+}
+
+static uint32_t pseudo_hdr_sum(const uint8_t *ip, uint8_t proto, size_t l4_len)
+{
+    /* src and dst addr are adjacent */
+    return csum_add(0, ip + 12, 8) + proto + (uint32_t) l4_len;
+}
+
+static void update_ip_csum(uint8_t *ip)
+{
+    size_t ihl = (ip[0] & 0xf) * 4;
+
+    put_be16(ip + 10, 0);
+    put_be16(ip + 10, ~csum_fold(csum_add(0, ip, ihl)));
+}
+
+/* ipv4 tcp packet, returns ip + tcp header len or 0 */
+static size_t get_tcp4_hdr_len(const uint8_t *pkt, size_t size)
+{
+    size_t ihl, doff;
+
+    if (size < 20 || (pkt[0] >> 4) != 4 || pkt[9] != IP_PROTO_TCP) {
+        return 0;
+    }
+
+    ihl = (pkt[0] & 0xf) * 4;
+
+    /* fragments are not touched */
+    if (ihl < 20 || (get_be16(pkt + 6) & 0x3fff) || size < ihl + 20) {
+        return 0;
+    }
+
+    doff = (pkt[ihl + 12] >> 4) * 4;
+
+    if (doff < 20 || size < ihl + doff) {
+        return 0;
+    }
+
+    return ihl + doff;
+}
+
+bool finish_packet_csum(uint8_t *pkt, size_t size, const tun_gso_t *gso)
+{
+    uint16_t csum;
+    size_t off = gso->csum_start + gso->csum_offset;
+
+    if (!gso->needs_csum) {
+        return true;
+    }
+
+    if (gso->csum_start >= size || off + 2 > size) {
+        return false;
+    }
+
+    /* checksum field already holds pseudo header sum */
+    csum = ~csum_fold(csum_add(0, pkt + gso->csum_start,
+                size - gso->csum_start));
+
+    if (!csum && pkt[9] == IP_PROTO_UDP) {
+        csum = 0xffff;
+    }
+
+    put_be16(pkt + off, csum);
+
+    return true;
+}
+
+bool gso_iter_init(gso_iter_t *it, const uint8_t *pkt, size_t size,
+        const tun_gso_t *gso)
+{
+    size_t ihl;
+
+    memset(it, 0, sizeof(*it));
+
+    if (!gso->gso_size || (it->hdr_len = get_tcp4_hdr_len(pkt, size)) == 0) {
+        return false;
+    }
+
+    ihl = (pkt[0] & 0xf) * 4;
+
+    it->pkt = pkt;
+    it->size = size;
+    it->off = it->hdr_len;
+    it->gso_size = gso->gso_size;
+    it->ip_id = get_be16(pkt + 4);
+    it->seq = get_be32(pkt + ihl + 4);
+
+    return true;
+}
+
+size_t gso_next_segment(gso_iter_t *it, uint8_t *out, size_t out_size)
+{
+    uint8_t *tcp;
+    uint32_t sum;
+    size_t ihl, payload, seg_len;
+
+    if (!it->pkt || it->off >= it->size) {
+        return 0;
+    }
+
+    ihl = (it->pkt[0] & 0xf) * 4;
+    payload = it->size - it->off;
+
+    if (payload > it->gso_size) {
+        payload = it->gso_size;
+    }
+
+    if ((seg_len = it->hdr_len + payload) > out_size) {
+        return 0;
+    }
+
+    memcpy(out, it->pkt, it->hdr_len);
+    memcpy(out + it->hdr_len, it->pkt + it->off, payload);
+
+    put_be16(out + 2, seg_len);
+    put_be16(out + 4, it->ip_id + it->segs);
+    update_ip_csum(out);
+
+    tcp = out + ihl;
+    put_be32(tcp + 4, it->seq + (it->off - it->hdr_len));
+
+    /* fin and psh belong to the last segment, cwr to the first one */
+    if (it->off + payload < it->size) {
+        tcp[13] &= ~(TCP_FIN | TCP_PSH);
+    }
+
+    if (it->segs) {
+        tcp[13] &= ~TCP_CWR;
+    }
+
+    put_be16(tcp + 16, 0);
+    sum = pseudo_hdr_sum(out, IP_PROTO_TCP, seg_len - ihl);
+    put_be16(tcp + 16, ~csum_fold(csum_add(sum, tcp, seg_len - ihl)));
+
+    it->off += payload;
+    it->segs++;
+
+    return seg_len;
+}
+
+bool gro_init(gro_t *gro, gro_write_cb write, void *arg)
+{
+    memset(gro, 0, sizeof(*gro));
+
+    gro->write = write;
+    gro->arg = arg;
+
+    for (size_t i = 0; i < GRO_MAX_FLOWS; i++) {
+        if ((gro->flows[i].buf = malloc(TUN_GSO_MAX_SIZE)) == NULL) {
+            gro_destroy(gro);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void gro_destroy(gro_t *gro)
+{
+    for (size_t i = 0; i < GRO_MAX_FLOWS; i++) {
+        free(gro->flows[i].buf);
+        gro->flows[i].buf = NULL;
+    }
+}
+
+static int gro_flush_flow(gro_t *gro, gro_flow_t *flow)
+{
+    uint8_t *ip = flow->buf;
+    size_t ihl = (ip[0] & 0xf) * 4;
+    size_t len = flow->len;
+    tun_gso_t gso = { 0 };
+
+    if (!len) {
+        return 0;
+    }
+
+    flow->len = 0;
+    gro->writes++;
+
+    /* single segment goes as is, with checksums of the peer */
+    if (flow->segs == 1) {
+        return gro->write(gro->arg, ip, len, NULL) < 0 ? -1 : 0;
+    }
+
+    gro->merged += flow->segs - 1;
+
+    put_be16(ip + 2, len);
+    update_ip_csum(ip);
+
+    /* partial checksum, kernel completes it for every segment */
+    put_be16(ip + ihl + 16, csum_fold(pseudo_hdr_sum(ip,
+                    IP_PROTO_TCP, len - ihl)));
+
+    gso.needs_csum = true;
+    gso.csum_start = ihl;
+    gso.csum_offset = 16;
+    gso.gso_size = flow->gso_size;
+    gso.hdr_len = flow->hdr_len;
+
+    return gro->write(gro->arg, ip, len, &gso) < 0 ? -1 : 0;
+}
+
+/* same addresses and ports */
+static bool is_same_flow(const uint8_t *a, const uint8_t *b)
+{
+    size_t a_ihl = (a[0] & 0xf) * 4;
+    size_t b_ihl = (b[0] & 0xf) * 4;
+
+    return !memcmp(a + 12, b + 12, 8) && !memcmp(a + a_ihl, b + b_ihl, 4);
+}
+
+static bool can_merge(const gro_flow_t *flow, const uint8_t *pkt,
+        size_t size, size_t hdr_len)
+{
+    const uint8_t *ip = flow->buf;
+    size_t ihl = (pkt[0] & 0xf) * 4;
+    size_t payload = size - hdr_len;
+
+    if (flow->is_closed || hdr_len != flow->hdr_len ||
+            payload > flow->gso_size ||
+            flow->len + payload > TUN_GSO_MAX_SIZE) {
+        return false;
+    }
+
+    /* tos, flags, ttl and ip options must match */
+    if (ip[0] != pkt[0] || ip[1] != pkt[1] ||
+            get_be16(ip + 6) != get_be16(pkt + 6) || ip[8] != pkt[8] ||
+            memcmp(ip + 20, pkt + 20, ihl - 20)) {
+        return false;
+    }
+
+    /* in order, same ack and tcp options */
+    return get_be32(pkt + ihl + 4) == flow->next_seq &&
+        !memcmp(ip + ihl + 8, pkt + ihl + 8, 4) &&
+        !memcmp(ip + ihl + 20, pkt + ihl + 20, hdr_len - ihl - 20);
+}
+
+static void start_flow(gro_flow_t *flow, const uint8_t *pkt, size_t size,
+        size_t hdr_len)
+{
+    size_t ihl = (pkt[0] & 0xf) * 4;
+
+    memcpy(flow->buf, pkt, size);
+
+    flow->len = size;
+    flow->hdr_len = hdr_len;
+    flow->segs = 1;
+    flow->gso_size = size - hdr_len;
+    flow->next_seq = get_be32(pkt + ihl + 4) + flow->gso_size;
+    flow->is_closed = pkt[ihl + 13] & TCP_PSH;
+}
+
+static void merge_flow(gro_flow_t *flow, const uint8_t *pkt, size_t size,
+        size_t hdr_len)
+{
+    size_t ihl = (pkt[0] & 0xf) * 4;
+    size_t payload = size - hdr_len;
+    uint8_t *tcp = flow->buf + ihl;
+
+    memcpy(flow->buf + flow->len, pkt + hdr_len, payload);
+
+    /* latest window and push flag win */
+    memcpy(tcp + 14, pkt + ihl + 14, 2);
+    tcp[13] |= pkt[ihl + 13] & TCP_PSH;
+
+    flow->len += payload;
+    flow->segs++;
+    flow->next_seq += payload;
+    flow->is_closed = payload < flow->gso_size || (tcp[13] & TCP_PSH);
+}
+
+int gro_write_packet(gro_t *gro, const uint8_t *data, size_t size)
+{
+    gro_flow_t *flow = NULL;
+    size_t hdr_len, ihl;
+    uint8_t flags;
+    bool is_candidate;
+
+    if ((hdr_len = get_tcp4_hdr_len(data, size)) == 0) {
+        gro->writes++;
+        return gro->write(gro->arg, data, size, NULL) < 0 ? -1 : 0;
+    }
+
+    ihl = (data[0] & 0xf) * 4;
+    flags = data[ihl + 13];
+
+    /* plain data segments only, anything else ends the flow */
+    is_candidate = get_be16(data + 2) == size && size > hdr_len &&
+        (flags & ~TCP_PSH) == TCP_ACK;
+
+    for (size_t i = 0; i < GRO_MAX_FLOWS; i++) {
+        if (gro->flows[i].len && is_same_flow(gro->flows[i].buf, data)) {
+            flow = &gro->flows[i];
+            break;
+        }
+    }
+
+    if (flow && is_candidate && can_merge(flow, data, size, hdr_len)) {
+        merge_flow(flow, data, size, hdr_len);
+        return 0;
+    }
+
+    /* keep order within flow */
+    if (flow && gro_flush_flow(gro, flow) < 0) {
+        return -1;
+    }
+
+    if (!is_candidate) {
+        gro->writes++;
+        return gro->write(gro->arg, data, size, NULL) < 0 ? -1 : 0;
+    }
+
+    for (size_t i = 0; !flow && i < GRO_MAX_FLOWS; i++) {
+        if (!gro->flows[i].len) {
+            flow = &gro->flows[i];
+        }
+    }
+
+    if (!flow) {
+        flow = &gro->flows[gro->evict++ % GRO_MAX_FLOWS];
+
+        if (gro_flush_flow(gro, flow) < 0) {
+            return -1;
+        }
+    }
+
+    start_flow(flow, data, size, hdr_len);
+
+    return 0;
+}
+
+int gro_flush(gro_t *gro)
+{
+    int ret = 0;
+
+    for (size_t i = 0; i < GRO_MAX_FLOWS; i++) {
+        if (gro_flush_flow(gro, &gro->flows[i]) < 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+bool clamp_tcp_mss(uint8_t *pkt, size_t size, uint16_t mss)
+{
+    size_t ihl, hdr_len, off;
+    uint16_t old;
+    uint32_t sum;
+
+    if ((hdr_len = get_tcp4_hdr_len(pkt, size)) == 0) {
+        return false;
+    }
+
+    ihl = (pkt[0] & 0xf) * 4;
+
+    if (!(pkt[ihl + 13] & TCP_SYN)) {
+        return false;
+    }
+
+    for (off = ihl + 20; off < hdr_len; ) {
+        /* end of options, nop */
+        if (pkt[off] == 0) {
+            break;
+        } else if (pkt[off] == 1) {
+            off++;
+            continue;
+        }
+
+        if (off + 1 >= hdr_len || pkt[off + 1] < 2 ||
+                off + pkt[off + 1] > hdr_len) {
+            break;
+        }
+
+        /* kind 2: mss */
+        if (pkt[off] == 2 && pkt[off + 1] == 4) {
+            if ((old = get_be16(pkt + off + 2)) <= mss) {
+                return false;
+            }
+
+            put_be16(pkt + off + 2, mss);
+
+            /* rfc 1624 incremental update, option is 16 bit aligned */
+            sum = (uint16_t) ~get_be16(pkt + ihl + 16) +
+                (uint16_t) ~old + mss;
+            put_be16(pkt + ihl + 16, ~csum_fold(sum));
+
+            return true;
+        }
+
+        off += pkt[off + 1];
+    }
+
+    return false;
+}
+
+bool mark_ecn_ce(uint8_t *pkt, size_t size)
+{
+    if (size < 20 || (pkt[0] >> 4) != 4 ||
+            (size_t) (pkt[0] & 0xf) * 4 > size || !(pkt[1] & 3)) {
+        return false;
+    }
+
+    if ((pkt[1] & 3) != 3) {
+        pkt[1] |= 3;
+        update_ip_csum(pkt);
+    }
+
+    return true;
+}
+
+size_t build_icmp_frag_needed(uint8_t *out, size_t out_size,
+        const uint8_t *pkt, size_t size, uint32_t src_addr, uint16_t mtu)
+{
+    size_t ihl, quote, len;
+
+    if (size < 20 || (pkt[0] >> 4) != 4) {
+        return 0;
+    }
+
+    /* original header and 8 bytes of payload */
+    ihl = (pkt[0] & 0xf) * 4;
+    quote = ihl + 8 < size ? ihl + 8 : size;
+    len = 20 + 8 + quote;
+
+    if (out_size < len) {
+        return 0;
+    }
+
+    memset(out, 0, 28);
+
+    out[0] = 0x45;
+    put_be16(out + 2, len);
+    out[8] = 64;
+    out[9] = 1;
+    put_be32(out + 12, src_addr);
+    memcpy(out + 16, pkt + 12, 4);
+    update_ip_csum(out);
+
+    /* destination unreachable, fragmentation needed */
+    out[20] = 3;
+    out[21] = 4;
+    put_be16(out + 26, mtu);
+    memcpy(out + 28, pkt, quote);
+    put_be16(out + 22, ~csum_fold(csum_add(0, out + 20, 8 + quote)));
+
+    return len;
+}
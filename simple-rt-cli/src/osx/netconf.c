@@ -0,0 +1,63 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "netconf.h"
+
+#ifndef IFACE_UP_SH_PATH
+ #define IFACE_UP_SH_PATH "./iface_up.sh"
+#endif
+
+/* FIXME: pf has no api worth linking, script does the job */
+bool netconf_up(const netconf_t *conf)
+{
+    char cmd[1024] = { 0 };
+    char net_addr_str[32] = { 0 };
+    char host_addr_str[32] = { 0 };
+
+    uint32_t net_addr = htonl(conf->net_addr);
+    uint32_t host_addr = htonl(conf->host_addr);
+
+    snprintf(net_addr_str, sizeof(net_addr_str), "%s",
+            inet_ntoa(*(struct in_addr *) &net_addr));
+
+    snprintf(host_addr_str, sizeof(host_addr_str), "%s",
+            inet_ntoa(*(struct in_addr *) &host_addr));
+
+    snprintf(cmd, sizeof(cmd), "%s %s start %s %s %s %u %s %s %u\n",
+            IFACE_UP_SH_PATH, PLATFORM, conf->dev, net_addr_str,
+            host_addr_str, conf->prefix,
+            conf->nameserver,
+            conf->out_iface,
+            conf->mtu);
+
+    return system(cmd) == 0;
+}
+
+bool netconf_down(void)
+{
+    char cmd[1024] = { 0 };
+
+    snprintf(cmd, sizeof(cmd), "%s %s stop",
+            IFACE_UP_SH_PATH, PLATFORM);
+
+    return system(cmd) == 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+#include "poller.h"
+
+#define POLLER_MAX_EVENTS 64
+#define POLLER_WAKEUP_IDENT 1
+
+struct poller_t {
+    int kq;
+};
+
+poller_t *poller_new(void)
+{
+    poller_t *poller;
+    struct kevent ev;
+
+    if ((poller = malloc(sizeof(*poller))) == NULL) {
+        return NULL;
+    }
+
+    EV_SET(&ev, POLLER_WAKEUP_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR,
+            0, 0, NULL);
+
+    if ((poller->kq = kqueue()) < 0 ||
+            kevent(poller->kq, &ev, 1, NULL, 0, NULL) < 0) {
+        perror("Unable to create poller");
+        poller_free(poller);
+        return NULL;
+    }
+
+    return poller;
+}
+
+void poller_free(poller_t *poller)
+{
+    if (!poller) {
+        return;
+    }
+
+    if (poller->kq >= 0) {
+        close(poller->kq);
+    }
+
+    free(poller);
+}
+
+bool poller_add(poller_t *poller, int fd, short events, void *data)
+{
+    int cnt = 0;
+    struct kevent ev[2];
+
+    if (events & POLLIN) {
+        EV_SET(&ev[cnt++], fd, EVFILT_READ, EV_ADD, 0, 0, data);
+    }
+
+    if (events & POLLOUT) {
+        EV_SET(&ev[cnt++], fd, EVFILT_WRITE, EV_ADD, 0, 0, data);
+    }
+
+    return kevent(poller->kq, ev, cnt, NULL, 0, NULL) == 0;
+}
+
+void poller_del(poller_t *poller, int fd)
+{
+    struct kevent ev;
+
+    /* filter may be not registered, ignore errors */
+    EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(poller->kq, &ev, 1, NULL, 0, NULL);
+
+    EV_SET(&ev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(poller->kq, &ev, 1, NULL, 0, NULL);
+}
+
+int poller_wait(poller_t *poller, void **data, int max, int64_t timeout_us)
+{
+    int cnt, ret = 0;
+    struct kevent events[POLLER_MAX_EVENTS];
+    struct timespec ts = {
+        .tv_sec = timeout_us / 1000000,
+        .tv_nsec = (timeout_us % 1000000) * 1000,
+    };
+
+    if (max > POLLER_MAX_EVENTS) {
+        max = POLLER_MAX_EVENTS;
+    }
+
+    if ((cnt = kevent(poller->kq, NULL, 0, events, max,
+                    timeout_us < 0 ? NULL : &ts)) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        if (events[i].filter != EVFILT_USER) {
+            data[ret++] = events[i].udata;
+        }
+    }
+
+    return ret;
+}
+
+void poller_wakeup(poller_t *poller)
+{
+    struct kevent ev;
+
+    EV_SET(&ev, POLLER_WAKEUP_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent(poller->kq, &ev, 1, NULL, 0, NULL);
+}
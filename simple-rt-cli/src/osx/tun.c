@@ -31,6 +31,7 @@
 #include <sys/kern_control.h>
 #include <net/if_utun.h>
 
+#include "tun.h"
 #include "utils.h"
 
 #define MY_SC_UNIT 2234
@@ -41,7 +42,20 @@ bool is_tun_present(void)
     return true;
 }
 
-int tun_alloc(char *dev_name, size_t dev_name_size)
+bool tun_has_offload(void)
+{
+    /* utun has no vnet headers */
+    return false;
+}
+
+size_t tun_max_queues(void)
+{
+    /* utun has no multi queue support */
+    return 1;
+}
+
+int tun_alloc(char *dev_name, size_t dev_name_size, bool multi_queue,
+        bool offload)
 {
     int fd = 0;
     struct sockaddr_ctl sc = { 0 };
@@ -86,11 +100,16 @@ int tun_alloc(char *dev_name, size_t dev_name_size)
     return fd;
 }
 
-ssize_t tun_read_ip_packet(int fd, uint8_t *packet, size_t size)
+ssize_t tun_read_ip_packet(int fd, uint8_t *packet, size_t size,
+        tun_gso_t *gso)
 {
     u_int32_t type;
     struct iovec iv[2];
 
+    if (gso) {
+        memset(gso, 0, sizeof(*gso));
+    }
+
     iv[0].iov_base = (uint8_t *) &type;
     iv[0].iov_len = sizeof(type);
     iv[1].iov_base = packet;
@@ -99,7 +118,8 @@ ssize_t tun_read_ip_packet(int fd, uint8_t *packet, size_t size)
     return readv(fd, iv, ARRAY_SIZE(iv));
 }
 
-ssize_t tun_write_ip_packet(int fd, const uint8_t *packet, size_t size)
+ssize_t tun_write_ip_packet(int fd, const uint8_t *packet, size_t size,
+        const tun_gso_t *gso)
 {
     struct iovec iv[2];
     uint32_t type = htonl(AF_INET);
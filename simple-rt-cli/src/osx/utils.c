@@ -21,6 +21,25 @@
 static simple_rt_config_t simple_rt_config = {
     .interface = "en0",
     .nameserver = DEFAULT_NAMESERVER,
+    .network = DEFAULT_NETWORK,
+    .usb_transfers = DEFAULT_USB_TRANSFERS,
+    .flush_latency_us = DEFAULT_FLUSH_LATENCY_US,
+    .tx_queue_len = DEFAULT_TX_QUEUE_LEN,
+    .tun_queues = DEFAULT_TUN_QUEUES,
+    .shards = DEFAULT_SHARDS,
+    .pool_size_mb = DEFAULT_POOL_SIZE_MB,
+    .offload = false,
+    .switch_policy = SWITCH_POLICY_KERNEL,
+    .compress = false,
+    .metrics_path = NULL,
+    .mtu = DEFAULT_MTU,
+    .rate_limits_path = NULL,
+    .busy_poll_us = 0,
+    .cpu_list = NULL,
+    .dns_mode = DNS_MODE_OFF,
+    .ack_filter = false,
+    .link_timeout_ms = DEFAULT_LINK_TIMEOUT_MS,
+    .sessions_path = NULL,
 };
 
 simple_rt_config_t *get_simple_rt_config(void)
@@ -28,3 +47,14 @@ simple_rt_config_t *get_simple_rt_config(void)
     return &simple_rt_config;
 }
 
+
+/* thread_policy_set() affinity is a hint only, threads are not pinned */
+bool pin_thread_to_cpu(int cpu)
+{
+    return false;
+}
+
+char *get_usb_irq_cpu_list(char *buf, size_t size)
+{
+    return NULL;
+}
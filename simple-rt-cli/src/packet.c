@@ -0,0 +1,296 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "packet.h"
+#include "ring.h"
+
+/* descriptors per buffer, slices of batches need more than one */
+#define DESCS_PER_BUF 4
+
+/* transfer buffers take this part of memory cap, packets the rest */
+#define XFER_SHARE_DIV 4
+
+#define HUGEPAGE_SIZE (2 << 20)
+
+typedef struct buf_class_t {
+    uint8_t *mem;
+    size_t buf_size;
+    size_t bufs_total;
+    atomic_uint *refs;
+    ring_t free_bufs;
+    atomic_size_t bufs_used;
+    atomic_size_t bufs_peak;
+    atomic_uint_least64_t alloc_failed;
+} buf_class_t;
+
+static struct {
+    uint8_t *mem;
+    size_t mem_size;
+    buf_class_t classes[PACKET_CLASSES];
+    packet_t *descs;
+    ring_t free_descs;
+    bool is_hugepage;
+} pool;
+
+static uint8_t *alloc_pool_memory(size_t size)
+{
+    void *mem;
+
+#ifdef MAP_HUGETLB
+    size_t huge_size = (size + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+
+    mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+        pool.mem_size = huge_size;
+        pool.is_hugepage = true;
+        return mem;
+    }
+#endif
+
+    /* no reserved hugepages, let kernel back it with THP if it can */
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+#ifdef MADV_HUGEPAGE
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+
+    pool.mem_size = size;
+    pool.is_hugepage = false;
+
+    return mem;
+}
+
+static bool init_buf_class(buf_class_t *c, uint8_t *mem)
+{
+    c->mem = mem;
+
+    if ((c->refs = calloc(c->bufs_total, sizeof(*c->refs))) == NULL ||
+            !ring_init(&c->free_bufs, c->bufs_total)) {
+        return false;
+    }
+
+    /* buffer index is stored as pointer, offset by one to never be NULL */
+    for (size_t i = 0; i < c->bufs_total; i++) {
+        atomic_init(&c->refs[i], 0);
+        ring_push(&c->free_bufs, (void *) (i + 1));
+    }
+
+    atomic_init(&c->bufs_used, 0);
+    atomic_init(&c->bufs_peak, 0);
+    atomic_init(&c->alloc_failed, 0);
+
+    return true;
+}
+
+bool packet_pool_init(size_t pkt_size, size_t xfer_size, size_t mem_cap)
+{
+    buf_class_t *pkts = &pool.classes[PACKET_CLASS_PKT];
+    buf_class_t *xfers = &pool.classes[PACKET_CLASS_XFER];
+    size_t descs_total;
+
+    /* cache line aligned buffers */
+    pkts->buf_size = (pkt_size + 63) & ~(size_t) 63;
+    xfers->buf_size = (xfer_size + 63) & ~(size_t) 63;
+
+    xfers->bufs_total = mem_cap / XFER_SHARE_DIV / xfers->buf_size;
+    pkts->bufs_total = (mem_cap - xfers->bufs_total * xfers->buf_size) /
+        pkts->buf_size;
+    descs_total = (pkts->bufs_total + xfers->bufs_total) * DESCS_PER_BUF;
+
+    if (pkts->bufs_total == 0 || xfers->bufs_total == 0 ||
+            descs_total > UINT32_MAX) {
+        fprintf(stderr, "Invalid packet pool size %zu\n", mem_cap);
+        return false;
+    }
+
+    if ((pool.mem = alloc_pool_memory(pkts->bufs_total * pkts->buf_size +
+                    xfers->bufs_total * xfers->buf_size)) == NULL) {
+        perror("Unable to allocate packet pool");
+        return false;
+    }
+
+    pool.descs = calloc(descs_total, sizeof(*pool.descs));
+
+    /* transfers first, both classes stay cache line aligned */
+    if (!pool.descs || !init_buf_class(xfers, pool.mem) ||
+            !init_buf_class(pkts, pool.mem +
+                xfers->bufs_total * xfers->buf_size) ||
+            !ring_init(&pool.free_descs, descs_total)) {
+        fprintf(stderr, "Unable to allocate packet pool\n");
+        packet_pool_destroy();
+        return false;
+    }
+
+    for (size_t i = 0; i < descs_total; i++) {
+        ring_push(&pool.free_descs, &pool.descs[i]);
+    }
+
+    return true;
+}
+
+void packet_pool_destroy(void)
+{
+    if (pool.mem) {
+        munmap(pool.mem, pool.mem_size);
+    }
+
+    for (size_t i = 0; i < PACKET_CLASSES; i++) {
+        ring_destroy(&pool.classes[i].free_bufs);
+        free(pool.classes[i].refs);
+    }
+
+    ring_destroy(&pool.free_descs);
+    free(pool.descs);
+
+    memset(&pool, 0, sizeof(pool));
+}
+
+void packet_pool_get_stats(packet_class_t cls, packet_pool_stats_t *stats)
+{
+    buf_class_t *c = &pool.classes[cls];
+
+    stats->buf_size = c->buf_size;
+    stats->bufs_total = c->bufs_total;
+    stats->bufs_used = atomic_load(&c->bufs_used);
+    stats->bufs_peak = atomic_load(&c->bufs_peak);
+    stats->alloc_failed = atomic_load(&c->alloc_failed);
+    stats->is_hugepage = pool.is_hugepage;
+}
+
+size_t packet_buf_size(void)
+{
+    return pool.classes[PACKET_CLASS_PKT].buf_size;
+}
+
+size_t packet_xfer_size(void)
+{
+    return pool.classes[PACKET_CLASS_XFER].buf_size;
+}
+
+static void update_peak(buf_class_t *c, size_t used)
+{
+    size_t peak = atomic_load_explicit(&c->bufs_peak, memory_order_relaxed);
+
+    while (used > peak && !atomic_compare_exchange_weak_explicit(
+                &c->bufs_peak, &peak, used,
+                memory_order_relaxed, memory_order_relaxed));
+}
+
+static packet_t *alloc_from_class(packet_class_t cls)
+{
+    buf_class_t *c = &pool.classes[cls];
+    packet_t *pkt;
+    uintptr_t buf;
+
+    if ((pkt = ring_pop(&pool.free_descs)) == NULL) {
+        goto error;
+    }
+
+    if ((buf = (uintptr_t) ring_pop(&c->free_bufs)) == 0) {
+        ring_push(&pool.free_descs, pkt);
+        goto error;
+    }
+
+    pkt->buf = buf - 1;
+    pkt->cls = cls;
+    pkt->data = c->mem + pkt->buf * c->buf_size;
+    pkt->len = 0;
+    pkt->ts = 0;
+    pkt->next = NULL;
+
+    atomic_store_explicit(&c->refs[pkt->buf], 1, memory_order_relaxed);
+    update_peak(c, atomic_fetch_add_explicit(&c->bufs_used, 1,
+                memory_order_relaxed) + 1);
+
+    return pkt;
+
+error:
+    atomic_fetch_add_explicit(&c->alloc_failed, 1, memory_order_relaxed);
+    return NULL;
+}
+
+packet_t *packet_alloc(void)
+{
+    return alloc_from_class(PACKET_CLASS_PKT);
+}
+
+packet_t *packet_alloc_xfer(void)
+{
+    return alloc_from_class(PACKET_CLASS_XFER);
+}
+
+/* new packet referencing part of pkt buffer */
+packet_t *packet_slice(packet_t *pkt, uint8_t *data, size_t len)
+{
+    buf_class_t *c = &pool.classes[pkt->cls];
+    packet_t *slice;
+
+    if ((slice = ring_pop(&pool.free_descs)) == NULL) {
+        atomic_fetch_add_explicit(&c->alloc_failed, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&c->refs[pkt->buf], 1, memory_order_relaxed);
+
+    slice->buf = pkt->buf;
+    slice->cls = pkt->cls;
+    slice->data = data;
+    slice->len = len;
+    slice->ts = pkt->ts;
+    slice->next = NULL;
+
+    return slice;
+}
+
+/* buffer is referenced by someone else, must not be overwritten */
+bool packet_is_shared(packet_t *pkt)
+{
+    return atomic_load_explicit(&pool.classes[pkt->cls].refs[pkt->buf],
+            memory_order_acquire) > 1;
+}
+
+void packet_free(packet_t *pkt)
+{
+    buf_class_t *c;
+    uint32_t buf;
+
+    if (!pkt) {
+        return;
+    }
+
+    c = &pool.classes[pkt->cls];
+    buf = pkt->buf;
+    ring_push(&pool.free_descs, pkt);
+
+    if (atomic_fetch_sub_explicit(&c->refs[buf], 1,
+                memory_order_acq_rel) == 1) {
+        atomic_fetch_sub_explicit(&c->bufs_used, 1, memory_order_relaxed);
+        ring_push(&c->free_bufs, (void *) ((uintptr_t) buf + 1));
+    }
+}
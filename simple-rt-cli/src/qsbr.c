@@ -0,0 +1,137 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "qsbr.h"
+
+#define QSBR_OFFLINE 0
+
+typedef struct qsbr_reader_t {
+    /* last global epoch seen, QSBR_OFFLINE if holds no references */
+    _Alignas(64) atomic_uint_fast64_t epoch;
+    struct qsbr_reader_t *next;
+} qsbr_reader_t;
+
+static atomic_uint_fast64_t g_epoch = 1;
+
+/* registration and polling are rare, readers never take it */
+static pthread_mutex_t g_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static qsbr_reader_t *g_readers = NULL;
+
+static _Thread_local qsbr_reader_t *g_self = NULL;
+
+void qsbr_register_thread(void)
+{
+    qsbr_reader_t *reader;
+
+    if (g_self) {
+        return;
+    }
+
+    if ((reader = aligned_alloc(64, sizeof(*reader))) == NULL) {
+        fprintf(stderr, "Unable to register qsbr reader\n");
+        abort();
+    }
+
+    atomic_init(&reader->epoch, QSBR_OFFLINE);
+
+    pthread_mutex_lock(&g_readers_lock);
+    reader->next = g_readers;
+    g_readers = reader;
+    pthread_mutex_unlock(&g_readers_lock);
+
+    g_self = reader;
+
+    qsbr_online();
+}
+
+void qsbr_unregister_thread(void)
+{
+    qsbr_reader_t **pp;
+
+    if (!g_self) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_readers_lock);
+
+    for (pp = &g_readers; *pp; pp = &(*pp)->next) {
+        if (*pp == g_self) {
+            *pp = g_self->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&g_readers_lock);
+
+    free(g_self);
+    g_self = NULL;
+}
+
+void qsbr_quiescent(void)
+{
+    /* earlier reads must not leak past the report */
+    atomic_store_explicit(&g_self->epoch,
+            atomic_load(&g_epoch), memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void qsbr_offline(void)
+{
+    atomic_store_explicit(&g_self->epoch, QSBR_OFFLINE, memory_order_release);
+}
+
+void qsbr_online(void)
+{
+    /* later reads must not pass the report, pairs with qsbr_poll() */
+    atomic_store_explicit(&g_self->epoch,
+            atomic_load(&g_epoch), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+uint64_t qsbr_retire(void)
+{
+    return atomic_fetch_add(&g_epoch, 1) + 1;
+}
+
+bool qsbr_poll(uint64_t epoch)
+{
+    uint64_t seen;
+    bool ret = true;
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    pthread_mutex_lock(&g_readers_lock);
+
+    for (qsbr_reader_t *r = g_readers; r; r = r->next) {
+        seen = atomic_load_explicit(&r->epoch, memory_order_acquire);
+
+        if (seen != QSBR_OFFLINE && seen < epoch) {
+            ret = false;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&g_readers_lock);
+
+    return ret;
+}
@@ -0,0 +1,424 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "accessory.h"
+#include "network.h"
+#include "qsbr.h"
+#include "ratelimit.h"
+#include "utils.h"
+
+/* bytes per second in one mbit/s */
+#define MBIT_RATE 125000.0
+
+#define NO_LIMIT UINT64_MAX
+
+typedef struct rate_override_t {
+    accessory_id_t id;
+    uint64_t rate[RATE_DIRS];
+} rate_override_t;
+
+typedef struct rate_config_t {
+    uint64_t total[RATE_DIRS];
+    uint64_t phone[RATE_DIRS];
+    bool is_fair;
+    rate_override_t *overrides;
+    size_t overrides_cnt;
+} rate_config_t;
+
+/* accessory as seen by one tick */
+typedef struct rate_acc_t {
+    rate_limiter_t *limits;
+    uint64_t cap[RATE_DIRS];
+    uint64_t demand[RATE_DIRS];
+} rate_acc_t;
+
+typedef struct rate_tick_t {
+    rate_acc_t *accs;
+    size_t cnt;
+    size_t size;
+    rate_config_t *config;
+} rate_tick_t;
+
+static struct {
+    const char *path;
+    rate_config_t config;
+    atomic_bool is_enabled;
+    token_bucket_t total[RATE_DIRS];
+    uint64_t tick_ts;
+    bool is_dirty;
+    rate_tick_t tick;
+} g_rate;
+
+static bool take_tokens(token_bucket_t *tb, size_t len, uint64_t now_ns)
+{
+    uint64_t rate = atomic_load_explicit(&tb->rate, memory_order_relaxed);
+    uint64_t cost, burst, empty, start;
+
+    if (!rate) {
+        return true;
+    }
+
+    cost = (uint64_t) len * 1000000000 / rate;
+    burst = (uint64_t) RATE_MIN_BURST * 1000000000 / rate;
+    if (burst < RATE_BURST_US * 1000) {
+        burst = RATE_BURST_US * 1000;
+    }
+
+    empty = atomic_load_explicit(&tb->empty_ns, memory_order_relaxed);
+
+    do {
+        start = empty > now_ns ? empty : now_ns;
+
+        /* bucket would be empty longer than burst allows */
+        if (start + cost > now_ns + burst) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&tb->empty_ns, &empty,
+                start + cost, memory_order_relaxed, memory_order_relaxed));
+
+    return true;
+}
+
+void rate_limiter_init(rate_limiter_t *rl)
+{
+    atomic_init(&rl->bucket.empty_ns, 0);
+    atomic_init(&rl->bucket.rate, 0);
+    atomic_init(&rl->offered, 0);
+    rl->last_offered = 0;
+}
+
+bool rate_limit_packet(rate_limiter_t *rl, rate_dir_t dir, size_t len)
+{
+    uint64_t now_ns;
+
+    if (!atomic_load_explicit(&g_rate.is_enabled, memory_order_relaxed)) {
+        return true;
+    }
+
+    now_ns = get_time_us() * 1000;
+    atomic_fetch_add_explicit(&rl->offered, len, memory_order_relaxed);
+
+    /* tokens of accessory are lost if total is over, they refill soon */
+    return take_tokens(&rl->bucket, len, now_ns) &&
+        take_tokens(&g_rate.total[dir], len, now_ns);
+}
+
+static bool parse_rate(const char *str, uint64_t *rate)
+{
+    char *end;
+    double mbit = strtod(str, &end);
+
+    if (end == str || *end || mbit < 0) {
+        return false;
+    }
+
+    *rate = (uint64_t) (mbit * MBIT_RATE);
+
+    return true;
+}
+
+static bool add_override(rate_config_t *config, accessory_id_t id,
+        const uint64_t *rate)
+{
+    rate_override_t *overrides;
+
+    if ((overrides = realloc(config->overrides,
+                    (config->overrides_cnt + 1) * sizeof(*overrides))) == NULL) {
+        return false;
+    }
+
+    config->overrides = overrides;
+    overrides[config->overrides_cnt].id = id;
+    memcpy(overrides[config->overrides_cnt].rate, rate,
+            sizeof(overrides->rate));
+    config->overrides_cnt++;
+
+    return true;
+}
+
+static bool parse_rate_config(const char *path, rate_config_t *config)
+{
+    FILE *f;
+    char line[256], *tok[4], *p, *save;
+    uint64_t rate[RATE_DIRS];
+    accessory_id_t id;
+    unsigned int line_no = 0;
+    size_t cnt;
+
+    memset(config, 0, sizeof(*config));
+
+    if ((f = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_no++;
+
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+
+        for (cnt = 0, p = strtok_r(line, " \t\r\n", &save);
+                p != NULL && cnt < ARRAY_SIZE(tok);
+                p = strtok_r(NULL, " \t\r\n", &save)) {
+            tok[cnt++] = p;
+        }
+
+        if (!cnt) {
+            continue;
+        }
+
+        if (cnt == 1 && !strcmp(tok[0], "fair")) {
+            config->is_fair = true;
+            continue;
+        }
+
+        if (cnt != 3 || !parse_rate(tok[1], &rate[RATE_DOWN]) ||
+                !parse_rate(tok[2], &rate[RATE_UP])) {
+            goto error;
+        }
+
+        if (!strcmp(tok[0], "total")) {
+            memcpy(config->total, rate, sizeof(rate));
+        } else if (!strcmp(tok[0], "phone")) {
+            memcpy(config->phone, rate, sizeof(rate));
+        } else if ((id = parse_acc_addr(tok[0])) == 0 ||
+                !add_override(config, id, rate)) {
+            goto error;
+        }
+    }
+
+    fclose(f);
+
+    return true;
+
+error:
+    fprintf(stderr, "%s:%u: bad rate limit\n", path, line_no);
+    free(config->overrides);
+    fclose(f);
+
+    return false;
+}
+
+static void apply_rate_config(rate_config_t *config)
+{
+    bool is_enabled = config->overrides_cnt != 0;
+
+    free(g_rate.config.overrides);
+    g_rate.config = *config;
+
+    for (size_t dir = 0; dir < RATE_DIRS; dir++) {
+        atomic_store(&g_rate.total[dir].rate, config->total[dir]);
+        is_enabled |= config->total[dir] || config->phone[dir];
+    }
+
+    atomic_store(&g_rate.is_enabled, is_enabled);
+
+    printf("rate limits: total %.1f/%.1f, phone %.1f/%.1f mbit/s down/up, "
+            "%zu addresses%s\n",
+            config->total[RATE_DOWN] / MBIT_RATE,
+            config->total[RATE_UP] / MBIT_RATE,
+            config->phone[RATE_DOWN] / MBIT_RATE,
+            config->phone[RATE_UP] / MBIT_RATE,
+            config->overrides_cnt, config->is_fair ? ", fair share" : "");
+}
+
+bool start_rate_limits(const char *path)
+{
+    rate_config_t config;
+
+    if (!parse_rate_config(path, &config)) {
+        return false;
+    }
+
+    g_rate.path = path;
+    apply_rate_config(&config);
+
+    /* main thread reads accessory table on ticks, see handle_rate_limits() */
+    qsbr_register_thread();
+    qsbr_offline();
+
+    return true;
+}
+
+bool reload_rate_limits(void)
+{
+    rate_config_t config;
+
+    if (!g_rate.path) {
+        return false;
+    }
+
+    if (!parse_rate_config(g_rate.path, &config)) {
+        fprintf(stderr, "Keeping current rate limits\n");
+        return false;
+    }
+
+    apply_rate_config(&config);
+
+    /* new limits apply right away */
+    g_rate.is_dirty = true;
+
+    return true;
+}
+
+void stop_rate_limits(void)
+{
+    if (!g_rate.path) {
+        return;
+    }
+
+    qsbr_unregister_thread();
+
+    free(g_rate.config.overrides);
+    free(g_rate.tick.accs);
+    memset(&g_rate.config, 0, sizeof(g_rate.config));
+    memset(&g_rate.tick, 0, sizeof(g_rate.tick));
+    g_rate.path = NULL;
+}
+
+/* own limit of accessory, address line wins over phone one */
+static uint64_t get_acc_cap(rate_config_t *config, accessory_id_t id,
+        rate_dir_t dir)
+{
+    uint64_t rate = config->phone[dir];
+
+    for (size_t i = 0; i < config->overrides_cnt; i++) {
+        if (config->overrides[i].id == id) {
+            rate = config->overrides[i].rate[dir];
+        }
+    }
+
+    return rate ? rate : NO_LIMIT;
+}
+
+static void collect_limits(void *arg, accessory_id_t id,
+        rate_limiter_t *limits)
+{
+    rate_tick_t *t = arg;
+    rate_acc_t *accs;
+
+    if (t->cnt == t->size) {
+        size_t size = t->size ? t->size * 2 : 16;
+
+        if ((accs = realloc(t->accs, size * sizeof(*accs))) == NULL) {
+            return;
+        }
+        t->accs = accs;
+        t->size = size;
+    }
+
+    t->accs[t->cnt].limits = limits;
+
+    for (size_t dir = 0; dir < RATE_DIRS; dir++) {
+        t->accs[t->cnt].cap[dir] = get_acc_cap(t->config, id, dir);
+    }
+
+    t->cnt++;
+}
+
+static int compare_rates(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * max-min fair share: accessories asking less than level get what they
+ * ask, busy ones get level, total is used up.
+ */
+static uint64_t get_fair_level(rate_tick_t *t, rate_dir_t dir, uint64_t total)
+{
+    uint64_t demands[t->cnt + 1], level;
+
+    for (size_t i = 0; i < t->cnt; i++) {
+        demands[i] = t->accs[i].demand[dir] < t->accs[i].cap[dir] ?
+            t->accs[i].demand[dir] : t->accs[i].cap[dir];
+    }
+
+    qsort(demands, t->cnt, sizeof(demands[0]), compare_rates);
+
+    for (size_t i = 0; i < t->cnt; i++) {
+        if (demands[i] >= (level = total / (t->cnt - i))) {
+            return level;
+        }
+
+        total -= demands[i];
+    }
+
+    /* nobody is held back, spare goes to whoever grows */
+    return t->cnt ? total + demands[t->cnt - 1] : total;
+}
+
+int64_t handle_rate_limits(void)
+{
+    rate_tick_t *t = &g_rate.tick;
+    uint64_t now = get_time_us(), dt, offered, level, rate;
+
+    if (!g_rate.path) {
+        return -1;
+    }
+
+    if (!g_rate.is_dirty && now < g_rate.tick_ts + RATE_TICK_US) {
+        return g_rate.tick_ts + RATE_TICK_US - now;
+    }
+
+    dt = now > g_rate.tick_ts ? now - g_rate.tick_ts : 1;
+    g_rate.tick_ts = now;
+    g_rate.is_dirty = false;
+
+    t->cnt = 0;
+    t->config = &g_rate.config;
+
+    /* limiters stay valid until we are quiescent again */
+    qsbr_online();
+    for_each_accessory_limits(collect_limits, t);
+
+    for (size_t i = 0; i < t->cnt; i++) {
+        for (size_t dir = 0; dir < RATE_DIRS; dir++) {
+            rate_limiter_t *rl = &t->accs[i].limits[dir];
+
+            offered = atomic_load_explicit(&rl->offered, memory_order_relaxed);
+            t->accs[i].demand[dir] = (offered - rl->last_offered) *
+                1000000 / dt;
+            rl->last_offered = offered;
+        }
+    }
+
+    for (size_t dir = 0; dir < RATE_DIRS; dir++) {
+        level = g_rate.config.is_fair && g_rate.config.total[dir] ?
+            get_fair_level(t, dir, g_rate.config.total[dir]) : NO_LIMIT;
+
+        for (size_t i = 0; i < t->cnt; i++) {
+            rate = t->accs[i].cap[dir] < level ? t->accs[i].cap[dir] : level;
+            atomic_store_explicit(&t->accs[i].limits[dir].bucket.rate,
+                    rate == NO_LIMIT ? 0 : rate, memory_order_relaxed);
+        }
+    }
+
+    qsbr_offline();
+
+    return RATE_TICK_US;
+}
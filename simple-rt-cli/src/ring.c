@@ -0,0 +1,52 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+/* size is rounded up to power of two */
+bool ring_init(ring_t *ring, size_t size)
+{
+    size_t cnt = 2;
+
+    while (cnt < size) {
+        cnt <<= 1;
+    }
+
+    if ((ring->cells = calloc(cnt, sizeof(*ring->cells))) == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < cnt; i++) {
+        atomic_init(&ring->cells[i].seq, i);
+    }
+
+    ring->mask = cnt - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return true;
+}
+
+void ring_destroy(ring_t *ring)
+{
+    free(ring->cells);
+    ring->cells = NULL;
+}
@@ -0,0 +1,308 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "network.h"
+#include "session.h"
+#include "utils.h"
+
+typedef struct session_t {
+    char usb_serial[SESSION_SERIAL_SIZE];
+    accessory_id_t id;
+} session_t;
+
+/* changed table reaches file within that long */
+#define SESSIONS_SAVE_US 1000000
+
+/*
+ * main thread binds on handshake, probe and rx threads on first packet.
+ * file is written by main thread only, see handle_sessions().
+ */
+static struct {
+    const char *path;
+    session_t *list;
+    size_t cnt;
+    size_t size;
+    bool is_dirty;
+    pthread_mutex_t lock;
+} g_sessions = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* table is split on whitespace, phone with odd serial isn't remembered */
+static bool is_serial_valid(const char *usb_serial)
+{
+    if (!usb_serial || !*usb_serial ||
+            strlen(usb_serial) >= SESSION_SERIAL_SIZE) {
+        return false;
+    }
+
+    for (const char *p = usb_serial; *p; p++) {
+        if (!isgraph((unsigned char) *p) || *p == '#') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* must be called with lock held */
+static session_t *find_session(const char *usb_serial)
+{
+    for (size_t i = 0; i < g_sessions.cnt; i++) {
+        if (!strcmp(g_sessions.list[i].usb_serial, usb_serial)) {
+            return &g_sessions.list[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* must be called with lock held, true if table changed */
+static bool forget_session_id(accessory_id_t id, const char *keep)
+{
+    bool is_changed = false;
+
+    for (size_t i = 0; i < g_sessions.cnt; ) {
+        if (g_sessions.list[i].id == id &&
+                (!keep || strcmp(g_sessions.list[i].usb_serial, keep))) {
+            g_sessions.list[i] = g_sessions.list[--g_sessions.cnt];
+            is_changed = true;
+        } else {
+            i++;
+        }
+    }
+
+    return is_changed;
+}
+
+/* must be called with lock held, true if table changed */
+static bool set_session(const char *usb_serial, accessory_id_t id)
+{
+    session_t *s;
+    size_t size;
+    bool is_changed = forget_session_id(id, usb_serial);
+
+    if ((s = find_session(usb_serial)) != NULL) {
+        is_changed |= s->id != id;
+        s->id = id;
+        return is_changed;
+    }
+
+    if (g_sessions.cnt == g_sessions.size) {
+        size = g_sessions.size ? g_sessions.size * 2 : 16;
+        if ((s = realloc(g_sessions.list, size * sizeof(*s))) == NULL) {
+            fprintf(stderr, "Unable to allocate session table\n");
+            return is_changed;
+        }
+        g_sessions.list = s;
+        g_sessions.size = size;
+    }
+
+    s = &g_sessions.list[g_sessions.cnt++];
+    snprintf(s->usb_serial, sizeof(s->usb_serial), "%s", usb_serial);
+    s->id = id;
+
+    return true;
+}
+
+/* written aside, synced and renamed, crash never leaves half of table */
+static void save_sessions(const session_t *list, size_t cnt)
+{
+    FILE *f;
+    char tmp_path[PATH_MAX];
+    char addr_str[INET_ADDRSTRLEN];
+    uint32_t addr;
+    bool is_written;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_sessions.path);
+
+    if ((f = fopen(tmp_path, "w")) == NULL) {
+        fprintf(stderr, "Unable to save sessions to %s: %s\n",
+                tmp_path, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "# usb serial, address; written by simple-rt\n");
+
+    for (size_t i = 0; i < cnt; i++) {
+        addr = htonl(get_acc_addr(list[i].id));
+        inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+        fprintf(f, "%s %s\n", list[i].usb_serial, addr_str);
+    }
+
+    is_written = fflush(f) == 0 && fsync(fileno(f)) == 0;
+
+    if (fclose(f) != 0 || !is_written ||
+            rename(tmp_path, g_sessions.path) != 0) {
+        fprintf(stderr, "Unable to save sessions to %s: %s\n",
+                g_sessions.path, strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+bool start_sessions(const char *path)
+{
+    FILE *f;
+    char line[256], *tok[3], *p, *save;
+    accessory_id_t id;
+    unsigned int line_no = 0;
+    size_t cnt;
+
+    g_sessions.path = path;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        /* first run, file comes with first phone */
+        if (errno == ENOENT) {
+            return true;
+        }
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_no++;
+
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+
+        for (cnt = 0, p = strtok_r(line, " \t\r\n", &save);
+                p != NULL && cnt < ARRAY_SIZE(tok);
+                p = strtok_r(NULL, " \t\r\n", &save)) {
+            tok[cnt++] = p;
+        }
+
+        if (!cnt) {
+            continue;
+        }
+
+        /* network may have changed since, phone gets new address then */
+        if (cnt != 2 || !is_serial_valid(tok[0]) ||
+                (id = parse_acc_addr(tok[1])) == 0) {
+            fprintf(stderr, "%s:%u: session skipped\n", path, line_no);
+            continue;
+        }
+
+        set_session(tok[0], id);
+    }
+
+    fclose(f);
+
+    /* other phones get these addresses last */
+    for (size_t i = 0; i < g_sessions.cnt; i++) {
+        defer_accessory_id(g_sessions.list[i].id);
+    }
+
+    printf("%zu phone sessions remembered\n", g_sessions.cnt);
+
+    return true;
+}
+
+int64_t handle_sessions(void)
+{
+    session_t *list = NULL;
+    size_t cnt;
+
+    if (!g_sessions.path) {
+        return -1;
+    }
+
+    /* copy is written, binds on data plane never wait for disk */
+    pthread_mutex_lock(&g_sessions.lock);
+
+    if (g_sessions.is_dirty) {
+        cnt = g_sessions.cnt;
+        /* one more, emptied table is written too */
+        if ((list = calloc(cnt + 1, sizeof(*list))) != NULL) {
+            memcpy(list, g_sessions.list, cnt * sizeof(*list));
+            g_sessions.is_dirty = false;
+        }
+    }
+
+    pthread_mutex_unlock(&g_sessions.lock);
+
+    if (list) {
+        save_sessions(list, cnt);
+        free(list);
+    }
+
+    return SESSIONS_SAVE_US;
+}
+
+void stop_sessions(void)
+{
+    /* binds are over, last changes go to file */
+    handle_sessions();
+
+    pthread_mutex_lock(&g_sessions.lock);
+
+    free(g_sessions.list);
+    g_sessions.list = NULL;
+    g_sessions.cnt = 0;
+    g_sessions.size = 0;
+
+    pthread_mutex_unlock(&g_sessions.lock);
+}
+
+accessory_id_t find_session_id(const char *usb_serial)
+{
+    session_t *s;
+    accessory_id_t id = 0;
+
+    if (!is_serial_valid(usb_serial)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_sessions.lock);
+
+    if ((s = find_session(usb_serial)) != NULL) {
+        id = s->id;
+    }
+
+    pthread_mutex_unlock(&g_sessions.lock);
+
+    return id;
+}
+
+void bind_session(const char *usb_serial, accessory_id_t id)
+{
+    bool is_changed;
+
+    pthread_mutex_lock(&g_sessions.lock);
+
+    /* phone without serial still takes address from remembered one */
+    if (is_serial_valid(usb_serial)) {
+        is_changed = set_session(usb_serial, id);
+    } else {
+        is_changed = forget_session_id(id, NULL);
+    }
+
+    if (is_changed) {
+        g_sessions.is_dirty = true;
+    }
+
+    pthread_mutex_unlock(&g_sessions.lock);
+}
@@ -0,0 +1,465 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+
+#include "shard.h"
+#include "accessory.h"
+#include "network.h"
+#include "qsbr.h"
+#include "utils.h"
+
+#define SHARD_MAX_EVENTS 64
+
+/* retired accessories are checked for grace period this often */
+#define SHARD_RECLAIM_US 1000
+
+#define MAX_CPUS 1024
+
+/* spin loop hint, sibling hyperthread gets the core meanwhile */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+static shard_t g_shards[MAX_SHARDS];
+static size_t g_shards_cnt = 0;
+
+static _Thread_local shard_t *g_current_shard = NULL;
+
+static void usb_pollfd_added(int fd, short events, void *user_data)
+{
+    shard_t *shard = user_data;
+
+    if (!poller_add(shard->poller, fd, events, &shard->usb_io)) {
+        perror("Unable to watch usb fd");
+    }
+}
+
+static void usb_pollfd_removed(int fd, void *user_data)
+{
+    shard_t *shard = user_data;
+
+    poller_del(shard->poller, fd);
+}
+
+static bool watch_usb_pollfds(shard_t *shard)
+{
+    const struct libusb_pollfd **pollfds;
+
+    libusb_set_pollfd_notifiers(shard->usb_ctx,
+            usb_pollfd_added, usb_pollfd_removed, shard);
+
+    if ((pollfds = libusb_get_pollfds(shard->usb_ctx)) == NULL) {
+        fprintf(stderr, "libusb pollfds are not supported\n");
+        return false;
+    }
+
+    for (size_t i = 0; pollfds[i] != NULL; i++) {
+        usb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, shard);
+    }
+
+    libusb_free_pollfds(pollfds);
+
+    return true;
+}
+
+/* sleep until some fd is ready, libusb timeout, batch or ping deadline */
+static int64_t get_shard_timeout(shard_t *shard)
+{
+    struct timeval tv;
+    int64_t timeout_us = -1;
+    simple_rt_config_t *config = get_simple_rt_config();
+    uint64_t now;
+
+    if (atomic_load(&shard->pending_batches)) {
+        timeout_us = config->flush_latency_us;
+    }
+
+    if (shard->ctrl_list) {
+        now = get_time_us();
+        if (now >= shard->ctrl_next_ts) {
+            timeout_us = 0;
+        } else if (timeout_us < 0 ||
+                shard->ctrl_next_ts - now < (uint64_t) timeout_us) {
+            timeout_us = shard->ctrl_next_ts - now;
+        }
+    }
+
+    if (atomic_load(&shard->retired_cnt) &&
+            (timeout_us < 0 || timeout_us > SHARD_RECLAIM_US)) {
+        timeout_us = SHARD_RECLAIM_US;
+    }
+
+    /* no timerfd, libusb timeouts are ours to wait for */
+    if (!libusb_pollfds_handle_timeouts(shard->usb_ctx) &&
+            libusb_get_next_timeout(shard->usb_ctx, &tv) == 1) {
+        int64_t usb_timeout_us = tv.tv_sec * 1000000 + tv.tv_usec;
+
+        if (timeout_us < 0 || usb_timeout_us < timeout_us) {
+            timeout_us = usb_timeout_us;
+        }
+    }
+
+    return timeout_us;
+}
+
+/*
+ * busy poll: while packets keep coming, spinning for a few us is cheaper
+ * than going to sleep and being woken up. kicks from other threads show
+ * up in kick ring before wakeup fd is read.
+ */
+static int spin_shard(shard_t *shard, void **events, int max,
+        int64_t *timeout_us)
+{
+    simple_rt_config_t *config = get_simple_rt_config();
+    uint64_t start = get_time_us(), spent;
+    int64_t budget = config->busy_poll_us;
+    int cnt;
+
+    if (*timeout_us >= 0 && *timeout_us < budget) {
+        budget = *timeout_us;
+    }
+
+    do {
+        cnt = poller_wait(shard->poller, events, max, 0);
+        if (cnt || ring_count(&shard->kick_ring)) {
+            *timeout_us = 0;
+            return cnt;
+        }
+
+        cpu_relax();
+    } while ((int64_t) (spent = get_time_us() - start) < budget);
+
+    if (*timeout_us > 0) {
+        *timeout_us = *timeout_us > (int64_t) spent ?
+            *timeout_us - (int64_t) spent : 0;
+    }
+
+    return 0;
+}
+
+static void *shard_thread_proc(void *arg)
+{
+    shard_t *shard = arg;
+    simple_rt_config_t *config = get_simple_rt_config();
+    void *events[SHARD_MAX_EVENTS];
+    struct timeval zero_tv = { 0 };
+    int64_t timeout_us;
+    bool usb_ready;
+    int cnt;
+
+    g_current_shard = shard;
+    pin_to_shard_cpu(shard);
+    qsbr_register_thread();
+
+    while (shard->is_running) {
+        /* holds no accessory references while spinning or sleeping */
+        qsbr_offline();
+        timeout_us = get_shard_timeout(shard);
+        cnt = 0;
+
+        if (config->busy_poll_us) {
+            cnt = spin_shard(shard, events, ARRAY_SIZE(events), &timeout_us);
+        }
+
+        /* spinning already looked at fds, nothing left to wait for */
+        if (!config->busy_poll_us || (!cnt && timeout_us)) {
+            cnt = poller_wait(shard->poller, events, ARRAY_SIZE(events),
+                    timeout_us);
+        }
+        qsbr_online();
+
+        if (cnt < 0) {
+            perror("Shard poller failed");
+            break;
+        }
+
+        /* timeout may be libusb one as well */
+        usb_ready = cnt == 0;
+
+        for (int i = 0; i < cnt; i++) {
+            shard_io_t *io = events[i];
+
+            if (io == &shard->usb_io) {
+                usb_ready = true;
+            } else {
+                io->handle(io->arg);
+            }
+        }
+
+        if (usb_ready) {
+            libusb_handle_events_timeout_completed(shard->usb_ctx,
+                    &zero_tv, NULL);
+        }
+
+        handle_accessory_events(shard);
+    }
+
+    qsbr_unregister_thread();
+
+    return NULL;
+}
+
+static void destroy_shard(shard_t *shard)
+{
+    if (shard->usb_ctx) {
+        libusb_set_pollfd_notifiers(shard->usb_ctx, NULL, NULL, NULL);
+        libusb_exit(shard->usb_ctx);
+    }
+
+    poller_free(shard->poller);
+    ring_destroy(&shard->kick_ring);
+    pthread_mutex_destroy(&shard->retire_lock);
+
+    memset(shard, 0, sizeof(*shard));
+}
+
+static bool init_shard(shard_t *shard, size_t idx)
+{
+    int ret;
+
+    memset(shard, 0, sizeof(*shard));
+
+    shard->idx = idx;
+    shard->cpu = -1;
+    atomic_init(&shard->load, 0);
+    atomic_init(&shard->pending_batches, 0);
+    atomic_init(&shard->retired_cnt, 0);
+    pthread_mutex_init(&shard->retire_lock, NULL);
+
+    /*
+     * accessories with queued packets, at most once each: every address
+     * of network may land on one shard, plus retired ones not yet
+     * destroyed which take their address from a replugged phone
+     */
+    if (!ring_init(&shard->kick_ring, 2 * get_network_size()) ||
+            (shard->poller = poller_new()) == NULL) {
+        fprintf(stderr, "Unable to allocate shard\n");
+        goto error;
+    }
+
+    if ((ret = libusb_init(&shard->usb_ctx)) != 0) {
+        fprintf(stderr, "Unable to init libusb: %s\n", libusb_strerror(ret));
+        shard->usb_ctx = NULL;
+        goto error;
+    }
+
+    if (!watch_usb_pollfds(shard)) {
+        goto error;
+    }
+
+    return true;
+
+error:
+    destroy_shard(shard);
+    return false;
+}
+
+/* "0,2-3", or "irq" for cpus serving usb host controller */
+static size_t parse_cpu_list(const char *str, int *cpus, size_t max)
+{
+    char buf[256], *end;
+    long first, last;
+    size_t cnt = 0;
+
+    if (!strcmp(str, "irq")) {
+        if ((str = get_usb_irq_cpu_list(buf, sizeof(buf))) == NULL) {
+            fprintf(stderr, "Unable to find usb controller interrupt\n");
+            return 0;
+        }
+
+        printf("usb controller interrupt is served by cpus %s\n", str);
+    }
+
+    while (*str) {
+        first = last = strtol(str, &end, 10);
+        if (end == str || first < 0) {
+            return 0;
+        }
+
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return 0;
+            }
+        }
+
+        for (long cpu = first; cpu <= last && cnt < max; cpu++) {
+            cpus[cnt++] = cpu;
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return 0;
+        }
+
+        str = end;
+    }
+
+    return cnt;
+}
+
+bool start_shards(size_t cnt)
+{
+    sigset_t sigs, old_sigs;
+    simple_rt_config_t *config = get_simple_rt_config();
+    int cpus[MAX_CPUS];
+    size_t cpus_cnt = 0;
+
+    if (!cnt) {
+        cnt = 1;
+    }
+
+    if (cnt > MAX_SHARDS) {
+        fprintf(stderr, "Only %d shards supported\n", MAX_SHARDS);
+        cnt = MAX_SHARDS;
+    }
+
+    for (size_t i = 0; i < cnt; i++) {
+        if (!init_shard(&g_shards[i], i)) {
+            stop_shards();
+            return false;
+        }
+
+        g_shards_cnt++;
+    }
+
+    if (config->cpu_list && (cpus_cnt = parse_cpu_list(config->cpu_list,
+                    cpus, ARRAY_SIZE(cpus))) == 0) {
+        fprintf(stderr, "Bad cpu list: %s\n", config->cpu_list);
+        stop_shards();
+        return false;
+    }
+
+    /* shards go round robin over listed cpus */
+    for (size_t i = 0; i < g_shards_cnt && cpus_cnt; i++) {
+        g_shards[i].cpu = cpus[i % cpus_cnt];
+    }
+
+    /* signals go to main thread */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+
+    for (size_t i = 0; i < g_shards_cnt; i++) {
+        g_shards[i].is_running = true;
+
+        if (pthread_create(&g_shards[i].thread, NULL,
+                    shard_thread_proc, &g_shards[i]) != 0) {
+            g_shards[i].is_running = false;
+            fprintf(stderr, "Unable to start shard thread\n");
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+    printf("%zu data plane shard(s) started%s", g_shards_cnt,
+            cpus_cnt ? ", cpus" : "\n");
+    for (size_t i = 0; i < g_shards_cnt && cpus_cnt; i++) {
+        printf(" %d%s", g_shards[i].cpu, i + 1 < g_shards_cnt ? "" : "\n");
+    }
+
+    if (config->busy_poll_us) {
+        printf("busy poll for %u us before sleeping\n", config->busy_poll_us);
+    }
+
+    return true;
+}
+
+void stop_shards(void)
+{
+    for (size_t i = 0; i < g_shards_cnt; i++) {
+        if (g_shards[i].is_running) {
+            g_shards[i].is_running = false;
+            wakeup_shard(&g_shards[i]);
+            pthread_join(g_shards[i].thread, NULL);
+        }
+
+        destroy_shard(&g_shards[i]);
+    }
+
+    g_shards_cnt = 0;
+}
+
+size_t get_shards_count(void)
+{
+    return g_shards_cnt;
+}
+
+shard_t *get_shard(size_t idx)
+{
+    return &g_shards[idx % g_shards_cnt];
+}
+
+shard_t *get_current_shard(void)
+{
+    return g_current_shard;
+}
+
+shard_t *acquire_shard(void)
+{
+    shard_t *ret = &g_shards[0];
+
+    for (size_t i = 1; i < g_shards_cnt; i++) {
+        if (atomic_load(&g_shards[i].load) < atomic_load(&ret->load)) {
+            ret = &g_shards[i];
+        }
+    }
+
+    atomic_fetch_add(&ret->load, 1);
+
+    return ret;
+}
+
+void release_shard(shard_t *shard)
+{
+    if (shard) {
+        atomic_fetch_sub(&shard->load, 1);
+    }
+}
+
+bool shard_add_io(shard_t *shard, int fd, shard_io_t *io)
+{
+    return poller_add(shard->poller, fd, POLLIN, io);
+}
+
+void shard_del_io(shard_t *shard, int fd)
+{
+    poller_del(shard->poller, fd);
+}
+
+void wakeup_shard(shard_t *shard)
+{
+    poller_wakeup(shard->poller);
+}
+
+void pin_to_shard_cpu(shard_t *shard)
+{
+    if (shard->cpu >= 0 && !pin_thread_to_cpu(shard->cpu)) {
+        fprintf(stderr, "Unable to pin thread to cpu %d\n", shard->cpu);
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "network.h"
+#include "switch.h"
+
+/* pair counters, open addressing, power of two */
+#define SWITCH_PAIRS 1024
+#define SWITCH_PROBES 16
+
+typedef struct switch_pair_t {
+    /* src << 16 | dst, 0 while slot is free */
+    atomic_uint_least32_t key;
+    atomic_uint_least64_t packets;
+    atomic_uint_least64_t bytes;
+    atomic_uint_least64_t dropped;
+} switch_pair_t;
+
+static switch_pair_t g_pairs[SWITCH_PAIRS];
+
+/* pairs which found no free slot */
+static switch_pair_t g_other_pairs;
+
+static const char *policy_names[] = {
+    [SWITCH_POLICY_KERNEL] = "kernel",
+    [SWITCH_POLICY_SWITCH] = "switch",
+    [SWITCH_POLICY_DROP]   = "drop",
+};
+
+bool parse_switch_policy(const char *str, switch_policy_t *policy)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(policy_names); i++) {
+        if (!strcmp(str, policy_names[i])) {
+            *policy = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *get_switch_policy_name(switch_policy_t policy)
+{
+    return policy_names[policy];
+}
+
+/* slots are claimed once and never freed, lookups take no locks */
+static switch_pair_t *get_switch_pair(accessory_id_t src, accessory_id_t dst)
+{
+    uint32_t key = (uint32_t) src << 16 | dst;
+    uint32_t hash = key * 2654435761u;
+    uint_least32_t cur;
+    switch_pair_t *pair;
+
+    for (uint32_t i = 0; i < SWITCH_PROBES; i++) {
+        pair = &g_pairs[(hash + i) & (SWITCH_PAIRS - 1)];
+        cur = atomic_load_explicit(&pair->key, memory_order_relaxed);
+
+        if (cur == 0 && atomic_compare_exchange_strong(&pair->key, &cur, key)) {
+            return pair;
+        }
+
+        if (cur == key) {
+            return pair;
+        }
+    }
+
+    return &g_other_pairs;
+}
+
+bool switch_accessory_packet(packet_t *rx, const uint8_t *data,
+        size_t size, accessory_id_t src)
+{
+    simple_rt_config_t *config = get_simple_rt_config();
+    switch_pair_t *pair;
+    packet_t *pkt = NULL;
+    accessory_id_t dst;
+
+    if (config->switch_policy == SWITCH_POLICY_KERNEL) {
+        return false;
+    }
+
+    /* network, host and broadcast addresses are left to kernel */
+    dst = get_acc_id_from_packet(data, size, true);
+    if (dst <= 1 || dst >= get_network_size() - 1 || dst == src) {
+        return false;
+    }
+
+    pair = get_switch_pair(src, dst);
+
+    if (config->switch_policy == SWITCH_POLICY_DROP) {
+        atomic_fetch_add_explicit(&pair->dropped, 1, memory_order_relaxed);
+        return true;
+    }
+
+    /* no copy, slice keeps rx buffer until peer has sent it */
+    if (rx) {
+        pkt = packet_slice(rx, (uint8_t *) data, size);
+    } else if (size <= packet_buf_size() && (pkt = packet_alloc()) != NULL) {
+        memcpy(pkt->data, data, size);
+        pkt->len = size;
+    }
+
+    if (!pkt || send_accessory_packet(pkt, dst) < 0) {
+        atomic_fetch_add_explicit(&pair->dropped, 1, memory_order_relaxed);
+        return true;
+    }
+
+    atomic_fetch_add_explicit(&pair->packets, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pair->bytes, size, memory_order_relaxed);
+
+    return true;
+}
+
+static void print_switch_pair(const char *name, switch_pair_t *pair)
+{
+    printf("switch: %s: %llu packets, %llu bytes, %llu dropped\n", name,
+            (unsigned long long) atomic_load(&pair->packets),
+            (unsigned long long) atomic_load(&pair->bytes),
+            (unsigned long long) atomic_load(&pair->dropped));
+}
+
+void print_switch_stats(void)
+{
+    char name[32];
+    uint32_t key;
+
+    for (size_t i = 0; i < SWITCH_PAIRS; i++) {
+        if ((key = atomic_load(&g_pairs[i].key)) == 0) {
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "device %u -> %u", key >> 16,
+                key & 0xffff);
+        print_switch_pair(name, &g_pairs[i]);
+    }
+
+    if (atomic_load(&g_other_pairs.packets) ||
+            atomic_load(&g_other_pairs.dropped)) {
+        print_switch_pair("other devices", &g_other_pairs);
+    }
+}
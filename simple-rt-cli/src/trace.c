@@ -0,0 +1,267 @@
+/*
+ * SimpleRT: Reverse tethering utility for Android
+ * Copyright (C) 2016 Konstantin Menyaev
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <libusb.h>
+
+#include "trace.h"
+#include "utils.h"
+
+/* power of two, ~32 KB per thread */
+#define FLIGHT_RECORDER_SIZE 1024
+
+#define FLIGHT_DUMP_PATH "/var/run/simple_rt.trace"
+
+/* error storm writes one dump, not thousands */
+#define FLIGHT_DUMP_INTERVAL_US 1000000
+
+/*
+ * seq is position + 1, stored last: dump skips entries being
+ * overwritten or not written yet.
+ */
+typedef struct flight_entry_t {
+    atomic_uint_least64_t seq;
+    uint64_t ts;
+    uint32_t id;
+    uint32_t len;
+    uint8_t stage;
+} flight_entry_t;
+
+/*
+ * one writer each, so recording takes no shared cache line. recorder
+ * of exited thread keeps its entries for dump until next thread takes it.
+ */
+typedef struct flight_recorder_t {
+    flight_entry_t entries[FLIGHT_RECORDER_SIZE];
+    atomic_uint_least64_t pos;
+    atomic_bool is_taken;
+    struct flight_recorder_t *next;
+} flight_recorder_t;
+
+/* recorders are never freed, list only grows */
+static _Atomic(flight_recorder_t *) g_recorders = NULL;
+
+static _Thread_local flight_recorder_t *g_self = NULL;
+
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_key;
+
+/* set by data path, dump itself is written by main loop */
+static _Atomic(const char *) g_dump_reason = NULL;
+static uint64_t g_last_dump_ts = 0;
+
+#define TRACE_STAGE_NAME(name) #name,
+
+static const char *g_stage_names[] = {
+    TRACE_STAGES(TRACE_STAGE_NAME)
+};
+
+static void release_recorder(void *arg)
+{
+    flight_recorder_t *rec = arg;
+
+    atomic_store_explicit(&rec->is_taken, false, memory_order_release);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&g_key, release_recorder);
+}
+
+static flight_recorder_t *take_recorder(void)
+{
+    flight_recorder_t *rec;
+    bool taken;
+
+    pthread_once(&g_key_once, create_key);
+
+    for (rec = atomic_load(&g_recorders); rec; rec = rec->next) {
+        taken = false;
+        if (atomic_compare_exchange_strong(&rec->is_taken, &taken, true)) {
+            break;
+        }
+    }
+
+    if (!rec) {
+        /* tracing is best effort, thread simply records nothing */
+        if ((rec = calloc(1, sizeof(*rec))) == NULL) {
+            return NULL;
+        }
+
+        atomic_init(&rec->is_taken, true);
+        rec->next = atomic_load(&g_recorders);
+        while (!atomic_compare_exchange_weak(&g_recorders, &rec->next, rec));
+    }
+
+    /* released when thread exits */
+    pthread_setspecific(g_key, rec);
+    g_self = rec;
+
+    return rec;
+}
+
+void flight_record(trace_stage_t stage, uint32_t id, uint32_t len)
+{
+    flight_recorder_t *rec = g_self;
+    uint64_t pos;
+    flight_entry_t *e;
+
+    if (!rec && (rec = take_recorder()) == NULL) {
+        return;
+    }
+
+    pos = atomic_load_explicit(&rec->pos, memory_order_relaxed);
+    e = &rec->entries[pos & (FLIGHT_RECORDER_SIZE - 1)];
+
+    /* entry is torn until seq is published */
+    atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    e->ts = get_time_us();
+    e->id = id;
+    e->len = len;
+    e->stage = stage;
+
+    atomic_store_explicit(&e->seq, pos + 1, memory_order_release);
+    atomic_store_explicit(&rec->pos, pos + 1, memory_order_release);
+}
+
+/* copies whole entries of one recorder, returns new count */
+static size_t collect_entries(flight_recorder_t *rec, flight_entry_t *out,
+        size_t cnt)
+{
+    uint64_t end, pos, seq;
+    flight_entry_t *src, *e;
+
+    end = atomic_load_explicit(&rec->pos, memory_order_acquire);
+    pos = end > FLIGHT_RECORDER_SIZE ? end - FLIGHT_RECORDER_SIZE : 0;
+
+    for (; pos < end; pos++) {
+        src = &rec->entries[pos & (FLIGHT_RECORDER_SIZE - 1)];
+        e = &out[cnt];
+
+        if (atomic_load_explicit(&src->seq, memory_order_acquire) != pos + 1) {
+            continue;
+        }
+
+        e->ts = src->ts;
+        e->id = src->id;
+        e->len = src->len;
+        e->stage = src->stage;
+
+        /* overwritten while copied */
+        atomic_thread_fence(memory_order_acquire);
+        seq = atomic_load_explicit(&src->seq, memory_order_relaxed);
+        if (seq != pos + 1 || e->stage >= TRACE_STAGE_MAX) {
+            continue;
+        }
+
+        cnt++;
+    }
+
+    return cnt;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const flight_entry_t *x = a, *y = b;
+
+    return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+bool flight_dump(const char *reason)
+{
+    FILE *out;
+    uint64_t now = get_time_us();
+    flight_recorder_t *rec;
+    flight_entry_t *entries;
+    size_t recs = 0, cnt = 0, i;
+
+    if (g_last_dump_ts && now - g_last_dump_ts < FLIGHT_DUMP_INTERVAL_US) {
+        return false;
+    }
+
+    g_last_dump_ts = now;
+
+    /* recorders added meanwhile are skipped, list is walked twice */
+    for (rec = atomic_load(&g_recorders); rec; rec = rec->next) {
+        recs++;
+    }
+
+    if ((entries = malloc((recs ? recs : 1) * FLIGHT_RECORDER_SIZE *
+                    sizeof(*entries))) == NULL) {
+        fprintf(stderr, "Unable to allocate flight recorder dump\n");
+        return false;
+    }
+
+    for (rec = atomic_load(&g_recorders), i = 0; rec && i < recs;
+            rec = rec->next, i++) {
+        cnt = collect_entries(rec, entries, cnt);
+    }
+
+    /* merged by time, each thread's entries are in order already */
+    qsort(entries, cnt, sizeof(*entries), compare_entries);
+
+    if ((out = fopen(FLIGHT_DUMP_PATH, "w")) == NULL) {
+        fprintf(stderr, "Unable to write %s: %s\n", FLIGHT_DUMP_PATH,
+                strerror(errno));
+        free(entries);
+        return false;
+    }
+
+    fprintf(out, "# %s, now %llu us\n# ts_us stage id len\n", reason,
+            (unsigned long long) now);
+
+    for (i = 0; i < cnt; i++) {
+        fprintf(out, "%llu %s %u %u\n", (unsigned long long) entries[i].ts,
+                g_stage_names[entries[i].stage], entries[i].id,
+                entries[i].len);
+    }
+
+    fclose(out);
+    free(entries);
+
+    printf("flight recorder: %zu entries written to %s (%s)\n",
+            cnt, FLIGHT_DUMP_PATH, reason);
+
+    return true;
+}
+
+void flight_dump_later(const char *reason)
+{
+    const char *none = NULL;
+
+    /* first reason wins until main loop writes it */
+    if (atomic_compare_exchange_strong(&g_dump_reason, &none, reason)) {
+        libusb_interrupt_event_handler(NULL);
+    }
+}
+
+void handle_flight_dump(void)
+{
+    const char *reason = atomic_exchange(&g_dump_reason, NULL);
+
+    if (reason) {
+        flight_dump(reason);
+    }
+}